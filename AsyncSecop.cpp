@@ -0,0 +1,233 @@
+#include "AsyncSecop.h"
+
+#include <libutils/Exceptions.h>
+#include <libutils/Logger.h>
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace Utils;
+
+namespace OPI
+{
+
+AsyncSecop::AsyncSecop(const string &path): fd(-1)
+{
+	struct sockaddr_un addr = {};
+
+	if( path.size() >= sizeof(addr.sun_path) )
+	{
+		throw runtime_error("Secop socket path too long");
+	}
+
+	addr.sun_family = AF_UNIX;
+	memcpy( addr.sun_path, path.c_str(), path.size() );
+
+	if( ( this->fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 ) ) < 0 )
+	{
+		throw ErrnoException("Failed to create secop socket");
+	}
+
+	// Local connect doesn't wait on anything, switch to non blocking after
+	if( connect( this->fd, reinterpret_cast<struct sockaddr*>( &addr ), sizeof(addr) ) < 0 ||
+			fcntl( this->fd, F_SETFL, fcntl( this->fd, F_GETFL ) | O_NONBLOCK ) < 0 )
+	{
+		close( this->fd );
+		this->fd = -1;
+		throw ErrnoException("Failed to connect to secop at '" + path + "'");
+	}
+}
+
+int AsyncSecop::GetFd()
+{
+	return this->fd;
+}
+
+bool AsyncSecop::WantWrite()
+{
+	return ! this->wbuf.empty();
+}
+
+int AsyncSecop::Call(json cmd, Secop::ReplyCallback cb)
+{
+	bool idle = this->wbuf.empty();
+
+	int t = this->replies.Add( cmd, std::move( cb ), this->wbuf );
+
+	// Try to send right away, rest is sent when socket is writable
+	if( idle )
+	{
+		this->OnWritable();
+	}
+
+	return t;
+}
+
+void AsyncSecop::SockAuth(function<void (bool)> cb)
+{
+	json cmd;
+
+	cmd["cmd"]= "auth";
+	cmd["type"]="socket";
+
+	this->Call( cmd, [cb](const json& rep)
+	{
+		cb( Secop::Replies::CheckReply( rep ) );
+	});
+}
+
+void AsyncSecop::HasACL(const string &user, const string &service, const string &acl, function<void (bool, bool)> cb)
+{
+	json cmd;
+
+	cmd["cmd"]			= "hasacl";
+	cmd["username"]		= user;
+	cmd["servicename"]	= service;
+	cmd["acl"]			= acl;
+
+	this->Call( cmd, [cb](const json& rep)
+	{
+		bool ok = Secop::Replies::CheckReply( rep ) && rep.contains("hasacl") && rep["hasacl"].is_boolean();
+		cb( ok, ok && rep["hasacl"].get<bool>() );
+	});
+}
+
+void AsyncSecop::GetUserGroups(const string &user, function<void (bool, const vector<string> &)> cb)
+{
+	json cmd;
+
+	cmd["cmd"]		= "getusergroups";
+	cmd["username"]	= user;
+
+	this->Call( cmd, [cb](const json& rep)
+	{
+		vector<string> groups;
+		bool ok = Secop::Replies::CheckReply( rep );
+
+		if( ok && rep.contains("groups") && rep["groups"].is_array() )
+		{
+			for(const auto& x: rep["groups"])
+			{
+				if( x.is_string() )
+				{
+					groups.push_back( x );
+				}
+			}
+		}
+		cb( ok, groups );
+	});
+}
+
+void AsyncSecop::GetAttribute(const string &user, const string &attr, function<void (bool, const string &)> cb)
+{
+	json cmd;
+
+	cmd["cmd"]		= "getattribute";
+	cmd["username"]	= user;
+	cmd["attribute"] = attr;
+
+	this->Call( cmd, [cb](const json& rep)
+	{
+		bool ok = Secop::Replies::CheckReply( rep ) && rep.contains("attribute") && rep["attribute"].is_string();
+		cb( ok, ok ? rep["attribute"].get<string>() : "" );
+	});
+}
+
+bool AsyncSecop::OnReadable()
+{
+	while( true )
+	{
+		size_t avail = 0;
+		char* buf = this->replies.WritePtr( avail );
+
+		ssize_t rd = read( this->fd, buf, avail );
+
+		if( rd < 0 && errno == EINTR )
+		{
+			continue;
+		}
+
+		if( rd < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+		{
+			return true;
+		}
+
+		if( rd <= 0 )
+		{
+			logg << Logger::Error << "Failed to read response from secop" << lend;
+			this->Fail();
+			return false;
+		}
+
+		this->replies.Commit( rd );
+
+		// Don't let a failing callback unwind the event loop with
+		// further replies left undispatched
+		bool more = true;
+		while( more )
+		{
+			try
+			{
+				more = this->replies.DispatchNext();
+			}
+			catch( std::exception& err )
+			{
+				logg << Logger::Error << "AsyncSecop: reply callback failed: " << err.what() << lend;
+			}
+		}
+	}
+}
+
+bool AsyncSecop::OnWritable()
+{
+	while( ! this->wbuf.empty() )
+	{
+		ssize_t wr = send( this->fd, this->wbuf.data(), this->wbuf.size(), MSG_NOSIGNAL );
+
+		if( wr < 0 && errno == EINTR )
+		{
+			continue;
+		}
+
+		if( wr < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+		{
+			return true;
+		}
+
+		if( wr < 0 )
+		{
+			logg << Logger::Error << "Failed to write request to secop" << lend;
+			this->Fail();
+			return false;
+		}
+
+		this->wbuf.erase( 0, wr );
+	}
+
+	return true;
+}
+
+size_t AsyncSecop::Outstanding() const
+{
+	return this->replies.Outstanding();
+}
+
+AsyncSecop::~AsyncSecop()
+{
+	if( this->fd >= 0 )
+	{
+		close( this->fd );
+	}
+}
+
+void AsyncSecop::Fail()
+{
+	this->wbuf.clear();
+	this->replies.Fail();
+}
+
+} // End NS
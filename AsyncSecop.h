@@ -0,0 +1,65 @@
+#ifndef ASYNCSECOP_H
+#define ASYNCSECOP_H
+
+#include "Secop.h"
+
+#include <libutils/ClassTools.h>
+
+#include <functional>
+#include <map>
+#include <string>
+
+using namespace std;
+
+namespace OPI
+{
+
+/*
+ * Non blocking secop client for use in an event loop.
+ *
+ * Commands are queued and replies delivered to callbacks, nothing blocks.
+ * Register the descriptor from GetFd for reading, and for writing as
+ * long as WantWrite returns true, and call OnReadable/OnWritable when
+ * the loop reports the descriptor ready.
+ */
+class AsyncSecop: public Utils::NoCopy
+{
+public:
+	AsyncSecop(const string& path = "/tmp/secop");
+
+	int GetFd();
+
+	// True if queued data is waiting for socket to become writable
+	bool WantWrite();
+
+	// Queue command, returns tid. Callback gets an empty reply on failure
+	int Call(json cmd, Secop::ReplyCallback cb);
+
+	void SockAuth(function<void(bool ok)> cb);
+	void HasACL(const string& user, const string& service, const string& acl,
+				function<void(bool ok, bool hasacl)> cb);
+	void GetUserGroups(const string& user, function<void(bool ok, const vector<string>& groups)> cb);
+	void GetAttribute(const string& user, const string& attr,
+					  function<void(bool ok, const string& value)> cb);
+
+	// Read and dispatch available replies, false if connection closed
+	bool OnReadable();
+
+	// Send queued data, false on failure
+	bool OnWritable();
+
+	// Number of commands not yet answered
+	size_t Outstanding() const;
+
+	virtual ~AsyncSecop();
+private:
+	void Fail();
+
+	int fd;
+	string wbuf;
+	Secop::Replies replies;
+};
+
+} // End NS
+
+#endif // ASYNCSECOP_H
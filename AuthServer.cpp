@@ -3,10 +3,11 @@
 #include <stdexcept>
 #include <utility>
 
-#include <libutils/FileUtils.h>
 #include <libutils/HttpStatusCodes.h>
+#include <libutils/Logger.h>
 
 using namespace std;
+using namespace Utils;
 using namespace Utils::HTTP;
 namespace OPI
 {
@@ -162,19 +163,7 @@ tuple<int, json> AuthServer::GetCertificate(const string &csr, const string &tok
 
 	this->CurlSetHeaders(headers);
 
-	json retobj;
-	string body = this->DoPost("get_cert.php", postargs);
-	try
-	{
-		retobj = json::parse(body);
-	}
-	catch (json::parse_error& err)
-	{
-		(void)err;
-		//TODO: log error
-	}
-
-	return tuple<int,json>(this->result_code, retobj );
+	return this->PostJson("get_cert.php", postargs);
 }
 
 tuple<int, json> AuthServer::UpdateMXPointer(bool useopi, const string &token)
@@ -190,20 +179,7 @@ tuple<int, json> AuthServer::UpdateMXPointer(bool useopi, const string &token)
 
 	this->CurlSetHeaders(headers);
 
-	json retobj;
-	string body = this->DoPost("update_mx.php", postargs);
-
-	try
-	{
-		retobj = json::parse(body);
-	}
-	catch (json::parse_error& err)
-	{
-		(void) err;
-		//TODO: log error
-	}
-
-	return tuple<int,json>(this->result_code, retobj );
+	return this->PostJson("update_mx.php", postargs);
 }
 
 tuple<int, json> AuthServer::CheckMXPointer(const string &name)
@@ -214,21 +190,18 @@ tuple<int, json> AuthServer::CheckMXPointer(const string &name)
 		{"type", "MX" }
 	};
 
-	json retobj;
-	string body = this->DoPost("update_mx.php", postargs);
-
-	try
-	{
-		retobj = json::parse(body);
-	}
-	catch (json::parse_error& err)
-	{
-		(void) err;
-		//TODO: log error
+	return this->PostJson("update_mx.php", postargs);
+}
 
-	}
+HttpMulti::Handle<tuple<int, json>> AuthServer::CheckMXPointerAsync(const string &name, long timeout)
+{
+	map<string,string> postargs = {
+		{"fqdn", name },
+		{"test_mx", "1" },
+		{"type", "MX" }
+	};
 
-	return tuple<int,json>(this->result_code, retobj );
+	return this->PostJsonAsync("update_mx.php", postargs, timeout);
 }
 
 void AuthServer::Setup()
@@ -251,15 +224,15 @@ void AuthServer::Setup()
 	{
 		s.AppAddID("op-backend");
 
-		RSAWrapper ob;
-		ob.GenerateKeys();
+		// Use a pregenerated key if available, generation is slow
+		RSAWrapperPtr ob = RSAKeyPool::Take();
 
 		// Write to secop
 		map<string,string> data;
 
 		data["type"] = "backendkeys";
-		data["pubkey"] = Base64Encode(ob.GetPubKeyAsDER());
-		data["privkey"] = Base64Encode(ob.GetPrivKeyAsDER());
+		data["pubkey"] = Base64Encode(ob->GetPubKeyAsDER());
+		data["privkey"] = Base64Encode(ob->GetPrivKeyAsDER());
 		s.AppAddIdentifier("op-backend", data);
 	}
 
@@ -285,10 +258,18 @@ RSAWrapperPtr AuthServer::GetKeysFromSecop()
 		{
 			if( id["type"] == "backendkeys" )
 			{
-				c = RSAWrapperPtr(new RSAWrapper);
-				// Key found
-				c->LoadPrivKeyFromDER( CryptoHelper::Base64Decode( id["privkey"]) );
-				c->LoadPubKeyFromDER( CryptoHelper::Base64Decode( id["pubkey"]) );
+				// Key found, only parse and validate if changed since last time
+				const string& privkey = id["privkey"];
+				const string& pubkey = id["pubkey"];
+
+				c = RSAKeyCache::Get( "secop:op-backend", RSAKeyCache::Fingerprint( privkey + pubkey ),
+					[&privkey, &pubkey]()
+				{
+					RSAWrapperPtr k( new RSAWrapper );
+					k->LoadPrivKeyFromDER( CryptoHelper::Base64Decode( privkey ) );
+					k->LoadPubKeyFromDER( CryptoHelper::Base64Decode( pubkey ) );
+					return k;
+				});
 				break;
 			}
 		}
@@ -299,15 +280,7 @@ RSAWrapperPtr AuthServer::GetKeysFromSecop()
 
 RSAWrapperPtr AuthServer::GetKeysFromFile(const string &pubpath, const string &privpath)
 {
-	CryptoHelper::RSAWrapperPtr c( new RSAWrapper );
-
-	string pub_pem = Utils::File::GetContentAsString( pubpath, true );
-	string priv_pem = Utils::File::GetContentAsString( privpath, true );
-
-	c->LoadPubKeyFromPEM( pub_pem );
-	c->LoadPrivKeyFromPEM( priv_pem );
-
-	return c;
+	return RSAKeyCache::FromPEMFiles( privpath, pubpath );
 }
 
 AuthServer::~AuthServer() = default;
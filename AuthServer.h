@@ -1,6 +1,7 @@
 #ifndef AUTHSERVER_H
 #define AUTHSERVER_H
 
+#include <future>
 #include <string>
 #include <tuple>
 
@@ -53,6 +54,12 @@ public:
 
 	tuple<int, json> CheckMXPointer(const string& name);
 
+	/*
+	 * Non blocking CheckMXPointer, result is delivered through the
+	 * future of the returned handle. Timeout in ms, 0 for none.
+	 */
+	HttpMulti::Handle<tuple<int, json>> CheckMXPointerAsync(const string& name, long timeout = 0);
+
 	/**
 	 * @brief Setup, create keys and register in Secop if needed
 	 */
@@ -0,0 +1,571 @@
+#include "Base64.h"
+
+#include <stdexcept>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BASE64_X86 1
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define BASE64_NEON 1
+#endif
+
+namespace OPI {
+namespace Base64 {
+
+static const char enctable[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Maps character to 6 bit value, 0x80 for characters outside alphabet
+static const struct DecTable
+{
+	uint8_t v[256];
+
+	DecTable()
+	{
+		memset( this->v, 0x80, sizeof( this->v ) );
+		for( uint8_t i = 0; i < 64; i++ )
+		{
+			this->v[ (uint8_t) enctable[i] ] = i;
+		}
+	}
+} dectable;
+
+/*
+ * Vector implementations process as many complete blocks as possible
+ * and return number of input bytes consumed, leaving the tail to the
+ * scalar code. Decoders stop at the first block with a character
+ * outside the alphabet.
+ */
+typedef size_t (*EncodeFn)(const uint8_t* in, size_t len, char* out);
+typedef size_t (*DecodeFn)(const char* in, size_t len, uint8_t* out);
+
+struct Impl
+{
+	const char*	name;
+	EncodeFn	encode;
+	DecodeFn	decode;
+};
+
+#ifdef BASE64_X86
+
+/*
+ * Translation of 6 bit indices to ascii, and back with validation,
+ * follows W. Mula and D. Lemire, "Faster Base64 Encoding and Decoding
+ * Using AVX2 Instructions"
+ */
+
+__attribute__((target("ssse3")))
+static inline __m128i sse_unpack(__m128i in)
+{
+	in = _mm_shuffle_epi8( in, _mm_setr_epi8( 1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10 ) );
+
+	const __m128i t0 = _mm_and_si128( in, _mm_set1_epi32( 0x0fc0fc00 ) );
+	const __m128i t1 = _mm_mulhi_epu16( t0, _mm_set1_epi32( 0x04000040 ) );
+	const __m128i t2 = _mm_and_si128( in, _mm_set1_epi32( 0x003f03f0 ) );
+	const __m128i t3 = _mm_mullo_epi16( t2, _mm_set1_epi32( 0x01000010 ) );
+
+	return _mm_or_si128( t1, t3 );
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i sse_translate(__m128i idx)
+{
+	const __m128i shift = _mm_setr_epi8(
+				'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+				'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+				'/' - 63, 'A', 0, 0 );
+
+	__m128i res = _mm_subs_epu8( idx, _mm_set1_epi8( 51 ) );
+	const __m128i less = _mm_cmpgt_epi8( _mm_set1_epi8( 26 ), idx );
+	res = _mm_or_si128( res, _mm_and_si128( less, _mm_set1_epi8( 13 ) ) );
+
+	return _mm_add_epi8( _mm_shuffle_epi8( shift, res ), idx );
+}
+
+__attribute__((target("ssse3")))
+static size_t encode_ssse3(const uint8_t* in, size_t len, char* out)
+{
+	size_t i = 0;
+
+	// Reads 16 bytes, uses 12
+	for( ; len - i >= 16; i += 12, out += 16 )
+	{
+		__m128i v = _mm_loadu_si128( (const __m128i*)( in + i ) );
+		_mm_storeu_si128( (__m128i*) out, sse_translate( sse_unpack( v ) ) );
+	}
+
+	return i;
+}
+
+__attribute__((target("ssse3")))
+static size_t decode_ssse3(const char* in, size_t len, uint8_t* out)
+{
+	const __m128i lut_lo = _mm_setr_epi8(
+				0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+				0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a );
+	const __m128i lut_hi = _mm_setr_epi8(
+				0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+				0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10 );
+	const __m128i lut_roll = _mm_setr_epi8(
+				0, 16, 19, 4, -65, -65, -71, -71,
+				0, 0, 0, 0, 0, 0, 0, 0 );
+	const __m128i mask_0f = _mm_set1_epi8( 0x0f );
+	const __m128i slash = _mm_set1_epi8( '/' );
+
+	size_t i = 0;
+
+	// Reads 16 characters, writes 16 bytes of which 12 are valid
+	for( ; len - i >= 24; i += 16, out += 12 )
+	{
+		__m128i v = _mm_loadu_si128( (const __m128i*)( in + i ) );
+
+		const __m128i hi_nib = _mm_and_si128( _mm_srli_epi32( v, 4 ), mask_0f );
+		const __m128i lo_nib = _mm_and_si128( v, mask_0f );
+		const __m128i lo = _mm_shuffle_epi8( lut_lo, lo_nib );
+		const __m128i hi = _mm_shuffle_epi8( lut_hi, hi_nib );
+
+		if( _mm_movemask_epi8( _mm_cmpeq_epi8( _mm_and_si128( lo, hi ), _mm_setzero_si128() ) ) != 0xffff )
+		{
+			break;
+		}
+
+		const __m128i eq_slash = _mm_cmpeq_epi8( v, slash );
+		const __m128i roll = _mm_shuffle_epi8( lut_roll, _mm_add_epi8( eq_slash, hi_nib ) );
+		v = _mm_add_epi8( v, roll );
+
+		v = _mm_maddubs_epi16( v, _mm_set1_epi32( 0x01400140 ) );
+		v = _mm_madd_epi16( v, _mm_set1_epi32( 0x00011000 ) );
+		v = _mm_shuffle_epi8( v, _mm_setr_epi8( 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1 ) );
+
+		_mm_storeu_si128( (__m128i*) out, v );
+	}
+
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t encode_avx2(const uint8_t* in, size_t len, char* out)
+{
+	const __m256i shuf = _mm256_setr_epi8(
+				1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+				1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10 );
+	const __m256i shift = _mm256_setr_epi8(
+				'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+				'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+				'/' - 63, 'A', 0, 0,
+				'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+				'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+				'/' - 63, 'A', 0, 0 );
+
+	size_t i = 0;
+
+	// Reads 12 bytes into each lane, last load extends 4 bytes past
+	for( ; len - i >= 32; i += 24, out += 32 )
+	{
+		__m256i v = _mm256_inserti128_si256(
+					_mm256_castsi128_si256( _mm_loadu_si128( (const __m128i*)( in + i ) ) ),
+					_mm_loadu_si128( (const __m128i*)( in + i + 12 ) ), 1 );
+
+		v = _mm256_shuffle_epi8( v, shuf );
+
+		const __m256i t0 = _mm256_and_si256( v, _mm256_set1_epi32( 0x0fc0fc00 ) );
+		const __m256i t1 = _mm256_mulhi_epu16( t0, _mm256_set1_epi32( 0x04000040 ) );
+		const __m256i t2 = _mm256_and_si256( v, _mm256_set1_epi32( 0x003f03f0 ) );
+		const __m256i t3 = _mm256_mullo_epi16( t2, _mm256_set1_epi32( 0x01000010 ) );
+		const __m256i idx = _mm256_or_si256( t1, t3 );
+
+		__m256i res = _mm256_subs_epu8( idx, _mm256_set1_epi8( 51 ) );
+		const __m256i less = _mm256_cmpgt_epi8( _mm256_set1_epi8( 26 ), idx );
+		res = _mm256_or_si256( res, _mm256_and_si256( less, _mm256_set1_epi8( 13 ) ) );
+		res = _mm256_add_epi8( _mm256_shuffle_epi8( shift, res ), idx );
+
+		_mm256_storeu_si256( (__m256i*) out, res );
+	}
+
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t decode_avx2(const char* in, size_t len, uint8_t* out)
+{
+	const __m256i lut_lo = _mm256_setr_epi8(
+				0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+				0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+				0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+				0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a );
+	const __m256i lut_hi = _mm256_setr_epi8(
+				0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+				0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+				0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+				0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10 );
+	const __m256i lut_roll = _mm256_setr_epi8(
+				0, 16, 19, 4, -65, -65, -71, -71,
+				0, 0, 0, 0, 0, 0, 0, 0,
+				0, 16, 19, 4, -65, -65, -71, -71,
+				0, 0, 0, 0, 0, 0, 0, 0 );
+	const __m256i pack = _mm256_setr_epi8(
+				2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+				2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1 );
+	const __m256i mask_0f = _mm256_set1_epi8( 0x0f );
+	const __m256i slash = _mm256_set1_epi8( '/' );
+
+	size_t i = 0;
+
+	// Reads 32 characters, writes 32 bytes of which 24 are valid
+	for( ; len - i >= 44; i += 32, out += 24 )
+	{
+		__m256i v = _mm256_loadu_si256( (const __m256i*)( in + i ) );
+
+		const __m256i hi_nib = _mm256_and_si256( _mm256_srli_epi32( v, 4 ), mask_0f );
+		const __m256i lo_nib = _mm256_and_si256( v, mask_0f );
+		const __m256i lo = _mm256_shuffle_epi8( lut_lo, lo_nib );
+		const __m256i hi = _mm256_shuffle_epi8( lut_hi, hi_nib );
+
+		if( ! _mm256_testz_si256( lo, hi ) )
+		{
+			break;
+		}
+
+		const __m256i eq_slash = _mm256_cmpeq_epi8( v, slash );
+		const __m256i roll = _mm256_shuffle_epi8( lut_roll, _mm256_add_epi8( eq_slash, hi_nib ) );
+		v = _mm256_add_epi8( v, roll );
+
+		v = _mm256_maddubs_epi16( v, _mm256_set1_epi32( 0x01400140 ) );
+		v = _mm256_madd_epi16( v, _mm256_set1_epi32( 0x00011000 ) );
+		v = _mm256_shuffle_epi8( v, pack );
+		v = _mm256_permutevar8x32_epi32( v, _mm256_setr_epi32( 0, 1, 2, 4, 5, 6, 3, 7 ) );
+
+		_mm256_storeu_si256( (__m256i*) out, v );
+	}
+
+	return i;
+}
+
+#endif // BASE64_X86
+
+#ifdef BASE64_NEON
+
+static size_t encode_neon(const uint8_t* in, size_t len, char* out)
+{
+	static const uint8_t shift_lut[16] = {
+		uint8_t( 'a' - 26 ), uint8_t( '0' - 52 ), uint8_t( '0' - 52 ), uint8_t( '0' - 52 ),
+		uint8_t( '0' - 52 ), uint8_t( '0' - 52 ), uint8_t( '0' - 52 ), uint8_t( '0' - 52 ),
+		uint8_t( '0' - 52 ), uint8_t( '0' - 52 ), uint8_t( '0' - 52 ), uint8_t( '+' - 62 ),
+		uint8_t( '/' - 63 ), uint8_t( 'A' ), 0, 0
+	};
+	const uint8x8x2_t shift = { { vld1_u8( shift_lut ), vld1_u8( shift_lut + 8 ) } };
+	const uint8x8_t v51 = vdup_n_u8( 51 );
+	const uint8x8_t v26 = vdup_n_u8( 26 );
+	const uint8x8_t v13 = vdup_n_u8( 13 );
+	const uint8x8_t v3f = vdup_n_u8( 0x3f );
+
+	size_t i = 0;
+
+	for( ; len - i >= 24; i += 24, out += 32 )
+	{
+		uint8x8x3_t s = vld3_u8( in + i );
+		uint8x8x4_t d;
+
+		d.val[0] = vshr_n_u8( s.val[0], 2 );
+		d.val[1] = vand_u8( vorr_u8( vshl_n_u8( s.val[0], 4 ), vshr_n_u8( s.val[1], 4 ) ), v3f );
+		d.val[2] = vand_u8( vorr_u8( vshl_n_u8( s.val[1], 2 ), vshr_n_u8( s.val[2], 6 ) ), v3f );
+		d.val[3] = vand_u8( s.val[2], v3f );
+
+		for( int j = 0; j < 4; j++ )
+		{
+			uint8x8_t res = vqsub_u8( d.val[j], v51 );
+			res = vorr_u8( res, vand_u8( vclt_u8( d.val[j], v26 ), v13 ) );
+			d.val[j] = vadd_u8( vtbl2_u8( shift, res ), d.val[j] );
+		}
+
+		vst4_u8( (uint8_t*) out, d );
+	}
+
+	return i;
+}
+
+static inline uint8x8_t neon_decode_lane(uint8x8_t c, uint8x8_t& invalid)
+{
+	const uint8x8_t upper = vand_u8( vcge_u8( c, vdup_n_u8( 'A' ) ), vcle_u8( c, vdup_n_u8( 'Z' ) ) );
+	const uint8x8_t lower = vand_u8( vcge_u8( c, vdup_n_u8( 'a' ) ), vcle_u8( c, vdup_n_u8( 'z' ) ) );
+	const uint8x8_t digit = vand_u8( vcge_u8( c, vdup_n_u8( '0' ) ), vcle_u8( c, vdup_n_u8( '9' ) ) );
+	const uint8x8_t plus = vceq_u8( c, vdup_n_u8( '+' ) );
+	const uint8x8_t slash = vceq_u8( c, vdup_n_u8( '/' ) );
+
+	uint8x8_t v = vand_u8( upper, vsub_u8( c, vdup_n_u8( 'A' ) ) );
+	v = vorr_u8( v, vand_u8( lower, vsub_u8( c, vdup_n_u8( 'a' - 26 ) ) ) );
+	v = vorr_u8( v, vand_u8( digit, vadd_u8( c, vdup_n_u8( 52 - '0' ) ) ) );
+	v = vorr_u8( v, vand_u8( plus, vdup_n_u8( 62 ) ) );
+	v = vorr_u8( v, vand_u8( slash, vdup_n_u8( 63 ) ) );
+
+	const uint8x8_t valid = vorr_u8( vorr_u8( upper, lower ), vorr_u8( digit, vorr_u8( plus, slash ) ) );
+	invalid = vorr_u8( invalid, vmvn_u8( valid ) );
+
+	return v;
+}
+
+static size_t decode_neon(const char* in, size_t len, uint8_t* out)
+{
+	size_t i = 0;
+
+	for( ; len - i >= 32; i += 32, out += 24 )
+	{
+		uint8x8x4_t s = vld4_u8( (const uint8_t*)( in + i ) );
+		uint8x8_t invalid = vdup_n_u8( 0 );
+
+		for( int j = 0; j < 4; j++ )
+		{
+			s.val[j] = neon_decode_lane( s.val[j], invalid );
+		}
+
+		if( vget_lane_u64( vreinterpret_u64_u8( invalid ), 0 ) != 0 )
+		{
+			break;
+		}
+
+		uint8x8x3_t d;
+		d.val[0] = vorr_u8( vshl_n_u8( s.val[0], 2 ), vshr_n_u8( s.val[1], 4 ) );
+		d.val[1] = vorr_u8( vshl_n_u8( s.val[1], 4 ), vshr_n_u8( s.val[2], 2 ) );
+		d.val[2] = vorr_u8( vshl_n_u8( s.val[2], 6 ), s.val[3] );
+
+		vst3_u8( out, d );
+	}
+
+	return i;
+}
+
+#endif // BASE64_NEON
+
+static Impl select_impl()
+{
+#ifdef BASE64_X86
+	__builtin_cpu_init();
+	if( __builtin_cpu_supports( "avx2" ) )
+	{
+		return { "avx2", encode_avx2, decode_avx2 };
+	}
+	if( __builtin_cpu_supports( "ssse3" ) )
+	{
+		return { "ssse3", encode_ssse3, decode_ssse3 };
+	}
+#endif
+#ifdef BASE64_NEON
+	return { "neon", encode_neon, decode_neon };
+#endif
+	return { "scalar", nullptr, nullptr };
+}
+
+static bool forcescalar = false;
+
+static const Impl& active()
+{
+	static const Impl simd = select_impl();
+	static const Impl scalar = { "scalar", nullptr, nullptr };
+
+	return forcescalar ? scalar : simd;
+}
+
+/*
+ * Decode complete quads until one containing a character outside the
+ * alphabet. Returns bytes written and sets used to characters consumed.
+ */
+static size_t decode_quads(const char* in, size_t len, uint8_t* out, size_t& used)
+{
+	const uint8_t* dt = dectable.v;
+	const uint8_t* s = (const uint8_t*) in;
+	size_t i = 0, o = 0;
+
+	if( active().decode )
+	{
+		i = active().decode( in, len, out );
+		o = i / 4 * 3;
+	}
+
+	for( ; len - i >= 4; i += 4, o += 3 )
+	{
+		uint8_t a = dt[ s[i] ], b = dt[ s[i+1] ], c = dt[ s[i+2] ], d = dt[ s[i+3] ];
+
+		if( ( a | b | c | d ) & 0x80 )
+		{
+			break;
+		}
+
+		out[o]		= ( a << 2 ) | ( b >> 4 );
+		out[o+1]	= ( b << 4 ) | ( c >> 2 );
+		out[o+2]	= ( c << 6 ) | d;
+	}
+
+	used = i;
+	return o;
+}
+
+static size_t decode_strict(const char* in, size_t len, uint8_t* out)
+{
+	if( len % 4 != 0 )
+	{
+		throw runtime_error("Base64: invalid input length");
+	}
+
+	if( len == 0 )
+	{
+		return 0;
+	}
+
+	size_t pad = in[len-1] == '=' ? ( in[len-2] == '=' ? 2 : 1 ) : 0;
+	size_t body = pad > 0 ? len - 4 : len;
+
+	size_t used;
+	size_t o = decode_quads( in, body, out, used );
+
+	if( used != body )
+	{
+		throw runtime_error("Base64: invalid character in input");
+	}
+
+	if( pad > 0 )
+	{
+		const uint8_t* dt = dectable.v;
+		const uint8_t* s = (const uint8_t*) in + body;
+		uint8_t a = dt[ s[0] ], b = dt[ s[1] ], c = pad == 1 ? dt[ s[2] ] : 0;
+
+		// Unused trailing bits must be zero for canonical encoding
+		if( ( a | b | c ) & 0x80 || ( pad == 2 && ( b & 0x0f ) ) || ( pad == 1 && ( c & 0x03 ) ) )
+		{
+			throw runtime_error("Base64: invalid padding");
+		}
+
+		out[o++] = ( a << 2 ) | ( b >> 4 );
+		if( pad == 1 )
+		{
+			out[o++] = ( b << 4 ) | ( c >> 2 );
+		}
+	}
+
+	return o;
+}
+
+static size_t decode_lenient(const char* in, size_t len, uint8_t* out)
+{
+	const uint8_t* dt = dectable.v;
+	size_t i = 0, o = 0;
+	uint32_t acc = 0;
+	int n = 0;
+
+	while( i < len )
+	{
+		if( n == 0 )
+		{
+			// Take fast path on clean runs, ie between line breaks
+			size_t used;
+			o += decode_quads( in + i, len - i, out + o, used );
+			i += used;
+			if( i >= len )
+			{
+				break;
+			}
+		}
+
+		char ch = in[i++];
+		if( ch == '=' )
+		{
+			break;
+		}
+
+		uint8_t v = dt[ (uint8_t) ch ];
+		if( v & 0x80 )
+		{
+			continue;
+		}
+
+		acc = ( acc << 6 ) | v;
+		if( ++n == 4 )
+		{
+			out[o++] = acc >> 16;
+			out[o++] = acc >> 8;
+			out[o++] = acc;
+			acc = 0;
+			n = 0;
+		}
+	}
+
+	// Trailing partial quad, a single character carries no full byte
+	if( n == 2 )
+	{
+		out[o++] = acc >> 4;
+	}
+	else if( n == 3 )
+	{
+		out[o++] = acc >> 10;
+		out[o++] = acc >> 2;
+	}
+
+	return o;
+}
+
+size_t EncodedLength(size_t len)
+{
+	return ( len + 2 ) / 3 * 4;
+}
+
+size_t DecodedMaxLength(size_t len)
+{
+	return ( len + 3 ) / 4 * 3;
+}
+
+size_t Encode(const uint8_t* in, size_t len, char* out)
+{
+	size_t i = 0, o = 0;
+
+	if( active().encode )
+	{
+		i = active().encode( in, len, out );
+		o = i / 3 * 4;
+	}
+
+	for( ; len - i >= 3; i += 3, o += 4 )
+	{
+		uint32_t v = ( in[i] << 16 ) | ( in[i+1] << 8 ) | in[i+2];
+
+		out[o]		= enctable[ ( v >> 18 ) & 0x3f ];
+		out[o+1]	= enctable[ ( v >> 12 ) & 0x3f ];
+		out[o+2]	= enctable[ ( v >> 6 ) & 0x3f ];
+		out[o+3]	= enctable[ v & 0x3f ];
+	}
+
+	if( len - i == 1 )
+	{
+		out[o++] = enctable[ in[i] >> 2 ];
+		out[o++] = enctable[ ( in[i] & 0x03 ) << 4 ];
+		out[o++] = '=';
+		out[o++] = '=';
+	}
+	else if( len - i == 2 )
+	{
+		out[o++] = enctable[ in[i] >> 2 ];
+		out[o++] = enctable[ ( ( in[i] & 0x03 ) << 4 ) | ( in[i+1] >> 4 ) ];
+		out[o++] = enctable[ ( in[i+1] & 0x0f ) << 2 ];
+		out[o++] = '=';
+	}
+
+	return o;
+}
+
+size_t Decode(const char* in, size_t len, uint8_t* out, Mode mode)
+{
+	return mode == Strict ? decode_strict( in, len, out ) : decode_lenient( in, len, out );
+}
+
+string Backend()
+{
+	return active().name;
+}
+
+void ForceScalar(bool scalar)
+{
+	forcescalar = scalar;
+}
+
+} // Namespace Base64
+} // Namespace OPI
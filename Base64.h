@@ -0,0 +1,51 @@
+#ifndef BASE64_H
+#define BASE64_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+namespace OPI {
+
+/*
+ *
+ * Vectorized Base64 codec (RFC 4648 standard alphabet)
+ *
+ * Uses AVX2 or SSSE3 on x86, selected at runtime, NEON on ARM when
+ * built for it and a table driven scalar version otherwise.
+ *
+ */
+
+namespace Base64 {
+
+enum Mode
+{
+	Strict,		// Padded, canonical input only, no whitespace
+	Lenient		// Skip characters outside alphabet, stop at first '='
+};
+
+// Output size of Encode for len bytes
+size_t EncodedLength(size_t len);
+
+// Upper bound of Decode output for len characters
+size_t DecodedMaxLength(size_t len);
+
+// Out must hold EncodedLength(len) bytes, returns bytes written
+size_t Encode(const uint8_t* in, size_t len, char* out);
+
+// Out must hold DecodedMaxLength(len) bytes, returns bytes written.
+// Throws on invalid input in strict mode.
+size_t Decode(const char* in, size_t len, uint8_t* out, Mode mode = Strict);
+
+// Name of the implementation in use, "avx2", "ssse3", "neon" or "scalar"
+string Backend();
+
+// Force scalar implementation, for testing and benchmarks
+void ForceScalar(bool scalar);
+
+} // Namespace Base64
+} // Namespace OPI
+
+#endif // BASE64_H
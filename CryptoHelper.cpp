@@ -1,4 +1,6 @@
 #include "CryptoHelper.h"
+#include "SysInfo.h"
+#include "X509Helper.h"
 
 #include <crypto++/pwdbased.h>
 #include <crypto++/secblock.h>
@@ -6,16 +8,39 @@
 #include <crypto++/files.h>
 #include <crypto++/pssr.h>
 #include <crypto++/sha.h>
+#include <crypto++/hmac.h>
+#include <crypto++/gcm.h>
+#include <crypto++/aes.h>
+#include <crypto++/cpu.h>
+#include <crypto++/nbtheory.h>
+#include <crypto++/misc.h>
+
+// ChaCha20-Poly1305 arrived in Crypto++ 8.1
+#if CRYPTOPP_VERSION >= 810
+#include <crypto++/chachapoly.h>
+#define HAVE_CHACHAPOLY 1
+#endif
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <cstring>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
 
+#include <libutils/Exceptions.h>
+#include <libutils/FileUtils.h>
 #include <libutils/Logger.h>
 #include <libutils/String.h>
-#include <libutils/Process.h>
 
 using namespace std;
 using namespace CryptoPP;
@@ -41,11 +66,124 @@ void RSAWrapper::GenerateKeys(unsigned int size)
 	InvertibleRSAFunction params;
 	params.GenerateRandomWithKeySize( this->rng, size);
 
+	this->SetKeys( params );
+}
+
+/*
+ * Primes are picked the way Crypto++ does, a random start with the two
+ * top bits set followed by a sieved search over a short window. Doing
+ * the windows ourselves lets us report progress and check for
+ * cancellation in between. A window holds a prime with fair odds,
+ * every miss moves progress half the way closer to the end of its span.
+ */
+
+class RSAPrimeSelector: public PrimeSelector
+{
+public:
+	RSAPrimeSelector(const Integer& e): e(e) {}
+
+	bool IsAcceptable(const Integer &candidate) const override
+	{
+		return RelativelyPrime( this->e, candidate - 1 );
+	}
+private:
+	Integer e;
+};
+
+static Integer rsa_prime(RandomNumberGenerator& rng, unsigned int bits, const PrimeSelector& selector,
+		const RSAWrapper::Progress& progress, double from, double to, const atomic<bool>* cancel)
+{
+	const Integer window( 4 * bits );
+	double left = to - from;
+	Integer p;
+
+	while( true )
+	{
+		if( cancel && *cancel )
+		{
+			throw runtime_error("Key generation cancelled");
+		}
+
+		p.Randomize( rng, bits );
+		p.SetBit( bits - 1 );
+		p.SetBit( bits - 2 );
+		p.SetBit( 0 );
+
+		if( FirstPrime( p, p + window, 1, 2, &selector ) && p.BitCount() == bits )
+		{
+			return p;
+		}
+
+		left /= 2;
+		if( progress )
+		{
+			progress( to - left );
+		}
+	}
+}
+
+void RSAWrapper::GenerateKeys(unsigned int size, const Progress &progress, const atomic<bool> *cancel)
+{
+	// Crypto++ default public exponent, keep keys alike
+	const Integer e( 17 );
+	RSAPrimeSelector selector( e );
+	const unsigned int pbits = size / 2;
+
+	if( progress )
+	{
+		progress( 0.0 );
+	}
+
+	Integer p = rsa_prime( this->rng, pbits, selector, progress, 0.0, 0.45, cancel );
+	if( progress )
+	{
+		progress( 0.45 );
+	}
+
+	Integer q;
+	do
+	{
+		q = rsa_prime( this->rng, size - pbits, selector, progress, 0.45, 0.9, cancel );
+	} while( q == p );
+	if( progress )
+	{
+		progress( 0.9 );
+	}
+
+	Integer d = e.InverseMod( LCM( p - 1, q - 1 ) );
+
+	InvertibleRSAFunction params;
+	params.Initialize( p * q, e, d, p, q, d % ( p - 1 ), d % ( q - 1 ), q.InverseMod( p ) );
+
+	if( ! params.Validate( this->rng, 1 ) )
+	{
+		throw runtime_error("Generated key failed validation");
+	}
+
+	if( cancel && *cancel )
+	{
+		throw runtime_error("Key generation cancelled");
+	}
+
+	this->SetKeys( params );
+
+	if( progress )
+	{
+		progress( 1.0 );
+	}
+}
+
+void RSAWrapper::SetKeys(const InvertibleRSAFunction &params)
+{
 	this->privkey = PrivateKeyPtr( new RSA::PrivateKey( params) );
 	this->pubkey = PublicKeyPtr( new RSA::PublicKey(params) );
 
 	this->priv_i = true;
+	this->signer.reset();
+	this->batchsigners.clear();
 	this->pub_i = true;
+	this->verifier.reset();
+	this->batchverifiers.clear();
 
 }
 
@@ -63,6 +201,8 @@ void RSAWrapper::LoadPrivKey(const string &path)
 	this->ValidatePrivKey();
 
 	this->priv_i = true;
+	this->signer.reset();
+	this->batchsigners.clear();
 }
 
 void RSAWrapper::LoadPubKey(const string &path)
@@ -79,6 +219,8 @@ void RSAWrapper::LoadPubKey(const string &path)
 	this->ValidatePubKey();
 
 	this->pub_i = true;
+	this->verifier.reset();
+	this->batchverifiers.clear();
 }
 
 vector<byte> RSAWrapper::GetPubKey()
@@ -252,6 +394,8 @@ void RSAWrapper::LoadPrivKey(const vector<byte> &key)
 	this->ValidatePrivKey();
 
 	this->priv_i = true;
+	this->signer.reset();
+	this->batchsigners.clear();
 }
 
 void RSAWrapper::LoadPrivKeyFromPEM(const string &key)
@@ -276,6 +420,8 @@ void RSAWrapper::LoadPrivKeyFromDER(const vector<byte> &key)
 	this->ValidatePrivKey();
 
 	this->priv_i = true;
+	this->signer.reset();
+	this->batchsigners.clear();
 
 }
 
@@ -291,6 +437,8 @@ void RSAWrapper::LoadPubKey(const vector<byte> &key)
 	this->ValidatePubKey();
 
 	this->pub_i = true;
+	this->verifier.reset();
+	this->batchverifiers.clear();
 }
 
 void RSAWrapper::LoadPubKeyFromPEM(const string &key)
@@ -311,56 +459,287 @@ void RSAWrapper::LoadPubKeyFromDER(const vector<byte> &key)
 	this->ValidatePubKey();
 
 	this->pub_i = true;
+	this->verifier.reset();
+	this->batchverifiers.clear();
 }
 
 vector<byte> RSAWrapper::SignMessage(const string &message)
+{
+	vector<byte> signature;
+
+	this->SignMessage( ByteView( message ), signature );
+
+	return signature;
+}
+
+bool RSAWrapper::VerifyMessage(const string &message, const string& signature)
+{
+	return this->VerifyMessage( ByteView( message ), ByteView( signature ) );
+}
+
+bool RSAWrapper::VerifyMessage(const string &message, const vector<byte> &signature)
+{
+	return this->VerifyMessage( ByteView( message ), ByteView( signature ) );
+}
+
+void RSAWrapper::SignMessage(ByteView message, vector<byte> &signature)
 {
 	if( ! this->priv_i )
 	{
 		throw runtime_error("Private key not loaded");
 	}
 
-	RSASS<PKCS1v15, SHA1>::Signer signer( *this->privkey.get() );
+	lock_guard<mutex> lock( this->keylock );
+
+	if( ! this->signer )
+	{
+		this->signer.reset( new RSASigner( *this->privkey.get() ) );
+	}
 
-	SecByteBlock signature( signer.MaxSignatureLength() );
+	signature.resize( this->signer->MaxSignatureLength() );
 
 	// Sign message
-	signer.SignMessage( this->rng, (const byte*) message.c_str(),
-		message.length(), signature );
+	size_t len = this->signer->SignMessage( this->rng, message.data(),
+		message.size(), signature.data() );
 
-	return vector<byte>(signature.begin(), signature.end());
+	signature.resize( len );
 }
 
-bool RSAWrapper::VerifyMessage(const string &message, const string& signature)
+bool RSAWrapper::VerifyMessage(ByteView message, ByteView signature)
 {
 	if( ! this->pub_i )
 	{
 		throw runtime_error("Public key not loaded");
 	}
 
-	RSASS<PKCS1v15, SHA1>::Verifier verifier( *this->pubkey.get() );
+	{
+		lock_guard<mutex> lock( this->keylock );
+
+		if( ! this->verifier )
+		{
+			this->verifier.reset( new RSAVerifier( *this->pubkey.get() ) );
+		}
+	}
 
-	bool result = verifier.VerifyMessage( (const byte*)message.c_str(),
-		message.length(), (const byte*)signature.c_str(), signature.length() );
+	bool result = this->verifier->VerifyMessage( message.data(), message.size(),
+		signature.data(), signature.size() );
 
 	return result;
 }
+
 /*
- * TODO: Merge these two to something more intelligent?
+ * Persistent workers for the batch operations. The calling thread
+ * takes part as worker 0, so a single cpu system runs everything
+ * inline. One batch runs at a time and items are handed out one by
+ * one, RSA operations are large enough for that to not matter.
  */
-bool RSAWrapper::VerifyMessage(const string &message, const vector<byte> &signature)
+class BatchPool
+{
+public:
+	typedef function<void(size_t item, size_t worker)> Job;
+
+	static BatchPool& Instance()
+	{
+		static BatchPool pool( max( sysinfo.NumCpus(), 1 ) );
+		return pool;
+	}
+
+	size_t Workers() const
+	{
+		return this->threads.size() + 1;
+	}
+
+	void Run(size_t count, const Job& job)
+	{
+		lock_guard<mutex> batch( this->batchlock );
+
+		{
+			lock_guard<mutex> l( this->lock );
+			this->job = &job;
+			this->count = count;
+			this->next = 0;
+			this->error = nullptr;
+			this->busy = this->threads.size();
+			this->generation++;
+		}
+		this->work.notify_all();
+
+		this->Work( 0 );
+
+		unique_lock<mutex> l( this->lock );
+		this->done.wait( l, [this](){ return this->busy == 0; } );
+		this->job = nullptr;
+
+		if( this->error )
+		{
+			rethrow_exception( this->error );
+		}
+	}
+
+	~BatchPool()
+	{
+		{
+			lock_guard<mutex> l( this->lock );
+			this->stop = true;
+		}
+		this->work.notify_all();
+
+		for( auto& t: this->threads )
+		{
+			t.join();
+		}
+	}
+private:
+	BatchPool(size_t workers)
+	{
+		for( size_t i = 1; i < workers; i++ )
+		{
+			this->threads.emplace_back( &BatchPool::Thread, this, i );
+		}
+	}
+
+	void Thread(size_t worker)
+	{
+		uint64_t seen = 0;
+
+		while( true )
+		{
+			{
+				unique_lock<mutex> l( this->lock );
+				this->work.wait( l, [this, seen](){ return this->stop || this->generation != seen; } );
+				if( this->stop )
+				{
+					return;
+				}
+				seen = this->generation;
+			}
+
+			this->Work( worker );
+
+			lock_guard<mutex> l( this->lock );
+			if( --this->busy == 0 )
+			{
+				this->done.notify_one();
+			}
+		}
+	}
+
+	void Work(size_t worker)
+	{
+		size_t item;
+		while( ( item = this->next++ ) < this->count )
+		{
+			try
+			{
+				(*this->job)( item, worker );
+			}
+			catch( ... )
+			{
+				lock_guard<mutex> l( this->lock );
+				if( ! this->error )
+				{
+					this->error = current_exception();
+				}
+			}
+		}
+	}
+
+	mutex batchlock;
+	mutex lock;
+	condition_variable work;
+	condition_variable done;
+
+	const Job* job = nullptr;
+	size_t count = 0;
+	atomic<size_t> next{0};
+	size_t busy = 0;
+	uint64_t generation = 0;
+	bool stop = false;
+	exception_ptr error;
+
+	vector<thread> threads;
+};
+
+// Signing needs randomness for blinding, keep one generator per thread
+static RandomNumberGenerator& thread_rng()
+{
+	static thread_local AutoSeededRandomPool rng;
+	return rng;
+}
+
+vector<vector<byte>> RSAWrapper::SignBatch(const vector<string> &messages)
+{
+	return this->SignBatch( vector<ByteView>( messages.begin(), messages.end() ) );
+}
+
+vector<vector<byte>> RSAWrapper::SignBatch(const vector<ByteView> &messages)
+{
+	if( ! this->priv_i )
+	{
+		throw runtime_error("Private key not loaded");
+	}
+
+	BatchPool& pool = BatchPool::Instance();
+	vector<vector<byte>> signatures( messages.size() );
+
+	lock_guard<mutex> lock( this->keylock );
+	this->batchsigners.resize( pool.Workers() );
+
+	pool.Run( messages.size(), [this, &messages, &signatures](size_t item, size_t worker)
+	{
+		unique_ptr<RSASigner>& signer = this->batchsigners[worker];
+		if( ! signer )
+		{
+			signer.reset( new RSASigner( *this->privkey.get() ) );
+		}
+
+		vector<byte>& sig = signatures[item];
+		sig.resize( signer->MaxSignatureLength() );
+		sig.resize( signer->SignMessage( thread_rng(), messages[item].data(), messages[item].size(), sig.data() ) );
+	});
+
+	return signatures;
+}
+
+vector<bool> RSAWrapper::VerifyBatch(const vector<string> &messages, const vector<vector<byte>> &signatures)
+{
+	return this->VerifyBatch( vector<ByteView>( messages.begin(), messages.end() ),
+							  vector<ByteView>( signatures.begin(), signatures.end() ) );
+}
+
+vector<bool> RSAWrapper::VerifyBatch(const vector<ByteView> &messages, const vector<ByteView> &signatures)
 {
 	if( ! this->pub_i )
 	{
 		throw runtime_error("Public key not loaded");
 	}
 
-	RSASS<PKCS1v15, SHA1>::Verifier verifier( *this->pubkey.get() );
+	if( messages.size() != signatures.size() )
+	{
+		throw runtime_error("Number of messages and signatures differ");
+	}
 
-	bool result = verifier.VerifyMessage( (const byte*)message.c_str(),
-										  message.length(), &signature[0], signature.size() );
+	BatchPool& pool = BatchPool::Instance();
 
-	return result;
+	// vector<bool> is packed, collect results in bytes to not share words between workers
+	vector<char> valid( messages.size() );
+
+	lock_guard<mutex> lock( this->keylock );
+	this->batchverifiers.resize( pool.Workers() );
+
+	pool.Run( messages.size(), [this, &messages, &signatures, &valid](size_t item, size_t worker)
+	{
+		unique_ptr<RSAVerifier>& verifier = this->batchverifiers[worker];
+		if( ! verifier )
+		{
+			verifier.reset( new RSAVerifier( *this->pubkey.get() ) );
+		}
+
+		valid[item] = verifier->VerifyMessage( messages[item].data(), messages[item].size(),
+											   signatures[item].data(), signatures[item].size() );
+	});
+
+	return vector<bool>( valid.begin(), valid.end() );
 }
 
 vector<byte> RSAWrapper::PEMToDER(const string &key)
@@ -405,256 +784,1349 @@ void RSAWrapper::ValidatePubKey()
 
 /*
  *
- * Begin implementation Stringtools
+ * Begin implementation RSA key cache
  *
  */
 
-string Base64Encode ( const vector<byte>& in )
+mutex RSAKeyCache::lock;
+map<string, RSAKeyCache::Entry> RSAKeyCache::keys;
+
+RSAWrapperPtr RSAKeyCache::Get(const string &source, const string &fingerprint, const Loader &loader)
 {
-	string encoded;
-	ArraySource(&in[0], in.size(), true,
-			new Base64Encoder(
-				new StringSink( encoded ), false
-				)
-			);
-	return encoded;
+	{
+		lock_guard<mutex> l( RSAKeyCache::lock );
+
+		auto it = RSAKeyCache::keys.find( source );
+		if( it != RSAKeyCache::keys.end() && it->second.fingerprint == fingerprint )
+		{
+			return it->second.key;
+		}
+	}
+
+	// Load, and validate, without holding the lock
+	logg << Logger::Debug << "Loading key from " << source << lend;
+	RSAWrapperPtr key = loader();
+
+	if( key )
+	{
+		lock_guard<mutex> l( RSAKeyCache::lock );
+		RSAKeyCache::keys[source] = { fingerprint, key };
+	}
+
+	return key;
 }
 
-string Base64Encode(const string& s)
+static string file_fingerprint(const string& path)
 {
-	string encoded;
+	struct stat st;
 
-	StringSource ss( s, true,
-			new Base64Encoder(
-				new StringSink( encoded ), false
-				)
-		);
+	if( stat( path.c_str(), &st ) < 0 )
+	{
+		throw ErrnoException("Unable to stat key file '" + path + "'");
+	}
 
-	return encoded;
+	stringstream ss;
+	ss << st.st_dev << ":" << st.st_ino << ":" << st.st_size << ":"
+	   << st.st_mtim.tv_sec << "." << st.st_mtim.tv_nsec << ":"
+	   << st.st_ctim.tv_sec << "." << st.st_ctim.tv_nsec;
+
+	return ss.str();
 }
 
-vector<byte> Base64Decode(const string &data)
+RSAWrapperPtr RSAKeyCache::FromPEMFiles(const string &privpath, const string &pubpath)
 {
-	//TODO: How avoid intermediate string?
-	string decoded;
-	StringSource ss( data, true,
-			new Base64Decoder(
-				new StringSink( decoded )
-				)
-		);
+	string source = "file:" + privpath + ";" + pubpath;
+	string fingerprint = file_fingerprint( privpath );
+
+	if( pubpath != "" )
+	{
+		fingerprint += ";" + file_fingerprint( pubpath );
+	}
 
-	vector<byte> ret( decoded.size() );
+	return RSAKeyCache::Get( source, fingerprint, [&privpath, &pubpath]()
+	{
+		RSAWrapperPtr c( new RSAWrapper );
 
-	std::copy(decoded.begin(), decoded.end(), ret.begin() );
+		c->LoadPrivKeyFromPEM( File::GetContentAsString( privpath, true ) );
 
-	return ret;
-}
+		if( pubpath != "" )
+		{
+			c->LoadPubKeyFromPEM( File::GetContentAsString( pubpath, true ) );
+		}
 
+		return c;
+	});
+}
 
-string Base64DecodeToString(const string& s)
+string RSAKeyCache::Fingerprint(ByteView data)
 {
-	string decoded;
+	string digest( SHA256::DIGESTSIZE, 0 );
 
-	StringSource ss( s, true,
-			new Base64Decoder(
-				new StringSink( decoded )
-				)
-		);
+	SHA256().CalculateDigest( (byte*) &digest[0], data.data(), data.size() );
 
-	return decoded;
+	return digest;
 }
 
-
-void
-Base64Decode ( const string& s, vector<byte>& out )
+void RSAKeyCache::Invalidate(const string &source)
 {
-	string decoded = Base64DecodeToString(s);
-	out.resize( decoded.size() );
-	std::copy(decoded.begin(), decoded.end(), out.begin() );
+	lock_guard<mutex> l( RSAKeyCache::lock );
+	RSAKeyCache::keys.erase( source );
 }
 
-void
-Base64Decode ( const string& s, SecVector<byte>& out )
+void RSAKeyCache::Clear()
 {
-	//TODO: the string here is not allocated with wiped allocator
-	string decoded = Base64DecodeToString(s);
-	out.resize( decoded.size() );
-	std::copy(decoded.begin(), decoded.end(), out.begin() );
+	lock_guard<mutex> l( RSAKeyCache::lock );
+	RSAKeyCache::keys.clear();
 }
 
+size_t RSAKeyCache::Size()
+{
+	lock_guard<mutex> l( RSAKeyCache::lock );
+	return RSAKeyCache::keys.size();
+}
 
 /*
  *
- *  Begin implementatsion AES wrapper
+ * Begin implementation RSA background key generation
  *
  */
 
-vector<byte> AESWrapper::defaultiv = {
-	1,2,3,4,
-	5,6,7,8,
-	9,10,11,12,
-	13,14,15,16
-};
-
-AESWrapper::AESWrapper(const SecVector<byte>& key, const vector<byte>& iv)
+RSAKeyGen::RSAKeyGen(unsigned int size, RSAWrapper::Progress progress): cancel(false)
 {
-	this->Initialize(key, iv);
+	promise<RSAWrapperPtr> done;
+	this->result = done.get_future().share();
+
+	this->worker = thread( [this, size, progress](promise<RSAWrapperPtr> done)
+	{
+		try
+		{
+			RSAWrapperPtr key( new RSAWrapper );
+			key->GenerateKeys( size, progress, &this->cancel );
+			done.set_value( key );
+		}
+		catch( ... )
+		{
+			done.set_exception( current_exception() );
+		}
+	}, std::move( done ) );
 }
 
-AESWrapper::AESWrapper ()
+void RSAKeyGen::Cancel()
 {
+	this->cancel = true;
 }
 
-void
-AESWrapper::Initialize ( const SecVector<byte>& key, const vector<byte>& iv )
+bool RSAKeyGen::Ready()
 {
-	this->key = key;
-	this->iv = iv;
-#if 0
-	this->e.SetKeyWithIV( &key[0], key.size(), &iv[0] );
-	this->d.SetKeyWithIV( &key[0], key.size(), &iv[0] );
-#endif
+	return this->result.wait_for( chrono::seconds( 0 ) ) == future_status::ready;
 }
 
-string AESWrapper::Encrypt(const string& plain)
+RSAWrapperPtr RSAKeyGen::Get()
 {
-
-	this->e.SetKeyWithIV( &this->key[0], this->key.size(), &this->iv[0] );
-
-	string ciphered;
-
-	StringSource s(plain, true,
-		new StreamTransformationFilter( this->e,
-			new StringSink(ciphered)
-		)
-	);
-
-	return ciphered;
+	return this->result.get();
 }
-void
 
-AESWrapper::Encrypt ( const vector<byte>& in, vector<byte>& out )
+RSAKeyGen::~RSAKeyGen()
 {
+	this->Cancel();
+	if( this->worker.joinable() )
+	{
+		this->worker.join();
+	}
+}
 
-	this->e.SetKeyWithIV( &this->key[0], this->key.size(), &this->iv[0] );
-
-	string enc;
-	StringSource s( &in[0], in.size(), true,
-			new StreamTransformationFilter( this->e,
-					new StringSink(enc)
-			)
-		);
+/*
+ *
+ * Begin implementation RSA key pool
+ *
+ */
 
-	out.resize(enc.size());
-	copy(enc.begin(), enc.end(), out.begin() );
+RSAKeyPool::State::~State()
+{
+	{
+		lock_guard<mutex> l( this->lock );
+		this->stop = true;
+	}
+	this->cv.notify_all();
+	if( this->worker.joinable() )
+	{
+		this->worker.join();
+	}
 }
 
-string AESWrapper::Decrypt(const string& encoded)
+RSAKeyPool::State &RSAKeyPool::state()
 {
-	this->d.SetKeyWithIV( &this->key[0], this->key.size(), &this->iv[0] );
-
-	string plain;
-	logg << Logger::Debug << "Decode string size "<<encoded.size()<<lend;
-	StringSource s(encoded, true,
-		new StreamTransformationFilter(this->d,
-			new StringSink(plain)
-		)
-	);
-
-	return plain;
+	static State s;
+	return s;
 }
 
-void
-AESWrapper::Decrypt ( const vector<byte>& in, vector<byte>& out )
+void RSAKeyPool::Start(size_t count, unsigned int size)
 {
-	//Todo: investigate if the copy could be avoided.
-	string plain = this->Decrypt(in);
+	State& s = state();
+	lock_guard<mutex> c( s.control );
+
+	RSAKeyPool::Halt( s );
 
-	out.resize(plain.size());
-	copy(plain.begin(), plain.end(), out.begin() );
+	lock_guard<mutex> l( s.lock );
+	if( s.size != size )
+	{
+		s.keys.clear();
+	}
+	s.count = count;
+	s.size = size;
+	s.stop = false;
+	s.worker = thread( &RSAKeyPool::Worker );
 }
 
-string
-AESWrapper::Decrypt ( const vector<byte>& in )
+void RSAKeyPool::Stop()
 {
-	this->d.SetKeyWithIV( &this->key[0], this->key.size(), &this->iv[0] );
+	State& s = state();
+	lock_guard<mutex> c( s.control );
 
-	string plain;
-	StringSource s( &in[0], in.size(), true,
-			new StreamTransformationFilter( this->d,
-					new StringSink(plain)
-					)
-			);
-	return plain;
+	RSAKeyPool::Halt( s );
 }
 
-const vector<byte> defaultsalt( {
-		33, 31, 2, 238, 199, 213, 62,
-		70, 132, 179, 13, 251, 120,
-		29, 251, 69, 216, 120, 141, 19,
-		177, 102, 3, 49, 165, 5, 120,
-		159, 191, 117, 240, 125, 235,
-		75, 158, 112, 67, 172, 57, 123,
-		175, 203, 37, 94, 57, 99, 237,
-		225, 238, 122, 213, 86, 182, 181,
-		251, 192, 142, 41, 105, 163, 1,
-		132, 52, 97
-	} );
-
-
-SecVector<byte>
-PBKDF2 (const SecString &passwd, size_t keylength, const vector<byte>& salt,
-		unsigned int iter )
+RSAWrapperPtr RSAKeyPool::Take(unsigned int size)
 {
+	State& s = state();
+	{
+		lock_guard<mutex> l( s.lock );
+		if( s.size == size && ! s.keys.empty() )
+		{
+			RSAWrapperPtr key = s.keys.front();
+			s.keys.pop_front();
+			s.cv.notify_all();
+			return key;
+		}
+	}
 
-	SecVector<byte> ret(keylength);
-
-	PKCS5_PBKDF2_HMAC<SHA512> df;
+	logg << Logger::Debug << "No pregenerated key available, generating one" << lend;
 
-	df.DeriveKey(
-		&ret[0], ret.size(),
-		0,
-		(const byte*)passwd.c_str(), passwd.length(),
-		&salt[0],
-		salt.size(),
-		iter);
+	RSAWrapperPtr key( new RSAWrapper );
+	key->GenerateKeys( size );
 
-	return ret;
+	return key;
 }
 
-void
-AESWrapper::SetDefaultIV ( const vector<byte>& iv )
+size_t RSAKeyPool::Available()
 {
-	AESWrapper::defaultiv = iv;
+	State& s = state();
+	lock_guard<mutex> l( s.lock );
+	return s.keys.size();
 }
 
-
-AESWrapper::~AESWrapper()
+// Ready keys are kept, control lock must be held
+void RSAKeyPool::Halt(State &s)
 {
-}
+	{
+		lock_guard<mutex> l( s.lock );
+		s.stop = true;
+	}
+	s.cv.notify_all();
 
-bool MakeCSR(const string &privkeypath, const string &csrpath, const string &cn, const string &company)
+	if( s.worker.joinable() )
+	{
+		s.worker.join();
+	}
+}
+
+void RSAKeyPool::Worker()
+{
+	State& s = state();
+
+	// Only use cpu time no one else wants
+	sched_param param = {};
+	if( pthread_setschedparam( pthread_self(), SCHED_IDLE, &param ) != 0 )
+	{
+		logg << Logger::Notice << "Unable to lower priority of key pool worker" << lend;
+	}
+
+	// Wait before retrying a failed generation, doubled on every failure
+	const chrono::seconds maxbackoff( 300 );
+	chrono::seconds backoff( 1 );
+
+	while( true )
+	{
+		unsigned int size;
+		{
+			unique_lock<mutex> l( s.lock );
+			s.cv.wait( l, [&s](){ return s.stop || s.keys.size() < s.count; } );
+			if( s.stop )
+			{
+				return;
+			}
+			size = s.size;
+		}
+
+		RSAWrapperPtr key( new RSAWrapper );
+		try
+		{
+			key->GenerateKeys( size, nullptr, &s.stop );
+		}
+		catch( std::exception& err )
+		{
+			if( s.stop )
+			{
+				return;
+			}
+
+			logg << Logger::Error << "Key pool generation failed, retry in "
+				 << backoff.count() << "s: " << err.what() << lend;
+
+			unique_lock<mutex> l( s.lock );
+			if( s.cv.wait_for( l, backoff, [&s](){ return s.stop.load(); } ) )
+			{
+				return;
+			}
+			backoff = min( backoff * 2, maxbackoff );
+			continue;
+		}
+
+		backoff = chrono::seconds( 1 );
+
+		lock_guard<mutex> l( s.lock );
+		s.keys.push_back( key );
+	}
+}
+
+/*
+ *
+ * Begin implementation Stringtools
+ *
+ */
+
+string Base64Encode ( const vector<byte>& in )
+{
+	return Base64Encode( ByteView( in ) );
+}
+
+string Base64Encode(const string& s)
+{
+	return Base64Encode( ByteView( s ) );
+}
+
+string Base64Encode(ByteView in)
+{
+	string encoded;
+
+	Base64Encode( in, encoded );
+
+	return encoded;
+}
+
+void Base64Encode(ByteView in, string &out)
+{
+	out.resize( Base64::EncodedLength( in.size() ) );
+
+	Base64::Encode( in.data(), in.size(), &out[0] );
+}
+
+// Decode straight into the output buffer
+template<typename T>
+static void b64_decode(ByteView in, T& out, Base64::Mode mode = Base64::Lenient)
+{
+	out.resize( Base64::DecodedMaxLength( in.size() ) );
+
+	out.resize( Base64::Decode( (const char*) in.data(), in.size(), out.data(), mode ) );
+}
+
+vector<byte> Base64Decode(const string &data)
+{
+	vector<byte> ret;
+
+	b64_decode( ByteView( data ), ret );
+
+	return ret;
+}
+
+
+string Base64DecodeToString(const string& s)
+{
+	string decoded( Base64::DecodedMaxLength( s.size() ), 0 );
+
+	decoded.resize( Base64::Decode( s.data(), s.size(), (uint8_t*) &decoded[0], Base64::Lenient ) );
+
+	return decoded;
+}
+
+
+void
+Base64Decode ( const string& s, vector<byte>& out )
+{
+	b64_decode( ByteView( s ), out );
+}
+
+void
+Base64Decode ( const string& s, SecVector<byte>& out )
+{
+	b64_decode( ByteView( s ), out );
+}
+
+void Base64Decode(ByteView in, vector<byte> &out, Base64::Mode mode)
+{
+	b64_decode( in, out, mode );
+}
+
+void Base64Decode(ByteView in, SecVector<byte> &out, Base64::Mode mode)
+{
+	b64_decode( in, out, mode );
+}
+
+
+/*
+ *
+ *  Begin implementatsion AES wrapper
+ *
+ */
+
+/*
+ * Length of PKCS#7 padding in last decrypted block, 0 if invalid.
+ * Looks at every byte of the block regardless of where a mismatch is,
+ * time taken does not tell how much of the padding was right.
+ */
+static size_t pkcs7_padding(const byte* last)
+{
+	const size_t bs = AES::BLOCKSIZE;
+	const size_t topbit = sizeof(size_t) * 8 - 1;
+	size_t pad = last[bs - 1];
+
+	// Top bit set if pad is 0 or larger than a block
+	size_t bad = ( ( pad - 1 ) | ( bs - pad ) ) >> topbit;
+
+	for( size_t i = 0; i < bs; i++ )
+	{
+		// All ones if byte is part of padding, i.e. i >= bs - pad
+		size_t inpad = ( ( i - ( bs - pad ) ) >> topbit ) - 1;
+		bad |= inpad & ( last[i] ^ pad );
+	}
+
+	return bad == 0 ? pad : 0;
+}
+
+vector<byte> AESWrapper::defaultiv = {
+	1,2,3,4,
+	5,6,7,8,
+	9,10,11,12,
+	13,14,15,16
+};
+
+AESWrapper::AESWrapper(const SecVector<byte>& key, const vector<byte>& iv)
+{
+	this->Initialize(key, iv);
+}
+
+AESWrapper::AESWrapper ()
+{
+}
+
+void
+AESWrapper::Initialize ( const SecVector<byte>& key, const vector<byte>& iv )
+{
+	this->key = key;
+	this->iv = iv;
+#if 0
+	this->e.SetKeyWithIV( &key[0], key.size(), &iv[0] );
+	this->d.SetKeyWithIV( &key[0], key.size(), &iv[0] );
+#endif
+}
+
+string AESWrapper::Encrypt(const string& plain)
+{
+	string ciphered( plain.size() + AES::BLOCKSIZE, 0 );
+
+	ciphered.resize( this->Encrypt( ByteView( plain ), (byte*) &ciphered[0] ) );
+
+	return ciphered;
+}
+
+void
+AESWrapper::Encrypt ( const vector<byte>& in, vector<byte>& out )
+{
+	out.resize( in.size() + AES::BLOCKSIZE );
+	out.resize( this->Encrypt( ByteView( in ), out.data() ) );
+}
+
+string AESWrapper::Decrypt(const string& encoded)
+{
+	logg << Logger::Debug << "Decode string size "<<encoded.size()<<lend;
+
+	string plain( encoded.size(), 0 );
+
+	plain.resize( this->Decrypt( ByteView( encoded ), (byte*) &plain[0] ) );
+
+	return plain;
+}
+
+void
+AESWrapper::Decrypt ( const vector<byte>& in, vector<byte>& out )
+{
+	out.resize( in.size() );
+	out.resize( this->Decrypt( ByteView( in ), out.data() ) );
+}
+
+string
+AESWrapper::Decrypt ( const vector<byte>& in )
+{
+	string plain( in.size(), 0 );
+
+	plain.resize( this->Decrypt( ByteView( in ), (byte*) &plain[0] ) );
+
+	return plain;
+}
+
+/*
+ * Full blocks are processed straight from in to out, only the
+ * final padded block passes through a local buffer.
+ */
+size_t AESWrapper::Encrypt(ByteView in, byte *out)
+{
+	const size_t bs = AES::BLOCKSIZE;
+	size_t full = in.size() - in.size() % bs;
+	size_t rest = in.size() - full;
+
+	this->e.SetKeyWithIV( &this->key[0], this->key.size(), &this->iv[0] );
+
+	if( full > 0 )
+	{
+		this->e.ProcessData( out, in.data(), full );
+	}
+
+	byte last[AES::BLOCKSIZE];
+	if( rest > 0 )
+	{
+		memcpy( last, in.data() + full, rest );
+	}
+	memset( last + rest, bs - rest, bs - rest );
+
+	this->e.ProcessData( out + full, last, bs );
+
+	memset( last, 0, bs );
+
+	return full + bs;
+}
+
+size_t AESWrapper::Decrypt(ByteView in, byte *out)
+{
+	const size_t bs = AES::BLOCKSIZE;
+
+	if( in.empty() || in.size() % bs != 0 )
+	{
+		throw InvalidCiphertext("AESWrapper: ciphertext length is not a multiple of block size");
+	}
+
+	this->d.SetKeyWithIV( &this->key[0], this->key.size(), &this->iv[0] );
+	this->d.ProcessData( out, in.data(), in.size() );
+
+	size_t pad = pkcs7_padding( out + in.size() - bs );
+	if( pad == 0 )
+	{
+		memset( out, 0, in.size() );
+		throw InvalidCiphertext("AESWrapper: invalid PKCS #7 block padding found");
+	}
+
+	return in.size() - pad;
+}
+
+void AESWrapper::Encrypt(ByteView in, SecVector<byte> &out)
+{
+	out.resize( in.size() + AES::BLOCKSIZE );
+	out.resize( this->Encrypt( in, out.data() ) );
+}
+
+void AESWrapper::Decrypt(ByteView in, SecVector<byte> &out)
+{
+	out.resize( in.size() );
+	out.resize( this->Decrypt( in, out.data() ) );
+}
+
+const vector<byte> defaultsalt( {
+		33, 31, 2, 238, 199, 213, 62,
+		70, 132, 179, 13, 251, 120,
+		29, 251, 69, 216, 120, 141, 19,
+		177, 102, 3, 49, 165, 5, 120,
+		159, 191, 117, 240, 125, 235,
+		75, 158, 112, 67, 172, 57, 123,
+		175, 203, 37, 94, 57, 99, 237,
+		225, 238, 122, 213, 86, 182, 181,
+		251, 192, 142, 41, 105, 163, 1,
+		132, 52, 97
+	} );
+
+
+SecVector<byte>
+PBKDF2 (const SecString &passwd, size_t keylength, const vector<byte>& salt,
+		unsigned int iter )
+{
+
+	SecVector<byte> ret(keylength);
+
+	PKCS5_PBKDF2_HMAC<SHA512> df;
+
+	df.DeriveKey(
+		&ret[0], ret.size(),
+		0,
+		(const byte*)passwd.c_str(), passwd.length(),
+		&salt[0],
+		salt.size(),
+		iter);
+
+	return ret;
+}
+
+/*
+ *
+ * Begin implementation KDF cache
+ *
+ */
+
+KDFCache::State::State(): secret( SHA256::DIGESTSIZE )
+{
+	AutoSeededRandomPool rng;
+	rng.GenerateBlock( &this->secret[0], this->secret.size() );
+}
+
+KDFCache::State::~State()
+{
+	{
+		lock_guard<mutex> l( this->lock );
+		this->stop = true;
+	}
+	this->cv.notify_all();
+
+	if( this->reaper.joinable() )
+	{
+		this->reaper.join();
+	}
+}
+
+KDFCache::State &KDFCache::state()
+{
+	static State s;
+	return s;
+}
+
+SecVector<byte> KDFCache::PBKDF2(const SecString &passwd, size_t keylength, const vector<byte> &salt, unsigned int iter)
+{
+	State& s = state();
+	string digest = KDFCache::Digest( s, passwd, keylength, salt, iter );
+
+	unsigned int lifetime;
+	{
+		lock_guard<mutex> l( s.lock );
+		KDFCache::Expire( s );
+
+		auto it = s.keys.find( digest );
+		if( it != s.keys.end() )
+		{
+			return it->second.key;
+		}
+		lifetime = s.lifetime;
+	}
+
+	// Derive without holding the lock, this is the slow part
+	SecVector<byte> key = CryptoHelper::PBKDF2( passwd, keylength, salt, iter );
+
+	if( lifetime == 0 )
+	{
+		return key;
+	}
+
+	lock_guard<mutex> l( s.lock );
+	if( s.maxentries == 0 )
+	{
+		return key;
+	}
+
+	while( s.keys.size() >= s.maxentries && s.keys.find( digest ) == s.keys.end() )
+	{
+		auto oldest = KDFCache::Oldest( s );
+		s.keys.erase( oldest );
+	}
+
+	Entry& e = s.keys[digest];
+	e.key = key;
+	e.expires = chrono::steady_clock::now() + chrono::seconds( lifetime );
+
+	if( ! s.reaper.joinable() )
+	{
+		s.reaper = thread( &KDFCache::Reaper );
+	}
+	s.cv.notify_all();
+
+	return key;
+}
+
+void KDFCache::SetLifetime(unsigned int seconds)
+{
+	State& s = state();
+	{
+		lock_guard<mutex> l( s.lock );
+		s.lifetime = seconds;
+
+		// Never let existing entries outlive the new limit
+		auto limit = chrono::steady_clock::now() + chrono::seconds( seconds );
+		for( auto& key: s.keys )
+		{
+			key.second.expires = min( key.second.expires, limit );
+		}
+		KDFCache::Expire( s );
+	}
+	s.cv.notify_all();
+}
+
+void KDFCache::SetMaxEntries(size_t entries)
+{
+	State& s = state();
+	lock_guard<mutex> l( s.lock );
+	s.maxentries = entries;
+
+	while( s.keys.size() > s.maxentries )
+	{
+		auto oldest = KDFCache::Oldest( s );
+		s.keys.erase( oldest );
+	}
+}
+
+void KDFCache::Clear()
+{
+	State& s = state();
+	lock_guard<mutex> l( s.lock );
+	s.keys.clear();
+}
+
+size_t KDFCache::Size()
+{
+	State& s = state();
+	lock_guard<mutex> l( s.lock );
+	KDFCache::Expire( s );
+	return s.keys.size();
+}
+
+/*
+ * Lengths are included so that different splits of password and salt
+ * never give the same input. The secret keeps the digest from being
+ * a cheap way to test password guesses.
+ */
+string KDFCache::Digest(const State &s, const SecString &passwd, size_t keylength, const vector<byte> &salt, unsigned int iter)
+{
+	HMAC<SHA256> mac( s.secret.data(), s.secret.size() );
+
+	uint64_t params[4] = { passwd.size(), salt.size(), iter, keylength };
+	mac.Update( reinterpret_cast<const byte*>( params ), sizeof( params ) );
+	mac.Update( reinterpret_cast<const byte*>( passwd.data() ), passwd.size() );
+	mac.Update( salt.data(), salt.size() );
+
+	string digest( SHA256::DIGESTSIZE, '\0' );
+	mac.Final( reinterpret_cast<byte*>( &digest[0] ) );
+
+	return digest;
+}
+
+// Entry expiring first, lock must be held and cache not be empty
+map<string, KDFCache::Entry>::iterator KDFCache::Oldest(State &s)
+{
+	return min_element( s.keys.begin(), s.keys.end(),
+		[](const pair<const string, Entry>& a, const pair<const string, Entry>& b)
+		{
+			return a.second.expires < b.second.expires;
+		});
+}
+
+// Lock must be held, erased keys are wiped by their allocator
+void KDFCache::Expire(State &s)
+{
+	auto now = chrono::steady_clock::now();
+
+	for( auto it = s.keys.begin(); it != s.keys.end(); )
+	{
+		if( it->second.expires <= now )
+		{
+			it = s.keys.erase( it );
+		}
+		else
+		{
+			++it;
+		}
+	}
+}
+
+// Wipes keys as they expire, not only on the next cache access
+void KDFCache::Reaper()
+{
+	State& s = state();
+	unique_lock<mutex> l( s.lock );
+
+	while( ! s.stop )
+	{
+		KDFCache::Expire( s );
+
+		if( s.keys.empty() )
+		{
+			s.cv.wait( l );
+		}
+		else
+		{
+			auto next = KDFCache::Oldest( s );
+			s.cv.wait_until( l, next->second.expires );
+		}
+	}
+}
+
+// Chunk size used by the stream and fd versions
+static constexpr size_t AES_CHUNK = 64 * 1024;
+
+static void aes_pump(AESStream& aes, istream& in, ostream& out)
+{
+	SecVector<byte> ibuf( AES_CHUNK ), obuf( AES_CHUNK + AES::BLOCKSIZE );
+
+	while( in )
+	{
+		in.read( reinterpret_cast<char*>( &ibuf[0] ), ibuf.size() );
+		size_t rd = in.gcount();
+		if( rd > 0 )
+		{
+			size_t len = aes.Update( &ibuf[0], rd, &obuf[0] );
+			out.write( reinterpret_cast<const char*>( &obuf[0] ), len );
+		}
+	}
+
+	if( in.bad() )
+	{
+		throw runtime_error("AESWrapper: failed to read input stream");
+	}
+
+	size_t len = aes.Final( &obuf[0] );
+	out.write( reinterpret_cast<const char*>( &obuf[0] ), len );
+
+	if( ! out )
+	{
+		throw runtime_error("AESWrapper: failed to write output stream");
+	}
+}
+
+static void aes_writeall(int fd, const byte* buf, size_t len)
+{
+	while( len > 0 )
+	{
+		ssize_t wr = write( fd, buf, len );
+		if( wr < 0 )
+		{
+			if( errno == EINTR )
+			{
+				continue;
+			}
+			throw ErrnoException("AESWrapper: failed to write output");
+		}
+		buf += wr;
+		len -= wr;
+	}
+}
+
+static void aes_pump(AESStream& aes, int infd, int outfd)
+{
+	SecVector<byte> ibuf( AES_CHUNK ), obuf( AES_CHUNK + AES::BLOCKSIZE );
+
+	while( true )
+	{
+		ssize_t rd = read( infd, &ibuf[0], ibuf.size() );
+		if( rd < 0 )
+		{
+			if( errno == EINTR )
+			{
+				continue;
+			}
+			throw ErrnoException("AESWrapper: failed to read input");
+		}
+
+		if( rd == 0 )
+		{
+			break;
+		}
+
+		size_t len = aes.Update( &ibuf[0], rd, &obuf[0] );
+		aes_writeall( outfd, &obuf[0], len );
+	}
+
+	size_t len = aes.Final( &obuf[0] );
+	aes_writeall( outfd, &obuf[0], len );
+}
+
+void AESWrapper::Encrypt(istream &in, ostream &out)
+{
+	AESStream aes( *this, AESStream::Encrypt );
+	aes_pump( aes, in, out );
+}
+
+void AESWrapper::Decrypt(istream &in, ostream &out)
+{
+	AESStream aes( *this, AESStream::Decrypt );
+	aes_pump( aes, in, out );
+}
+
+void AESWrapper::Encrypt(int infd, int outfd)
+{
+	AESStream aes( *this, AESStream::Encrypt );
+	aes_pump( aes, infd, outfd );
+}
+
+void AESWrapper::Decrypt(int infd, int outfd)
+{
+	AESStream aes( *this, AESStream::Decrypt );
+	aes_pump( aes, infd, outfd );
+}
+
+void
+AESWrapper::SetDefaultIV ( const vector<byte>& iv )
+{
+	AESWrapper::defaultiv = iv;
+}
+
+
+AESWrapper::~AESWrapper()
+{
+}
+
+/*
+ *
+ *  Begin implementation AES stream
+ *
+ */
+
+AESStream::AESStream(const AESWrapper &aes, Mode mode): AESStream( aes.key, mode, aes.iv )
+{
+}
+
+AESStream::AESStream(const SecVector<byte> &key, Mode mode, const vector<byte> &iv):
+	mode(mode), key(key), iv(iv), buffered(0)
+{
+	if( this->iv.size() != AES::BLOCKSIZE )
+	{
+		throw runtime_error("AESStream: invalid iv size");
+	}
+	this->Reset();
+}
+
+/*
+ * Encryption buffers partial blocks only. Decryption always holds
+ * back the last complete block since it carries the padding that
+ * Final has to strip.
+ */
+size_t AESStream::Update(const byte *in, size_t len, byte *out)
+{
+	const size_t bs = AES::BLOCKSIZE;
+	size_t written = 0;
+
+	if( this->buffered > 0 )
+	{
+		size_t fill = min( bs - this->buffered, len );
+		memcpy( this->buf + this->buffered, in, fill );
+		this->buffered += fill;
+		in += fill;
+		len -= fill;
+
+		if( this->buffered < bs || ( this->mode == Decrypt && len == 0 ) )
+		{
+			return 0;
+		}
+
+		this->Process( out, this->buf, bs );
+		this->buffered = 0;
+		written = bs;
+	}
+
+	size_t blocks = len / bs;
+	size_t rest = len % bs;
+
+	if( this->mode == Decrypt && blocks > 0 && rest == 0 )
+	{
+		blocks--;
+		rest = bs;
+	}
+
+	if( blocks > 0 )
+	{
+		this->Process( out + written, in, blocks * bs );
+		written += blocks * bs;
+	}
+
+	memcpy( this->buf, in + blocks * bs, rest );
+	this->buffered = rest;
+
+	return written;
+}
+
+size_t AESStream::Final(byte *out)
+{
+	const size_t bs = AES::BLOCKSIZE;
+	size_t written;
+
+	if( this->mode == Encrypt )
+	{
+		byte pad = bs - this->buffered;
+		memset( this->buf + this->buffered, pad, pad );
+		this->Process( out, this->buf, bs );
+		written = bs;
+	}
+	else
+	{
+		if( this->buffered != bs )
+		{
+			this->Reset();
+			throw InvalidCiphertext("AESStream: ciphertext length is not a multiple of block size");
+		}
+
+		byte plain[AES::BLOCKSIZE];
+		this->Process( plain, this->buf, bs );
+
+		size_t pad = pkcs7_padding( plain );
+
+		if( pad == 0 )
+		{
+			memset( plain, 0, bs );
+			this->Reset();
+			throw InvalidCiphertext("AESStream: invalid PKCS #7 block padding found");
+		}
+
+		written = bs - pad;
+		memcpy( out, plain, written );
+		memset( plain, 0, bs );
+	}
+
+	this->Reset();
+
+	return written;
+}
+
+void AESStream::Reset()
+{
+	if( this->mode == Encrypt )
+	{
+		this->e.SetKeyWithIV( &this->key[0], this->key.size(), &this->iv[0] );
+	}
+	else
+	{
+		this->d.SetKeyWithIV( &this->key[0], this->key.size(), &this->iv[0] );
+	}
+	memset( this->buf, 0, sizeof( this->buf ) );
+	this->buffered = 0;
+}
+
+void AESStream::Process(byte *out, const byte *in, size_t len)
+{
+	if( this->mode == Encrypt )
+	{
+		this->e.ProcessData( out, in, len );
+	}
+	else
+	{
+		this->d.ProcessData( out, in, len );
+	}
+}
+
+AESStream::~AESStream()
+{
+	memset( this->buf, 0, sizeof( this->buf ) );
+}
+
+/*
+ *
+ *  Begin implementation AEAD wrapper
+ *
+ */
+
+constexpr size_t AEADWrapper::KeySize;
+constexpr size_t AEADWrapper::NonceSize;
+constexpr size_t AEADWrapper::TagSize;
+constexpr size_t AEADWrapper::Overhead;
+
+AEADWrapper::AEADWrapper(const SecVector<byte> &key, Algorithm alg):
+	alg( alg == Auto ? AEADWrapper::Preferred() : alg ), key(key)
+{
+	if( this->key.size() != AEADWrapper::KeySize )
+	{
+		throw runtime_error("AEADWrapper: invalid key size");
+	}
+
+	if( ! AEADWrapper::HasAlgorithm( this->alg ) )
+	{
+		throw runtime_error("AEADWrapper: "+AEADWrapper::AlgorithmName( this->alg )+" not supported");
+	}
+}
+
+string AEADWrapper::Encrypt(const string &plain, const string &aad)
+{
+	string out( plain.size() + AEADWrapper::Overhead, 0 );
+
+	this->Seal( (byte*) &out[0], (const byte*) plain.data(), plain.size(),
+			(const byte*) aad.data(), aad.size() );
+
+	return out;
+}
+
+void AEADWrapper::Encrypt(const vector<byte> &in, vector<byte> &out, const vector<byte> &aad)
+{
+	out.resize( in.size() + AEADWrapper::Overhead );
+
+	this->Seal( out.data(), in.data(), in.size(), aad.data(), aad.size() );
+}
+
+string AEADWrapper::Decrypt(const string &cipher, const string &aad)
+{
+	if( cipher.size() < AEADWrapper::Overhead )
+	{
+		throw runtime_error("AEADWrapper: message too short");
+	}
+
+	string out( cipher.size() - AEADWrapper::Overhead, 0 );
+
+	this->Open( (byte*) &out[0], (const byte*) cipher.data(), cipher.size(),
+			(const byte*) aad.data(), aad.size() );
+
+	return out;
+}
+
+void AEADWrapper::Decrypt(const vector<byte> &in, vector<byte> &out, const vector<byte> &aad)
+{
+	if( in.size() < AEADWrapper::Overhead )
+	{
+		throw runtime_error("AEADWrapper: message too short");
+	}
+
+	out.resize( in.size() - AEADWrapper::Overhead );
+
+	this->Open( out.data(), in.data(), in.size(), aad.data(), aad.size() );
+}
+
+AEADWrapper::Algorithm AEADWrapper::GetAlgorithm() const
+{
+	return this->alg;
+}
+
+/*
+ * AES-GCM is by far the fastest with hardware AES and carry-less
+ * multiply. Without them, ie on older ARM boards, ChaCha20 wins.
+ */
+AEADWrapper::Algorithm AEADWrapper::Preferred()
+{
+	static Algorithm preferred =
+			AEADWrapper::HasHardwareAES() || ! AEADWrapper::HasAlgorithm( ChaChaPoly ) ? AESGCM : ChaChaPoly;
+
+	return preferred;
+}
+
+bool AEADWrapper::HasHardwareAES()
+{
+#if CRYPTOPP_BOOL_X86 || CRYPTOPP_BOOL_X32 || CRYPTOPP_BOOL_X64
+	return HasAESNI() && HasCLMUL();
+#elif ( CRYPTOPP_BOOL_ARM32 || CRYPTOPP_BOOL_ARMV8 || CRYPTOPP_BOOL_ARM64 ) && CRYPTOPP_VERSION >= 600
+	return HasAES() && HasPMULL();
+#else
+	return false;
+#endif
+}
+
+bool AEADWrapper::HasAlgorithm(Algorithm alg)
+{
+	switch( alg )
+	{
+	case AESGCM:
+		return true;
+	case ChaChaPoly:
+#ifdef HAVE_CHACHAPOLY
+		return true;
+#else
+		return false;
+#endif
+	default:
+		return false;
+	}
+}
+
+string AEADWrapper::AlgorithmName(Algorithm alg)
+{
+	switch( alg )
+	{
+	case Auto:
+		return "auto";
+	case AESGCM:
+		return "aes-gcm";
+	case ChaChaPoly:
+		return "chacha20-poly1305";
+	default:
+		return "unknown";
+	}
+}
+
+AEADWrapper::~AEADWrapper()
+{
+}
+
+void AEADWrapper::Seal(byte *out, const byte *in, size_t len, const byte *aad, size_t aadlen)
+{
+	byte* nonce = out + 1;
+	byte* cipher = nonce + AEADWrapper::NonceSize;
+
+	out[0] = this->alg;
+	this->rng.GenerateBlock( nonce, AEADWrapper::NonceSize );
+
+	this->Cipher( this->alg, true ).EncryptAndAuthenticate(
+				cipher, cipher + len, AEADWrapper::TagSize,
+				nonce, AEADWrapper::NonceSize,
+				aad, aadlen,
+				in, len );
+}
+
+size_t AEADWrapper::Open(byte *out, const byte *in, size_t len, const byte *aad, size_t aadlen)
+{
+	Algorithm alg = static_cast<Algorithm>( in[0] );
+	if( ! AEADWrapper::HasAlgorithm( alg ) )
+	{
+		throw runtime_error("AEADWrapper: unsupported algorithm in message");
+	}
+
+	const byte* nonce = in + 1;
+	const byte* cipher = nonce + AEADWrapper::NonceSize;
+	size_t clen = len - AEADWrapper::Overhead;
+
+	bool ok = this->Cipher( alg, false ).DecryptAndVerify(
+				out, cipher + clen, AEADWrapper::TagSize,
+				nonce, AEADWrapper::NonceSize,
+				aad, aadlen,
+				cipher, clen );
+
+	if( ! ok )
+	{
+		if( clen > 0 )
+		{
+			memset( out, 0, clen );
+		}
+		throw runtime_error("AEADWrapper: message authentication failed");
+	}
+
+	return clen;
+}
+
+AuthenticatedSymmetricCipher &AEADWrapper::Cipher(Algorithm alg, bool encrypt)
+{
+	unique_ptr<AuthenticatedSymmetricCipher>& c = encrypt ? this->enc[alg] : this->dec[alg];
+
+	if( ! c )
+	{
+		if( alg == AESGCM )
+		{
+			c.reset( encrypt ?
+				static_cast<AuthenticatedSymmetricCipher*>( new GCM<AES>::Encryption ) :
+				static_cast<AuthenticatedSymmetricCipher*>( new GCM<AES>::Decryption ) );
+		}
+#ifdef HAVE_CHACHAPOLY
+		else if( alg == ChaChaPoly )
+		{
+			c.reset( encrypt ?
+				static_cast<AuthenticatedSymmetricCipher*>( new ChaCha20Poly1305::Encryption ) :
+				static_cast<AuthenticatedSymmetricCipher*>( new ChaCha20Poly1305::Decryption ) );
+		}
+#endif
+		else
+		{
+			throw runtime_error("AEADWrapper: unsupported algorithm");
+		}
+
+		// Nonce is replaced on every message, this one is never used
+		byte nonce[AEADWrapper::NonceSize] = {0};
+		c->SetKeyWithIV( &this->key[0], this->key.size(), nonce, sizeof( nonce ) );
+	}
+
+	return *c;
+}
+
+
+/*
+ * Certificates are created in process by X509Helper, keys are handed
+ * over as DER, or PEM when read from file, in wiped memory.
+ */
+
+static SecVector<byte> priv_der(RSAWrapper& key)
+{
+	vector<byte> der = key.GetPrivKeyAsDER();
+	SecVector<byte> ret( der.begin(), der.end() );
+	SecureWipeBuffer( der.data(), der.size() );
+
+	return ret;
+}
+
+static SecString priv_pem(const string& path)
 {
-	stringstream cmd;
-	cmd << "/usr/bin/openssl ";
-	cmd << "req -out \""<< csrpath << "\" -key \""<<  privkeypath << "\" -new -subj '/O="<<company<<"/CN="<<cn<<"'";
+	string pem = File::GetContentAsString( path, true );
+	SecString ret( pem.begin(), pem.end() );
+	SecureWipeBuffer( &pem[0], pem.size() );
 
-	bool ret;
-	tie(ret, ignore) = Process::Exec(cmd.str() );
 	return ret;
 }
 
+string MakeCSRAsPEM(RSAWrapper &key, const string &cn, const string &company)
+{
+	SecVector<byte> der = priv_der( key );
+	vector<byte> pem = X509Helper::MakeCSR( der.data(), der.size(), X509Helper::DER, cn, company, X509Helper::PEM );
+
+	return string( pem.begin(), pem.end() );
+}
+
+vector<byte> MakeCSRAsDER(RSAWrapper &key, const string &cn, const string &company)
+{
+	SecVector<byte> der = priv_der( key );
+	return X509Helper::MakeCSR( der.data(), der.size(), X509Helper::DER, cn, company, X509Helper::DER );
+}
+
+string MakeSelfSignedCertAsPEM(RSAWrapper &key, const string &cn, const string &company, unsigned int days)
+{
+	SecVector<byte> der = priv_der( key );
+	vector<byte> pem = X509Helper::MakeSelfSignedCert( der.data(), der.size(), X509Helper::DER, cn, company, days, X509Helper::PEM );
+
+	return string( pem.begin(), pem.end() );
+}
+
+vector<byte> MakeSelfSignedCertAsDER(RSAWrapper &key, const string &cn, const string &company, unsigned int days)
+{
+	SecVector<byte> der = priv_der( key );
+	return X509Helper::MakeSelfSignedCert( der.data(), der.size(), X509Helper::DER, cn, company, days, X509Helper::DER );
+}
+
+bool MakeCSR(const string &privkeypath, const string &csrpath, const string &cn, const string &company)
+{
+	try
+	{
+		SecString key = priv_pem( privkeypath );
+		vector<byte> csr = X509Helper::MakeCSR( reinterpret_cast<const byte*>( key.data() ), key.size(), X509Helper::PEM,
+				cn, company, X509Helper::PEM );
+
+		File::Write( csrpath, string( csr.begin(), csr.end() ), File::UserRW|File::GroupRead|File::OtherRead );
+	}
+	catch( std::exception& err )
+	{
+		logg << Logger::Error << "Failed to create CSR: " << err.what() << lend;
+		return false;
+	}
+
+	return true;
+}
+
 bool MakeSelfSignedCert(const string &privkeypath, const string &certpath, const string &cn, const string &company)
 {
-	stringstream cmd;
+	try
+	{
+		SecString key = priv_pem( privkeypath );
+		vector<byte> cert = X509Helper::MakeSelfSignedCert( reinterpret_cast<const byte*>( key.data() ), key.size(), X509Helper::PEM,
+				cn, company, 365, X509Helper::PEM );
 
-	// TODO: Parametrizise digest and vailidity
-	cmd << "/usr/bin/openssl ";
-	cmd << "req -x509 -sha512 -key " << privkeypath << " -out " << certpath << " -days 365 -subj '/O=" << company <<"/CN=" << cn <<"'";
+		File::Write( certpath, string( cert.begin(), cert.end() ), File::UserRW|File::GroupRead|File::OtherRead );
+	}
+	catch( std::exception& err )
+	{
+		logg << Logger::Error << "Failed to create certificate: " << err.what() << lend;
+		return false;
+	}
 
-	bool ret;
-	tie(ret, ignore) = Process::Exec(cmd.str() );
-	return ret;
+	return true;
 }
 
 }
@@ -1,12 +1,27 @@
 #ifndef CRYPTOHELPER_H
 #define CRYPTOHELPER_H
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <istream>
+#include <ostream>
 
 #include <crypto++/rsa.h>
 #include <crypto++/osrng.h>
 #include <crypto++/modes.h>
+#include <crypto++/cryptlib.h>
+#include <crypto++/sha.h>
+
+#include "Base64.h"
 
 using namespace CryptoPP;
 using namespace std;
@@ -23,6 +38,31 @@ using SecBasicString = basic_string<T, char_traits<T>, AllocatorWithCleanup<T>>;
 
 typedef SecBasicString<char> SecString;
 
+/*
+ * Non owning view of a contiguous byte range. Lets callers hand over
+ * data from whatever buffer they hold it in without copying.
+ */
+class ByteView
+{
+public:
+	ByteView(): ptr(nullptr), len(0) {}
+	ByteView(const byte* data, size_t size): ptr(data), len(size) {}
+	ByteView(const string& s): ptr( (const byte*) s.data() ), len( s.size() ) {}
+	ByteView(const SecString& s): ptr( (const byte*) s.data() ), len( s.size() ) {}
+	ByteView(const vector<byte>& v): ptr( v.data() ), len( v.size() ) {}
+	ByteView(const SecVector<byte>& v): ptr( v.data() ), len( v.size() ) {}
+
+	const byte* data() const { return this->ptr; }
+	size_t size() const { return this->len; }
+	bool empty() const { return this->len == 0; }
+
+	const byte* begin() const { return this->ptr; }
+	const byte* end() const { return this->ptr + this->len; }
+private:
+	const byte* ptr;
+	size_t len;
+};
+
 
 /*
  *
@@ -33,13 +73,26 @@ typedef SecBasicString<char> SecString;
 typedef std::shared_ptr<RSA::PublicKey> PublicKeyPtr;
 typedef std::shared_ptr<RSA::PrivateKey> PrivateKeyPtr;
 
+typedef RSASS<PKCS1v15, SHA1>::Signer RSASigner;
+typedef RSASS<PKCS1v15, SHA1>::Verifier RSAVerifier;
+
 class RSAWrapper
 {
 public:
 	RSAWrapper();
 
+	// Progress of key generation, from 0 to 1
+	typedef function<void(double progress)> Progress;
+
 	void GenerateKeys(unsigned int size=3072);
 
+	/*
+	 * Generate keys reporting progress while searching for primes.
+	 * Throws runtime_error, leaving current keys untouched, if
+	 * cancel is set before generation is done.
+	 */
+	void GenerateKeys(unsigned int size, const Progress& progress, const atomic<bool>* cancel = nullptr);
+
 	void LoadPrivKey(const string& path);
 	void LoadPubKey(const string& path);
 
@@ -65,18 +118,147 @@ public:
 	bool VerifyMessage(const string& message, const string &signature);
 	bool VerifyMessage(const string &message, const vector<byte>& signature);
 
+	// Signature is written to, and reuses the capacity of, signature
+	void SignMessage(ByteView message, vector<byte>& signature);
+	bool VerifyMessage(ByteView message, ByteView signature);
+
+	/*
+	 * Batch versions, spread over a pool with one worker per cpu.
+	 * Entry i in the result belongs to message i.
+	 */
+	vector<vector<byte>> SignBatch(const vector<string>& messages);
+	vector<vector<byte>> SignBatch(const vector<ByteView>& messages);
+	vector<bool> VerifyBatch(const vector<string>& messages, const vector<vector<byte>>& signatures);
+	vector<bool> VerifyBatch(const vector<ByteView>& messages, const vector<ByteView>& signatures);
+
 private:
 	static vector<byte> PEMToDER(const string& key);
+	void SetKeys(const InvertibleRSAFunction& params);
 	void ValidatePrivKey();
 	void ValidatePubKey();
 	bool priv_i, pub_i; // Keys initialized?
 	PrivateKeyPtr privkey;
 	PublicKeyPtr pubkey;
 	AutoSeededRandomPool rng;
+
+	// Created on first use, guarded, together with rng, by keylock
+	unique_ptr<RSASigner> signer;
+	unique_ptr<RSAVerifier> verifier;
+	mutex keylock;
+
+	// One per batch worker, only touched by its own worker
+	vector<unique_ptr<RSASigner>> batchsigners;
+	vector<unique_ptr<RSAVerifier>> batchverifiers;
 };
 
 typedef shared_ptr<RSAWrapper> RSAWrapperPtr;
 
+/*
+ *
+ * RSA key generation in a background thread
+ *
+ * Generation starts on construction. Progress is reported from the
+ * generating thread. Destroying an unfinished generator cancels it
+ * and waits for the thread to stop.
+ *
+ */
+
+class RSAKeyGen
+{
+public:
+	RSAKeyGen(unsigned int size = 3072, RSAWrapper::Progress progress = nullptr);
+
+	void Cancel();
+	bool Ready();
+
+	// Wait for key, throws if generation was cancelled or failed
+	RSAWrapperPtr Get();
+
+	virtual ~RSAKeyGen();
+private:
+	atomic<bool> cancel;
+	shared_future<RSAWrapperPtr> result;
+	thread worker;
+};
+
+/*
+ *
+ * Pool of pre generated RSA keys
+ *
+ * Once started a low priority background thread keeps up to count
+ * keys of size bits ready. Take hands out a ready key if there is one
+ * and otherwise generates one on the spot.
+ *
+ */
+
+class RSAKeyPool
+{
+public:
+	static void Start(size_t count = 1, unsigned int size = 3072);
+	static void Stop();
+
+	static RSAWrapperPtr Take(unsigned int size = 3072);
+	static size_t Available();
+private:
+	struct State
+	{
+		mutex control;	// Serializes Start and Stop
+		mutex lock;
+		condition_variable cv;
+		list<RSAWrapperPtr> keys;
+		size_t count = 0;
+		unsigned int size = 0;
+		atomic<bool> stop{false};
+		thread worker;
+
+		~State();
+	};
+
+	static State& state();
+	static void Halt(State& s);
+	static void Worker();
+};
+
+/*
+ *
+ * Process wide cache of loaded and validated RSA keys
+ *
+ * Keys are kept per source, ie a path or other identifier, together
+ * with a fingerprint of the key material. As long as the fingerprint
+ * is unchanged the cached, ready to sign, wrapper is returned without
+ * parsing or validating the key again. Returned wrappers are shared
+ * and must not be reloaded by the caller.
+ *
+ */
+
+class RSAKeyCache
+{
+public:
+	typedef function<RSAWrapperPtr()> Loader;
+
+	// Return cached key if fingerprint matches, otherwise load and cache it
+	static RSAWrapperPtr Get(const string& source, const string& fingerprint, const Loader& loader);
+
+	// PEM files, fingerprinted by inode, size and modification time
+	static RSAWrapperPtr FromPEMFiles(const string& privpath, const string& pubpath = "");
+
+	// Digest of key material to use as fingerprint
+	static string Fingerprint(ByteView data);
+
+	static void Invalidate(const string& source);
+	static void Clear();
+	static size_t Size();
+private:
+	struct Entry
+	{
+		string fingerprint;
+		RSAWrapperPtr key;
+	};
+
+	static mutex lock;
+	static map<string, Entry> keys;
+};
+
 /*
  *
  *	AES Wrapper
@@ -96,10 +278,29 @@ public:
 	void Decrypt(const vector<byte>& in, vector<byte>& out);
 	string Decrypt(const vector<byte>& in);
 
+	/*
+	 * Zero copy versions. Out must have room for in.size() + AES::BLOCKSIZE
+	 * bytes, returns number of bytes written.
+	 */
+	size_t Encrypt(ByteView in, byte* out);
+	size_t Decrypt(ByteView in, byte* out);
+	void Encrypt(ByteView in, SecVector<byte>& out);
+	void Decrypt(ByteView in, SecVector<byte>& out);
+
+	/*
+	 * Stream versions, processes input in fixed size chunks
+	 * using constant memory regardless of payload size.
+	 */
+	void Encrypt(istream& in, ostream& out);
+	void Decrypt(istream& in, ostream& out);
+	void Encrypt(int infd, int outfd);
+	void Decrypt(int infd, int outfd);
+
 	static void SetDefaultIV(const vector<byte>& iv);
 
 	virtual ~AESWrapper();
 private:
+	friend class AESStream;
 
 	SecVector<byte> key;
 	vector<byte> iv;
@@ -113,6 +314,108 @@ private:
 
 typedef shared_ptr<AESWrapper> AESWrapperPtr;
 
+/*
+ *
+ * Incremental AES CBC encryption/decryption
+ *
+ * Output is compatible with AESWrapper, i.e. CBC with PKCS#7 padding.
+ * Feed data with Update and finish with Final. Update writes at most
+ * len + AES::BLOCKSIZE bytes to out and Final at most AES::BLOCKSIZE bytes.
+ *
+ */
+
+class AESStream
+{
+public:
+	enum Mode
+	{
+		Encrypt,
+		Decrypt
+	};
+
+	AESStream(const AESWrapper& aes, Mode mode);
+	AESStream(const SecVector<byte>& key, Mode mode, const vector<byte>& iv=AESWrapper::defaultiv);
+
+	size_t Update(const byte* in, size_t len, byte* out);
+	size_t Final(byte* out);
+
+	// Restart with the same key and iv
+	void Reset();
+
+	virtual ~AESStream();
+private:
+	void Process(byte* out, const byte* in, size_t len);
+
+	Mode mode;
+	SecVector<byte> key;
+	vector<byte> iv;
+	CBC_Mode< AES >::Encryption e;
+	CBC_Mode< AES >::Decryption d;
+
+	byte buf[AES::BLOCKSIZE];
+	size_t buffered;
+};
+
+typedef shared_ptr<AESStream> AESStreamPtr;
+
+/*
+ *
+ * Authenticated encryption using AES-GCM or ChaCha20-Poly1305
+ *
+ * Messages are laid out as algorithm(1) | nonce | ciphertext | tag and
+ * a fresh random nonce is used for every message. Decrypt picks the
+ * algorithm from the message, thus data sealed on one board opens on
+ * any other regardless of what algorithm Auto resolved to.
+ *
+ */
+
+class AEADWrapper
+{
+public:
+	enum Algorithm
+	{
+		Auto,
+		AESGCM,
+		ChaChaPoly
+	};
+
+	static constexpr size_t KeySize		= 32;
+	static constexpr size_t NonceSize	= 12;
+	static constexpr size_t TagSize		= 16;
+	static constexpr size_t Overhead	= 1 + NonceSize + TagSize;
+
+	AEADWrapper(const SecVector<byte>& key, Algorithm alg = Auto);
+
+	string Encrypt(const string& plain, const string& aad = "");
+	void Encrypt(const vector<byte>& in, vector<byte>& out, const vector<byte>& aad = {});
+
+	// Throws if message fails authentication
+	string Decrypt(const string& cipher, const string& aad = "");
+	void Decrypt(const vector<byte>& in, vector<byte>& out, const vector<byte>& aad = {});
+
+	Algorithm GetAlgorithm() const;
+
+	// Fastest available algorithm on this cpu
+	static Algorithm Preferred();
+	static bool HasHardwareAES();
+	static bool HasAlgorithm(Algorithm alg);
+	static string AlgorithmName(Algorithm alg);
+
+	virtual ~AEADWrapper();
+private:
+	void Seal(byte* out, const byte* in, size_t len, const byte* aad, size_t aadlen);
+	size_t Open(byte* out, const byte* in, size_t len, const byte* aad, size_t aadlen);
+	AuthenticatedSymmetricCipher& Cipher(Algorithm alg, bool encrypt);
+
+	Algorithm alg;
+	SecVector<byte> key;
+	unique_ptr<AuthenticatedSymmetricCipher> enc[3];
+	unique_ptr<AuthenticatedSymmetricCipher> dec[3];
+	AutoSeededRandomPool rng;
+};
+
+typedef shared_ptr<AEADWrapper> AEADWrapperPtr;
+
 /*
  *
  * Crypt tools
@@ -124,13 +427,27 @@ bool MakeCSR(const string& privkeypath, const string& csrpath, const string& cn,
 
 bool MakeSelfSignedCert(const string& privkeypath, const string& certpath, const string& cn, const string& company);
 
+/*
+ * Requests and certificates created from an in memory key, subject is
+ * O=company, CN=cn. Throws runtime_error on failure.
+ */
+string MakeCSRAsPEM(RSAWrapper& key, const string& cn, const string& company);
+vector<byte> MakeCSRAsDER(RSAWrapper& key, const string& cn, const string& company);
+
+string MakeSelfSignedCertAsPEM(RSAWrapper& key, const string& cn, const string& company, unsigned int days = 365);
+vector<byte> MakeSelfSignedCertAsDER(RSAWrapper& key, const string& cn, const string& company, unsigned int days = 365);
+
 string Base64Encode(const vector<byte> &in);
 string Base64Encode(const string &s);
+string Base64Encode(ByteView in);
+void Base64Encode(ByteView in, string& out);
 
 string Base64DecodeToString(const string& s);
 vector<byte> Base64Decode( const string& data);
 void Base64Decode(const string& s, vector<byte>& out);
 void Base64Decode(const string& s, SecVector<byte>& out);
+void Base64Decode(ByteView in, vector<byte>& out, Base64::Mode mode = Base64::Lenient);
+void Base64Decode(ByteView in, SecVector<byte>& out, Base64::Mode mode = Base64::Lenient);
 
 
 extern const vector<byte> defaultsalt;
@@ -138,6 +455,60 @@ extern const vector<byte> defaultsalt;
 SecVector<byte> PBKDF2(const SecString& passwd, size_t keylength,
 		const vector<byte>& salt = defaultsalt, unsigned int iter=5000);
 
+/*
+ *
+ * Cache of PBKDF2 derived keys
+ *
+ * Entries are keyed by a keyed hash, with a per process random secret,
+ * of password, salt, iterations and key length. Derived keys are held
+ * in SecVector memory and wiped once their lifetime, counted from
+ * derivation, has passed or when evicted to make room for new ones.
+ *
+ */
+
+class KDFCache
+{
+public:
+	// Same as PBKDF2 but returns a cached key when there is one
+	static SecVector<byte> PBKDF2(const SecString& passwd, size_t keylength,
+			const vector<byte>& salt = defaultsalt, unsigned int iter=5000);
+
+	// Lifetime in seconds of cached keys, 0 disables caching
+	static void SetLifetime(unsigned int seconds);
+	static void SetMaxEntries(size_t entries);
+
+	static void Clear();
+	static size_t Size();
+private:
+	struct Entry
+	{
+		SecVector<byte> key;
+		chrono::steady_clock::time_point expires;
+	};
+
+	struct State
+	{
+		mutex lock;
+		condition_variable cv;
+		map<string, Entry> keys;
+		SecVector<byte> secret;
+		unsigned int lifetime = 300;
+		size_t maxentries = 16;
+		bool stop = false;
+		thread reaper;
+
+		State();
+		~State();
+	};
+
+	static State& state();
+	static string Digest(const State& s, const SecString& passwd, size_t keylength,
+			const vector<byte>& salt, unsigned int iter);
+	static map<string, Entry>::iterator Oldest(State& s);
+	static void Expire(State& s);
+	static void Reaper();
+};
+
 #if 0
 vector<byte> PBKDF2(const string &passwd, size_t keylength,
 		const vector<byte>& salt = defaultsalt, unsigned int iter=5000);
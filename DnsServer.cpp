@@ -30,19 +30,17 @@ tuple<int, json> DnsServer::CheckOPIName(const string &opiname)
 		{"checkname",  "1"}
 	};
 
-	string body = this->DoPost("update_dns.php", postargs);
+	return this->PostJson("update_dns.php", postargs);
+}
 
-	json retobj;
-	try
-	{
-		retobj = json::parse(body);
-	}
-	catch (json::parse_error& err)
-	{
-		logg << Logger::Error << "Failed to parse response: " << err.what() << lend;
-	}
+HttpMulti::Handle<tuple<int, json>> DnsServer::CheckOPINameAsync(const string &opiname, long timeout)
+{
+	map<string,string> postargs = {
+		{"fqdn", opiname},
+		{"checkname",  "1"}
+	};
 
-	return tuple<int,json>(this->result_code, retobj );
+	return this->PostJsonAsync("update_dns.php", postargs, timeout);
 }
 
 bool DnsServer::RegisterPublicKey(const string &unit_id, const string &key, const string &token)
@@ -111,7 +109,7 @@ bool DnsServer::UpdateDynDNS(const string &unit_id, const string &name)
 
         if ( sysconfig.HasKey("hostinfo","domain") )
         {
-            domain=sysconfig.GetKeyAsString("hostinfo","domain");
+            domain=sysconfig.Get<Keys::Hostinfo::Domain>();
         }
         else
         {
@@ -125,20 +123,11 @@ bool DnsServer::UpdateDynDNS(const string &unit_id, const string &name)
     }
 
 
-	string body = this->DoPost("update_dns.php", postargs);
-	bool parseok = true;
-	json retobj;
-	try
-	{
-		retobj = json::parse(body);
-	}
-	catch (json::parse_error& err)
-	{
-		logg << Logger::Error << "Failed to parse response: " << err.what() << lend;
-		parseok = false;
-	}
+	int resultcode;
+	json reply;
+	tie(resultcode, reply) = this->PostJson("update_dns.php", postargs);
 
-	return this->result_code == Status::Ok && parseok;
+	return resultcode == Status::Ok && ! reply.is_null();
 }
 
 DnsServer::~DnsServer()
@@ -162,18 +151,9 @@ bool DnsServer::Auth(const string &unit_id)
 		}
 
 
-		RSAWrapper dnskeys;
-		list<string> rows = File::GetContent( SysConfig().GetKeyAsString("dns", "dnsauthkey") );
-		stringstream pemkey;
-
-		for( const auto& row: rows)
-		{
-			pemkey << row << "\n";
-		}
-
-		dnskeys.LoadPrivKeyFromPEM( pemkey.str() );
+		RSAWrapperPtr dnskeys = RSAKeyCache::FromPEMFiles( SysConfig().Get<Keys::Dns::DnsAuthKey>() );
 
-		string signedchallenge = Base64Encode( dnskeys.SignMessage( challenge ) );
+		string signedchallenge = Base64Encode( dnskeys->SignMessage( challenge ) );
 
 		json rep;
 		tie(resultcode, rep) = this->SendSignedChallenge( unit_id, signedchallenge );
@@ -6,6 +6,7 @@
 
 #include <nlohmann/json.hpp>
 
+#include <future>
 #include <string>
 #include <tuple>
 
@@ -22,6 +23,10 @@ public:
 
 	tuple<int, json> CheckOPIName( const string& opiname );
 
+	// Start a check without waiting, lots of names can be checked in
+	// parallel. Each can be cancelled through its handle, timeout in ms.
+	HttpMulti::Handle<tuple<int, json>> CheckOPINameAsync( const string& opiname, long timeout = 0 );
+
 	bool RegisterPublicKey(const string& unit_id, const string& key, const string& token );
 
 	bool UpdateDynDNS(const string& unit_id, const string& name);
@@ -2,14 +2,297 @@
 #include "SysConfig.h"
 #include "Config.h"
 
+#include <libutils/Exceptions.h>
 #include <libutils/FileUtils.h>
+#include <libutils/Logger.h>
 
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
 #include <utility>
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+using namespace Utils;
+
 namespace OPI
 {
 
-HttpClient::HttpClient(const string& host, bool verifyca): host(host),port(0), timeout(0), verifyca(verifyca)
+/*
+ *
+ * Body sinks
+ *
+ */
+
+CallbackSink::CallbackSink(Callback callback): callback( callback )
+{
+}
+
+bool CallbackSink::Write(const char *data, size_t len)
+{
+	return this->callback( data, len );
+}
+
+FdSink::FdSink(int fd): fd( fd ), written( 0 ), error( 0 )
+{
+}
+
+bool FdSink::Write(const char *data, size_t len)
+{
+	while( len > 0 )
+	{
+		ssize_t w = write( this->fd, data, len );
+		if( w < 0 )
+		{
+			if( errno == EINTR )
+			{
+				continue;
+			}
+			this->error = errno;
+			logg << Logger::Error << "FdSink: write failed: " << strerror( errno ) << lend;
+			return false;
+		}
+		data += w;
+		len -= w;
+		this->written += w;
+	}
+	return true;
+}
+
+size_t FdSink::Written()
+{
+	return this->written;
+}
+
+int FdSink::Error()
+{
+	return this->error;
+}
+
+// Chunks queued for the parser thread, bounds memory if the parser lags
+static constexpr size_t maxchunks = 8;
+
+void JsonSink::Stream::Push(string &&chunk)
+{
+	unique_lock<mutex> l( this->lock );
+	this->space.wait( l, [this]{ return ! this->bounded || this->chunks.size() < maxchunks || this->closed; } );
+	if( ! this->closed )
+	{
+		this->chunks.push_back( std::move( chunk ) );
+		this->avail.notify_one();
+	}
+}
+
+void JsonSink::Stream::End()
+{
+	lock_guard<mutex> l( this->lock );
+	this->eof = true;
+	this->avail.notify_one();
+}
+
+// Reader is done, possibly early on a parse error, release any writer
+void JsonSink::Stream::Close()
+{
+	lock_guard<mutex> l( this->lock );
+	this->closed = true;
+	this->chunks.clear();
+	this->space.notify_all();
+}
+
+void JsonSink::Stream::Unbounded()
+{
+	lock_guard<mutex> l( this->lock );
+	this->bounded = false;
+	this->space.notify_all();
+}
+
+JsonSink::Stream::int_type JsonSink::Stream::underflow()
+{
+	unique_lock<mutex> l( this->lock );
+	this->avail.wait( l, [this]{ return ! this->chunks.empty() || this->eof; } );
+	if( this->chunks.empty() )
+	{
+		return traits_type::eof();
+	}
+
+	this->current = std::move( this->chunks.front() );
+	this->chunks.pop_front();
+	this->space.notify_one();
+
+	char* start = &this->current[0];
+	this->setg( start, start, start + this->current.size() );
+
+	return traits_type::to_int_type( *start );
+}
+
+JsonSink::JsonSink(): JsonSink( nullptr )
+{
+}
+
+JsonSink::JsonSink(SAX *sax): sax( sax ), failed( false ), finished( false )
+{
+}
+
+bool JsonSink::Write(const char *data, size_t len)
+{
+	if( this->failed )
+	{
+		// Drain the rest of the body, the error is reported by Ok
+		return true;
+	}
+
+	if( ! this->parser.joinable() )
+	{
+		this->pending.append( data, len );
+		if( this->pending.size() <= JsonSink::StreamThreshold )
+		{
+			return true;
+		}
+
+		this->parser = thread( [this]()
+		{
+			istream in( &this->stream );
+			this->Parse( in );
+			this->stream.Close();
+		});
+
+		this->stream.Push( std::move( this->pending ) );
+		this->pending.clear();
+		return true;
+	}
+
+	this->stream.Push( string( data, len ) );
+
+	return true;
+}
+
+void JsonSink::Finish()
+{
+	if( this->finished )
+	{
+		return;
+	}
+	this->finished = true;
+
+	if( this->parser.joinable() )
+	{
+		this->stream.End();
+		this->parser.join();
+	}
+	else
+	{
+		this->Parse( this->pending );
+		string().swap( this->pending );
+	}
+}
+
+void JsonSink::NonBlocking()
+{
+	this->stream.Unbounded();
+}
+
+bool JsonSink::Ok()
+{
+	return this->finished && ! this->failed;
+}
+
+string JsonSink::Error()
+{
+	return this->error;
+}
+
+nlohmann::json &JsonSink::Result()
+{
+	return this->result;
+}
+
+JsonSink::~JsonSink()
+{
+	this->Finish();
+}
+
+template<class Input>
+void JsonSink::Parse(Input &in)
+{
+	try
+	{
+		if( this->sax )
+		{
+			if( ! nlohmann::json::sax_parse( in, this->sax ) )
+			{
+				this->error = "Parse aborted";
+				this->failed = true;
+			}
+		}
+		else
+		{
+			this->result = nlohmann::json::parse( in );
+		}
+	}
+	catch( std::exception& err )
+	{
+		this->error = err.what();
+		this->failed = true;
+	}
+}
+
+/*
+ * Process wide share handle. Curl calls lock and unlock around every
+ * access of shared data, one mutex per kind of data.
+ *
+ * Only DNS and TLS sessions are shared. Curl does not support sharing
+ * connections between handles used concurrently from different threads,
+ * as blocking requests and the HttpMulti loop do. Connections are
+ * instead reused per easy handle, and per multi handle for async
+ * requests.
+ */
+class CurlShare
+{
+public:
+	CurlShare(): handle( curl_share_init() )
+	{
+		if( ! this->handle )
+		{
+			throw runtime_error("Unable to init Curl share");
+		}
+
+		curl_share_setopt( this->handle, CURLSHOPT_LOCKFUNC, CurlShare::Lock );
+		curl_share_setopt( this->handle, CURLSHOPT_UNLOCKFUNC, CurlShare::Unlock );
+		curl_share_setopt( this->handle, CURLSHOPT_USERDATA, this );
+
+		curl_share_setopt( this->handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS );
+		curl_share_setopt( this->handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION );
+	}
+
+	CURLSH* Handle()
+	{
+		return this->handle;
+	}
+
+	~CurlShare()
+	{
+		curl_share_cleanup( this->handle );
+	}
+private:
+	static void Lock(CURL*, curl_lock_data data, curl_lock_access, void* userp)
+	{
+		static_cast<CurlShare*>(userp)->locks[data].lock();
+	}
+
+	static void Unlock(CURL*, curl_lock_data data, void* userp)
+	{
+		static_cast<CurlShare*>(userp)->locks[data].unlock();
+	}
+
+	CURLSH* handle;
+	mutex locks[CURL_LOCK_DATA_LAST];
+};
+
+HttpClient::HttpClient(const string& host, bool verifyca): host(host),port(0), timeout(0), verifyca(verifyca),
+	keepalive(true), maxidle(118), shared(true)
 {
 	this->curl = curl_easy_init();
 	if( ! this->curl )
@@ -19,7 +302,7 @@ HttpClient::HttpClient(const string& host, bool verifyca): host(host),port(0), t
 
 	try
 	{
-		this->defaultca = SysConfig().GetKeyAsString("hostinfo", "cafile");
+		this->defaultca = SysConfig().Get<Keys::Hostinfo::CaFile>();
 
 		string rpca = Utils::File::RealPath(this->defaultca);
 		if( ! Utils::File::FileExists(rpca) )
@@ -45,41 +328,66 @@ HttpClient::~HttpClient()
 void HttpClient::CurlPre()
 {
 	curl_easy_reset( this->curl );
-	this->body.str("");
+	this->body.clear();
+
+	this->CurlSetup( this->curl );
 
+	curl_easy_setopt(this->curl, CURLOPT_WRITEFUNCTION, HttpClient::WriteCallback );
+	curl_easy_setopt(this->curl, CURLOPT_WRITEDATA, (void *)this);
+}
+
+/*
+ * Settings of this client, common to synchronous and asynchronous requests
+ */
+void HttpClient::CurlSetup(CURL *handle)
+{
 	if( verifyca )
 	{
 
 		if( this->defaultca != "" )
 		{
-			curl_easy_setopt(this->curl, CURLOPT_CAINFO, this->defaultca.c_str() );
+			curl_easy_setopt(handle, CURLOPT_CAINFO, this->defaultca.c_str() );
 		}
 
 		if( this->capath != "" )
 		{
-			curl_easy_setopt(this->curl, CURLOPT_CAPATH, this->capath.c_str() );
+			curl_easy_setopt(handle, CURLOPT_CAPATH, this->capath.c_str() );
 		}
 	}
 	else
 	{
-		curl_easy_setopt(this->curl, CURLOPT_SSL_VERIFYPEER, 0L);
-		curl_easy_setopt(this->curl, CURLOPT_SSL_VERIFYHOST, 0L);
+		curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, 0L);
+		curl_easy_setopt(handle, CURLOPT_SSL_VERIFYHOST, 0L);
 	}
 
-	curl_easy_setopt(this->curl, CURLOPT_WRITEFUNCTION, HttpClient::WriteCallback );
-	curl_easy_setopt(this->curl, CURLOPT_WRITEDATA, (void *)this);
-
 	// Override protocol default port
 	if( port != 0 )
 	{
-		curl_easy_setopt(this->curl, CURLOPT_PORT, this->port);
+		curl_easy_setopt(handle, CURLOPT_PORT, this->port);
 	}
 
 	if( this->timeout != 0)
 	{
-		curl_easy_setopt(this->curl, CURLOPT_CONNECTTIMEOUT, this->timeout);
+		curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, this->timeout);
+	}
+
+	// Caches are kept in the share handle, not in the easy handle
+	if( this->shared )
+	{
+		curl_easy_setopt(handle, CURLOPT_SHARE, HttpClient::share() );
 	}
 
+	if( this->keepalive )
+	{
+		curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+#if LIBCURL_VERSION_NUM >= 0x074100
+		curl_easy_setopt(handle, CURLOPT_MAXAGE_CONN, this->maxidle);
+#endif
+	}
+	else
+	{
+		curl_easy_setopt(handle, CURLOPT_FORBID_REUSE, 1L);
+	}
 }
 
 /*
@@ -90,6 +398,11 @@ void HttpClient::CurlSetHeaders(const map<string, string>& headers)
 	this->headers = headers;
 }
 
+void HttpClient::CurlSetSink(BodySinkPtr sink)
+{
+	this->sink = sink;
+}
+
 string HttpClient::DoGet(const string& path, const map<string, string>& data)
 {
 	this->CurlPre();
@@ -114,6 +427,93 @@ string HttpClient::DoPost(const string& path, const map<string, string>& data)
 	return this->CurlPerform();
 }
 
+CURL *HttpClient::CurlAsyncPre()
+{
+	CURL* handle = curl_easy_init();
+	if( ! handle )
+	{
+		throw runtime_error("Unable to init Curl");
+	}
+
+	this->CurlSetup( handle );
+
+	return handle;
+}
+
+HttpMulti::RequestID HttpClient::DoGetAsync(const string &path, const map<string, string> &data, HttpMulti::Callback callback, long timeout)
+{
+	struct curl_slist* headers = this->makeheaders();
+	this->headers.clear();
+
+	CURL* handle = this->CurlAsyncPre();
+
+	string url = this->host+path+"?"+this->MakeFormData(data);
+	curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+
+	return HttpMulti::Default().Add( handle, headers, callback, timeout, std::move( this->sink ) );
+}
+
+HttpMulti::RequestID HttpClient::DoPostAsync(const string &path, const map<string, string> &data, HttpMulti::Callback callback, long timeout)
+{
+	struct curl_slist* headers = this->makeheaders();
+	this->headers.clear();
+
+	CURL* handle = this->CurlAsyncPre();
+
+	string url = this->host+path;
+	curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+
+	// Request outlives this call, let curl keep its own copy
+	string poststring = this->MakeFormData(data);
+	curl_easy_setopt(handle, CURLOPT_COPYPOSTFIELDS, poststring.c_str() );
+
+	return HttpMulti::Default().Add( handle, headers, callback, timeout, std::move( this->sink ) );
+}
+
+tuple<int, nlohmann::json> HttpClient::PostJson(const string &path, const map<string, string> &data)
+{
+	auto reply = make_shared<JsonSink>();
+
+	this->CurlSetSink( reply );
+	this->DoPost( path, data );
+
+	if( ! reply->Ok() )
+	{
+		logg << Logger::Error << "Failed to parse response: " << reply->Error() << lend;
+	}
+
+	return tuple<int, nlohmann::json>( this->result_code, reply->Result() );
+}
+
+HttpMulti::Handle<tuple<int, nlohmann::json>> HttpClient::PostJsonAsync(const string &path, const map<string, string> &data, long timeout)
+{
+	auto result = make_shared<promise<tuple<int, nlohmann::json>>>();
+	auto reply = make_shared<JsonSink>();
+
+	HttpMulti::Handle<tuple<int, nlohmann::json>> handle;
+	handle.multi = &HttpMulti::Default();
+	handle.result = result->get_future();
+
+	this->CurlSetSink( reply );
+	handle.id = this->DoPostAsync( path, data, [result, reply](const HttpMulti::Response& res)
+	{
+		if( res.result != CURLE_OK )
+		{
+			result->set_exception( make_exception_ptr( runtime_error( curl_easy_strerror( res.result ) ) ) );
+			return;
+		}
+
+		if( ! reply->Ok() )
+		{
+			logg << Logger::Error << "Failed to parse response: " << reply->Error() << lend;
+		}
+
+		result->set_value( tuple<int, nlohmann::json>( res.code, reply->Result() ) );
+	}, timeout);
+
+	return handle;
+}
+
 string HttpClient::CurlPerform()
 {
 
@@ -123,6 +523,13 @@ string HttpClient::CurlPerform()
 
 	this->clearheaders();
 
+	BodySinkPtr sink = std::move( this->sink );
+	this->sink.reset();
+	if( sink )
+	{
+		sink->Finish();
+	}
+
 	if(res != CURLE_OK)
 	{
 		throw runtime_error( curl_easy_strerror(res) );
@@ -134,7 +541,20 @@ string HttpClient::CurlPerform()
 		throw runtime_error( curl_easy_strerror(res) );
 	}
 
-	return this->body.str();
+	string ret;
+	ret.swap( this->body );
+
+	return ret;
+}
+
+bool HttpClient::ConnectionReused()
+{
+	long connects = 0;
+	if( curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects) != CURLE_OK )
+	{
+		return false;
+	}
+	return connects == 0;
 }
 
 string HttpClient::MakeFormData(const map<string, string>& data)
@@ -173,24 +593,37 @@ string HttpClient::EscapeString(const string &arg)
 size_t HttpClient::WriteCallback(void *contents, size_t size, size_t nmemb, void *userp)
 {
 	HttpClient* serv = static_cast<HttpClient*>(userp);
-	serv->body.write((char*)contents, size*nmemb);
+	if( serv->sink )
+	{
+		// Anything but size*nmemb aborts the transfer
+		return serv->sink->Write( static_cast<const char*>( contents ), size*nmemb ) ? size*nmemb : 0;
+	}
+	serv->body.append( static_cast<const char*>( contents ), size*nmemb );
 	return size*nmemb;
 }
 
-void HttpClient::setheaders()
+struct curl_slist *HttpClient::makeheaders()
 {
-	if( this->headers.size() > 0 )
+	struct curl_slist* list = nullptr;
+	for(const auto& h: this->headers )
 	{
-		this->slist = nullptr;
-		for(const auto& h: this->headers )
+		string header = h.first+ ":" + h.second;
+		struct curl_slist* next = curl_slist_append( list, header.c_str() );
+		if( ! next )
 		{
-			string header = h.first+ ":" + h.second;
-			this->slist = curl_slist_append( this->slist, header.c_str() );
-			if( ! this->slist )
-			{
-				throw runtime_error("Failed to append custom header");
-			}
+			curl_slist_free_all( list );
+			throw runtime_error("Failed to append custom header");
 		}
+		list = next;
+	}
+	return list;
+}
+
+void HttpClient::setheaders()
+{
+	if( this->headers.size() > 0 )
+	{
+		this->slist = this->makeheaders();
 		curl_easy_setopt( this->curl , CURLOPT_HTTPHEADER, this->slist);
 	}
 }
@@ -204,6 +637,12 @@ void HttpClient::clearheaders()
 	}
 }
 
+CURLSH *HttpClient::share()
+{
+	static CurlShare share;
+	return share.Handle();
+}
+
 void HttpClient::setPort(long value)
 {
 	port = value;
@@ -224,4 +663,370 @@ void HttpClient::setCAPath(const string &path)
 	this->capath = path;
 }
 
+void HttpClient::setKeepAlive(bool keepalive, long maxidle)
+{
+	this->keepalive = keepalive;
+	this->maxidle = maxidle;
+}
+
+void HttpClient::setShared(bool shared)
+{
+	this->shared = shared;
+}
+
+/*
+ *
+ * Begin implementation HttpMulti
+ *
+ */
+
+HttpMulti::HttpMulti(): timerset(false), nextid(1), stop(false)
+{
+	this->multi = curl_multi_init();
+	if( ! this->multi )
+	{
+		throw runtime_error("Unable to init Curl multi");
+	}
+
+	this->epollfd = epoll_create1( EPOLL_CLOEXEC );
+	if( this->epollfd < 0 )
+	{
+		curl_multi_cleanup( this->multi );
+		throw ErrnoException("Unable to create epoll");
+	}
+
+	this->wakefd = ::eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+	if( this->wakefd < 0 )
+	{
+		close( this->epollfd );
+		curl_multi_cleanup( this->multi );
+		throw ErrnoException("Unable to create eventfd");
+	}
+
+	struct epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.fd = this->wakefd;
+	epoll_ctl( this->epollfd, EPOLL_CTL_ADD, this->wakefd, &ev );
+
+	curl_multi_setopt( this->multi, CURLMOPT_SOCKETFUNCTION, HttpMulti::SocketCallback );
+	curl_multi_setopt( this->multi, CURLMOPT_SOCKETDATA, this );
+	curl_multi_setopt( this->multi, CURLMOPT_TIMERFUNCTION, HttpMulti::TimerCallback );
+	curl_multi_setopt( this->multi, CURLMOPT_TIMERDATA, this );
+
+	this->worker = thread( &HttpMulti::Loop, this );
+}
+
+HttpMulti::RequestID HttpMulti::Add(CURL *easy, curl_slist *headers, Callback callback, long timeout, BodySinkPtr sink)
+{
+	unique_ptr<Request> req( new Request );
+	req->easy = easy;
+	req->headers = headers;
+	req->callback = callback;
+	req->sink = sink;
+	if( sink )
+	{
+		sink->NonBlocking();
+	}
+
+	curl_easy_setopt( easy, CURLOPT_WRITEFUNCTION, HttpMulti::WriteCallback );
+	curl_easy_setopt( easy, CURLOPT_WRITEDATA, (void *) req.get() );
+	curl_easy_setopt( easy, CURLOPT_PRIVATE, (void *) req.get() );
+	if( headers )
+	{
+		curl_easy_setopt( easy, CURLOPT_HTTPHEADER, headers );
+	}
+	if( timeout > 0 )
+	{
+		curl_easy_setopt( easy, CURLOPT_TIMEOUT_MS, timeout );
+	}
+
+	RequestID id;
+	{
+		lock_guard<mutex> l( this->lock );
+		id = req->id = this->nextid++;
+		this->added.push_back( req.get() );
+		this->requests[id] = std::move( req );
+	}
+	this->Wakeup();
+
+	return id;
+}
+
+future<HttpMulti::Response> HttpMulti::Add(CURL *easy, curl_slist *headers, long timeout, BodySinkPtr sink)
+{
+	auto result = make_shared<promise<Response>>();
+
+	this->Add( easy, headers, [result](const Response& response)
+	{
+		result->set_value( response );
+	}, timeout, sink );
+
+	return result->get_future();
+}
+
+bool HttpMulti::Cancel(RequestID id)
+{
+	{
+		lock_guard<mutex> l( this->lock );
+		if( this->requests.find( id ) == this->requests.end() )
+		{
+			return false;
+		}
+		this->cancelled.push_back( id );
+	}
+	this->Wakeup();
+
+	return true;
+}
+
+size_t HttpMulti::Pending()
+{
+	lock_guard<mutex> l( this->lock );
+	return this->requests.size();
+}
+
+HttpMulti &HttpMulti::Default()
+{
+	static HttpMulti engine;
+	return engine;
+}
+
+HttpMulti::~HttpMulti()
+{
+	{
+		lock_guard<mutex> l( this->lock );
+		this->stop = true;
+	}
+	this->Wakeup();
+
+	if( this->worker.joinable() )
+	{
+		this->worker.join();
+	}
+
+	close( this->wakefd );
+	close( this->epollfd );
+	curl_multi_cleanup( this->multi );
+}
+
+HttpMulti::Request::~Request()
+{
+	curl_easy_cleanup( this->easy );
+	curl_slist_free_all( this->headers );
+}
+
+/*
+ * All work on the multi handle is done here. Other threads only queue
+ * additions and cancellations and wake us through the eventfd.
+ */
+void HttpMulti::Loop()
+{
+	struct epoll_event events[16];
+	int running = 0;
+
+	while( true )
+	{
+		int wait = -1;
+		if( this->timerset )
+		{
+			auto left = chrono::duration_cast<chrono::milliseconds>( this->deadline - chrono::steady_clock::now() );
+			wait = left.count() > 0 ? left.count() : 0;
+		}
+
+		int n = epoll_wait( this->epollfd, events, 16, wait );
+		if( n < 0 && errno != EINTR )
+		{
+			logg << Logger::Error << "HttpMulti: epoll_wait failed: " << strerror( errno ) << lend;
+			break;
+		}
+
+		for( int i = 0; i < n; i++ )
+		{
+			if( events[i].data.fd == this->wakefd )
+			{
+				uint64_t val;
+				while( read( this->wakefd, &val, sizeof( val ) ) > 0 );
+				continue;
+			}
+
+			int flags = 0;
+			flags |= ( events[i].events & EPOLLIN ) ? CURL_CSELECT_IN : 0;
+			flags |= ( events[i].events & EPOLLOUT ) ? CURL_CSELECT_OUT : 0;
+			flags |= ( events[i].events & ( EPOLLERR | EPOLLHUP ) ) ? CURL_CSELECT_ERR : 0;
+			curl_multi_socket_action( this->multi, events[i].data.fd, flags, &running );
+		}
+
+		vector<Request*> added;
+		vector<RequestID> cancelled;
+		bool stopping;
+		{
+			lock_guard<mutex> l( this->lock );
+			added.swap( this->added );
+			cancelled.swap( this->cancelled );
+			stopping = this->stop;
+		}
+
+		for( Request* req: added )
+		{
+			curl_multi_add_handle( this->multi, req->easy );
+		}
+
+		for( RequestID id: cancelled )
+		{
+			Request* req = nullptr;
+			{
+				lock_guard<mutex> l( this->lock );
+				auto it = this->requests.find( id );
+				if( it != this->requests.end() )
+				{
+					req = it->second.get();
+				}
+			}
+			if( req )
+			{
+				this->Finish( req, CURLE_ABORTED_BY_CALLBACK );
+			}
+		}
+
+		if( stopping )
+		{
+			break;
+		}
+
+		// Checked after additions, adding a handle asks for an immediate timeout
+		if( this->timerset && chrono::steady_clock::now() >= this->deadline )
+		{
+			this->timerset = false;
+			curl_multi_socket_action( this->multi, CURL_SOCKET_TIMEOUT, 0, &running );
+		}
+
+		CURLMsg* msg;
+		int left;
+		while( ( msg = curl_multi_info_read( this->multi, &left ) ) )
+		{
+			if( msg->msg == CURLMSG_DONE )
+			{
+				Request* req = nullptr;
+				curl_easy_getinfo( msg->easy_handle, CURLINFO_PRIVATE, (char **) &req );
+				this->Finish( req, msg->data.result );
+			}
+		}
+	}
+
+	// Anything still outstanding is cancelled
+	vector<Request*> left;
+	{
+		lock_guard<mutex> l( this->lock );
+		for( auto& req: this->requests )
+		{
+			left.push_back( req.second.get() );
+		}
+	}
+	for( Request* req: left )
+	{
+		this->Finish( req, CURLE_ABORTED_BY_CALLBACK );
+	}
+}
+
+void HttpMulti::Wakeup()
+{
+	uint64_t val = 1;
+	if( write( this->wakefd, &val, sizeof( val ) ) < 0 && errno != EAGAIN )
+	{
+		logg << Logger::Error << "HttpMulti: failed to wake loop: " << strerror( errno ) << lend;
+	}
+}
+
+// Removing a handle not yet added, or already removed, is harmless
+void HttpMulti::Finish(Request *req, CURLcode result)
+{
+	curl_multi_remove_handle( this->multi, req->easy );
+
+	Response response;
+	response.result = result;
+	response.code = 0;
+	if( result == CURLE_OK )
+	{
+		curl_easy_getinfo( req->easy, CURLINFO_RESPONSE_CODE, &response.code );
+	}
+	response.body = std::move( req->body );
+
+	if( req->sink )
+	{
+		req->sink->Finish();
+	}
+
+	Callback callback = std::move( req->callback );
+
+	{
+		lock_guard<mutex> l( this->lock );
+		this->requests.erase( req->id );
+	}
+
+	try
+	{
+		callback( response );
+	}
+	catch( std::exception& err )
+	{
+		logg << Logger::Error << "HttpMulti: request callback failed: " << err.what() << lend;
+	}
+	catch( ... )
+	{
+		// Must not escape loop thread
+		logg << Logger::Error << "HttpMulti: request callback failed" << lend;
+	}
+}
+
+int HttpMulti::SocketCallback(CURL*, curl_socket_t s, int what, void *userp, void *socketp)
+{
+	HttpMulti* m = static_cast<HttpMulti*>( userp );
+
+	if( what == CURL_POLL_REMOVE )
+	{
+		// Socket might already be closed and thus gone from epoll
+		epoll_ctl( m->epollfd, EPOLL_CTL_DEL, s, nullptr );
+		curl_multi_assign( m->multi, s, nullptr );
+		return 0;
+	}
+
+	struct epoll_event ev = {};
+	ev.events = ( what & CURL_POLL_IN ? EPOLLIN : 0 ) | ( what & CURL_POLL_OUT ? EPOLLOUT : 0 );
+	ev.data.fd = s;
+
+	// Socket pointer marks sockets already in epoll
+	if( socketp )
+	{
+		epoll_ctl( m->epollfd, EPOLL_CTL_MOD, s, &ev );
+	}
+	else
+	{
+		epoll_ctl( m->epollfd, EPOLL_CTL_ADD, s, &ev );
+		curl_multi_assign( m->multi, s, m );
+	}
+
+	return 0;
+}
+
+int HttpMulti::TimerCallback(CURLM*, long timeout, void *userp)
+{
+	HttpMulti* m = static_cast<HttpMulti*>( userp );
+
+	m->timerset = timeout >= 0;
+	m->deadline = chrono::steady_clock::now() + chrono::milliseconds( timeout );
+
+	return 0;
+}
+
+size_t HttpMulti::WriteCallback(void *contents, size_t size, size_t nmemb, void *userp)
+{
+	Request* req = static_cast<Request*>( userp );
+	if( req->sink )
+	{
+		return req->sink->Write( static_cast<const char*>( contents ), size*nmemb ) ? size*nmemb : 0;
+	}
+	req->body.append( static_cast<const char*>( contents ), size*nmemb );
+	return size*nmemb;
+}
+
 } // End NS
@@ -1,11 +1,23 @@
 #ifndef HTTPCLIENT_H
 #define HTTPCLIENT_H
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
-#include <map>
+#include <thread>
+#include <vector>
 
 #include <curl/curl.h>
+#include <nlohmann/json.hpp>
 
 
 using namespace std;
@@ -13,6 +25,226 @@ using namespace std;
 namespace OPI
 {
 
+/*
+ *
+ * Destinations for response bodies
+ *
+ * Data is handed to the sink as it arrives instead of being collected
+ * by the client. A sink is used for one request only.
+ *
+ */
+
+class BodySink
+{
+public:
+	// Return false to abort the transfer
+	virtual bool Write(const char* data, size_t len) = 0;
+
+	// No more data, called once the transfer is over, also on failure
+	virtual void Finish() {}
+
+	// Data will arrive on the HttpMulti loop thread, shared by all
+	// asynchronous requests, Write should not wait on anything
+	virtual void NonBlocking() {}
+
+	virtual ~BodySink() = default;
+};
+
+typedef shared_ptr<BodySink> BodySinkPtr;
+
+class CallbackSink: public BodySink
+{
+public:
+	typedef function<bool(const char* data, size_t len)> Callback;
+
+	CallbackSink(Callback callback);
+
+	bool Write(const char* data, size_t len) override;
+private:
+	Callback callback;
+};
+
+// Writes to fd, which is not closed, a failed write aborts the transfer
+class FdSink: public BodySink
+{
+public:
+	FdSink(int fd);
+
+	bool Write(const char* data, size_t len) override;
+
+	size_t Written();
+	// Errno of failed write, 0 if none
+	int Error();
+private:
+	int fd;
+	size_t written;
+	int error;
+};
+
+/*
+ * Parses the body as JSON while it is downloaded. Small bodies are
+ * parsed in one go once complete, larger ones are streamed to a parser
+ * thread since the nlohmann parser pulls its input.
+ *
+ * A parse error never aborts the transfer, the rest of the body is
+ * discarded and the error is reported by Ok and Error.
+ *
+ * On an asynchronous request Finish is called on the HttpMulti loop and
+ * waits for the parser to reach the end of a large body, other transfers
+ * on the engine are held up meanwhile. The parser keeps up with the
+ * download so this is usually short, but fetch very large documents with
+ * a blocking request.
+ */
+class JsonSink: public BodySink
+{
+public:
+	typedef nlohmann::json_sax<nlohmann::json> SAX;
+
+	// Build a value, available from Result when the transfer is done
+	JsonSink();
+
+	// Hand SAX events to sax, possibly from another thread
+	JsonSink(SAX* sax);
+
+	bool Write(const char* data, size_t len) override;
+	void Finish() override;
+	void NonBlocking() override;
+
+	bool Ok();
+	string Error();
+	nlohmann::json& Result();
+
+	virtual ~JsonSink();
+
+	// Bodies larger than this are parsed while downloading
+	static constexpr size_t StreamThreshold = 64 * 1024;
+private:
+	class Stream: public streambuf
+	{
+	public:
+		void Push(string&& chunk);
+		void End();
+		void Close();
+		// Queue without limit, Push never waits for the reader
+		void Unbounded();
+	protected:
+		int_type underflow() override;
+	private:
+		mutex lock;
+		condition_variable avail, space;
+		deque<string> chunks;
+		string current;
+		bool eof = false;
+		bool closed = false;
+		bool bounded = true;
+	};
+
+	template<class Input>
+	void Parse(Input& in);
+
+	SAX* sax;
+	nlohmann::json result;
+	string error;
+	string pending;
+	Stream stream;
+	thread parser;
+	atomic<bool> failed;
+	bool finished;
+};
+
+/*
+ *
+ * Asynchronous requests on a curl multi handle
+ *
+ * One thread per engine drives all transfers from an epoll loop.
+ * Callbacks are called from that thread and should not block. Sinks are
+ * finished on it too, before the callback, see JsonSink for its cost.
+ *
+ */
+
+class HttpMulti
+{
+public:
+	struct Response
+	{
+		CURLcode result;	// CURLE_ABORTED_BY_CALLBACK if cancelled
+		long code;
+		string body;		// Empty if request had a sink
+	};
+
+	typedef function<void(const Response& response)> Callback;
+	typedef uint64_t RequestID;
+
+	// Outcome of a request and the engine and id to cancel it with, a
+	// cancelled request fails its future
+	template<class T>
+	struct Handle
+	{
+		HttpMulti* multi = nullptr;
+		RequestID id = 0;
+		future<T> result;
+
+		bool Cancel()
+		{
+			return this->multi && this->multi->Cancel( this->id );
+		}
+	};
+
+	HttpMulti();
+
+	/*
+	 * Takes ownership of the prepared easy handle and headers, which
+	 * may be null. Timeout in ms covers the whole request, 0 for none.
+	 */
+	RequestID Add(CURL* easy, struct curl_slist* headers, Callback callback, long timeout = 0, BodySinkPtr sink = nullptr);
+	future<Response> Add(CURL* easy, struct curl_slist* headers, long timeout = 0, BodySinkPtr sink = nullptr);
+
+	// False if request is unknown or already done
+	bool Cancel(RequestID id);
+
+	size_t Pending();
+
+	// Engine shared by all HttpClients
+	static HttpMulti& Default();
+
+	virtual ~HttpMulti();
+private:
+	struct Request
+	{
+		RequestID id;
+		CURL* easy;
+		struct curl_slist* headers;
+		Callback callback;
+		BodySinkPtr sink;
+		string body;
+
+		~Request();
+	};
+
+	void Loop();
+	void Wakeup();
+	void Finish(Request* req, CURLcode result);
+
+	static int SocketCallback(CURL* easy, curl_socket_t s, int what, void* userp, void* socketp);
+	static int TimerCallback(CURLM* multi, long timeout, void* userp);
+	static size_t WriteCallback(void *contents, size_t size, size_t nmemb, void *userp);
+
+	CURLM* multi;
+	int epollfd;
+	int wakefd;
+	bool timerset;	// Curl wants a timeout action at deadline
+	chrono::steady_clock::time_point deadline;
+
+	mutex lock;
+	map<RequestID, unique_ptr<Request>> requests;
+	vector<Request*> added;
+	vector<RequestID> cancelled;
+	RequestID nextid;
+	bool stop;
+
+	thread worker;
+};
+
 class HttpClient
 {
 public:
@@ -25,13 +257,46 @@ public:
 	void setDefaultCA(const string& path);
 	void setCAPath(const string& path);
 
+	/*
+	 * Keep connections open after a request, for reuse by later
+	 * requests from this client, at most maxidle seconds. Idle
+	 * connections are kept alive with TCP keepalive. Default on.
+	 */
+	void setKeepAlive(bool keepalive, long maxidle = 118);
+
+	// Share DNS cache and TLS sessions with other clients, default on
+	void setShared(bool shared);
+
 protected:
 	void CurlPre();
 	void CurlSetHeaders(const map<string, string> &headers);
+
+	// Send body of next request to sink, that request then returns an empty body
+	void CurlSetSink(BodySinkPtr sink);
 	std::string DoGet(const std::string& path, const map<string, string>& data);
 	std::string DoPost(const std::string& path, const map<string, string>& data);
 	string CurlPerform();
 
+	/*
+	 * Asynchronous versions, run on the default HttpMulti engine.
+	 * Only settings and headers are taken from this client, it may
+	 * be destroyed before the request is done.
+	 */
+	HttpMulti::RequestID DoGetAsync(const string& path, const map<string, string>& data, HttpMulti::Callback callback, long timeout = 0);
+	HttpMulti::RequestID DoPostAsync(const string& path, const map<string, string>& data, HttpMulti::Callback callback, long timeout = 0);
+
+	/*
+	 * Post and parse the reply as JSON while it is downloaded. Returns
+	 * result code and reply, null if the reply could not be parsed.
+	 */
+	tuple<int, nlohmann::json> PostJson(const string& path, const map<string, string>& data);
+
+	// Asynchronous PostJson, a failed request fails the future
+	HttpMulti::Handle<tuple<int, nlohmann::json>> PostJsonAsync(const string& path, const map<string, string>& data, long timeout = 0);
+
+	// Did last request reuse an existing connection
+	bool ConnectionReused();
+
 	string MakeFormData(const map<string,string>& data);
 	string EscapeString(const string& arg);
 
@@ -41,17 +306,25 @@ protected:
 	long result_code;
 	string host;
 	string unit_id;
-	stringstream body;
+	string body;
 	map<string,string> headers;
+	BodySinkPtr sink;
 private:
+	void CurlSetup(CURL* handle);
+	CURL* CurlAsyncPre();
+	struct curl_slist* makeheaders();
 	void setheaders();
 	void clearheaders();
+	static CURLSH* share();
 	struct curl_slist *slist;
 	long port;
 	long timeout;
 	bool verifyca;
 	string capath;
 	string defaultca;
+	bool keepalive;
+	long maxidle;
+	bool shared;
 };
 
 } // End NS
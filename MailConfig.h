@@ -13,7 +13,7 @@
 
 // Convenience defines
 #define SCFG	(OPI::SysConfig())
-#define SAREA (SCFG.GetKeyAsString("filesystem","storagemount"))
+#define SAREA (SCFG.Get<OPI::Keys::Filesystem::StorageMount>())
 #define MCFG(opt)  (SAREA+SCFG.GetKeyAsString("mail", opt))
 
 using namespace std;
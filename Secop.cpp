@@ -4,11 +4,98 @@
 
 #include <libutils/Logger.h>
 
+#include <algorithm>
+#include <cstring>
+
 using namespace Utils;
 
 namespace OPI
 {
 
+/*
+ * Commands used both by single calls and batches
+ */
+static json CreateUserCmd(const string& user, const string& pwd, const string &display)
+{
+	json cmd;
+
+	cmd["cmd"]		= "createuser";
+	cmd["username"]	= user;
+	cmd["password"]	= pwd;
+	if( display != "")
+	{
+		cmd["displayname"] = display;
+	}
+
+	return cmd;
+}
+
+static json RemoveUserCmd(const string& user)
+{
+	json cmd;
+
+	cmd["cmd"]		= "removeuser";
+	cmd["username"]	= user;
+
+	return cmd;
+}
+
+static json AddAttributeCmd(const string &user, const string &attr, const string &value)
+{
+	json cmd;
+
+	cmd["cmd"]		= "addattribute";
+	cmd["username"]	= user;
+	cmd["attribute"]= attr;
+	cmd["value"]= value;
+
+	return cmd;
+}
+
+static json AddServiceCmd(const string& user, const string& service)
+{
+	json cmd;
+
+	cmd["cmd"]			= "addservice";
+	cmd["username"]		= user;
+	cmd["servicename"]	= service;
+
+	return cmd;
+}
+
+static json ACLCmd(const string& op, const string& user, const string& service, const string& acl)
+{
+	json cmd;
+
+	cmd["cmd"]			= op;
+	cmd["username"]		= user;
+	cmd["servicename"]	= service;
+	cmd["acl"]			= acl;
+
+	return cmd;
+}
+
+static json AddGroupCmd(const string &group)
+{
+	json cmd;
+
+	cmd["cmd"]	= "groupadd";
+	cmd["group"]= group;
+
+	return cmd;
+}
+
+static json AddGroupMemberCmd(const string &group, const string &member)
+{
+	json cmd;
+
+	cmd["cmd"]	= "groupaddmember";
+	cmd["group"]= group;
+	cmd["member"]= member;
+
+	return cmd;
+}
+
 inline void throw_error(const json& rep)
 {
 	if( rep.contains("status") && rep["status"].contains("desc") && rep["status"]["desc"].is_string() )
@@ -21,7 +108,7 @@ inline void throw_error(const json& rep)
 	}
 }
 
-Secop::Secop(): tid(0), secop("/tmp/secop")
+Secop::Secop(const string &path): secop(path)
 {
 
 }
@@ -82,15 +169,7 @@ bool Secop::PlainAuth(const string& user, const string& pwd)
 
 bool Secop::CreateUser(const string& user, const string& pwd, const string &display)
 {
-	json cmd;
-
-	cmd["cmd"]		= "createuser";
-	cmd["username"]	= user;
-	cmd["password"]	= pwd;
-	if( display != "")
-	{
-		cmd["displayname"] = display;
-	}
+	json cmd = CreateUserCmd( user, pwd, display );
 
 	json rep = this->DoCall(cmd);
 
@@ -112,10 +191,7 @@ bool Secop::UpdateUserPassword(const string &user, const string &pwd)
 
 bool Secop::RemoveUser(const string& user)
 {
-	json cmd;
-
-	cmd["cmd"]		= "removeuser";
-	cmd["username"]	= user;
+	json cmd = RemoveUserCmd( user );
 
 	json rep = this->DoCall(cmd);
 
@@ -172,12 +248,7 @@ vector<string> Secop::GetUserGroups(const string& user)
 
 bool Secop::AddAttribute(const string &user, const string &attr, const string &value)
 {
-	json cmd;
-
-	cmd["cmd"]		= "addattribute";
-	cmd["username"]	= user;
-	cmd["attribute"]= attr;
-	cmd["value"]= value;
+	json cmd = AddAttributeCmd( user, attr, value );
 
 	json rep = this->DoCall(cmd);
 
@@ -188,7 +259,7 @@ bool Secop::RemoveAttribute(const string &user, const string &attr)
 {
 	json cmd;
 
-	cmd["cmd"]		= "addattribute";
+	cmd["cmd"]		= "removeattribute";
 	cmd["username"]	= user;
 	cmd["attribute"]= attr;
 
@@ -263,11 +334,7 @@ vector<string> Secop::GetServices(const string& user)
 
 bool Secop::AddService(const string& user, const string& service)
 {
-	json cmd;
-
-	cmd["cmd"]			= "addservice";
-	cmd["username"]		= user;
-	cmd["servicename"]	= service;
+	json cmd = AddServiceCmd( user, service );
 
 	json rep = this->DoCall(cmd);
 
@@ -314,12 +381,7 @@ vector<string> Secop::GetACL(const string& user, const string& service)
 
 bool Secop::AddACL(const string& user, const string& service, const string& acl)
 {
-	json cmd;
-
-	cmd["cmd"]			= "addacl";
-	cmd["username"]		= user;
-	cmd["servicename"]	= service;
-	cmd["acl"]			= acl;
+	json cmd = ACLCmd( "addacl", user, service, acl );
 
 	json rep = this->DoCall(cmd);
 
@@ -328,12 +390,7 @@ bool Secop::AddACL(const string& user, const string& service, const string& acl)
 
 bool Secop::RemoveACL(const string& user, const string& service, const string& acl)
 {
-	json cmd;
-
-	cmd["cmd"]			= "removeacl";
-	cmd["username"]		= user;
-	cmd["servicename"]	= service;
-	cmd["acl"]			= acl;
+	json cmd = ACLCmd( "removeacl", user, service, acl );
 
 	json rep = this->DoCall(cmd);
 
@@ -436,10 +493,7 @@ list<map<string,string>> Secop::GetIdentifiers(const string& user, const string&
 
 bool Secop::AddGroup(const string &group)
 {
-	json cmd;
-
-	cmd["cmd"]	= "groupadd";
-	cmd["group"]= group;
+	json cmd = AddGroupCmd( group );
 
 	json rep = this->DoCall(cmd);
 
@@ -448,16 +502,11 @@ bool Secop::AddGroup(const string &group)
 
 bool Secop::AddGroupMember(const string &group, const string &member)
 {
-	json cmd;
-
-	cmd["cmd"]	= "groupaddmember";
-	cmd["group"]= group;
-	cmd["member"]= member;
+	json cmd = AddGroupMemberCmd( group, member );
 
 	json rep = this->DoCall(cmd);
 
 	return this->CheckReply(rep);
-
 }
 
 vector<string> Secop::GetGroupMembers(const string &group)
@@ -724,38 +773,551 @@ Secop::~Secop() = default;
 
 json Secop::DoCall(json& cmd)
 {
-	cmd["tid"]=this->tid;
-	cmd["version"]=1.0;
-	string r = cmd.dump();
+	json resp;
 
-	this->secop.Write(r.c_str(), r.size() );
+	int t = this->Post( cmd, [&resp](const json& rep){ resp = rep; } );
 
-	char buf[16384];
-	int rd;
+	this->Wait( t );
 
-	json resp;
+	return resp;
+}
 
-	if( ( rd = this->secop.Read( buf, sizeof(buf) ) ) > 0  )
+int Secop::Post(json &cmd, Secop::ReplyCallback cb)
+{
+	string r;
+	int t = this->replies.Add( cmd, std::move( cb ), r );
+
+	try
+	{
+		this->secop.Write(r.c_str(), r.size() );
+	}
+	catch( ... )
 	{
+		this->replies.Remove( t );
+		throw;
+	}
+
+	return t;
+}
 
-		try
+/*
+ * Secop answers while reading and blocks writing replies nobody reads
+ * if we write everything at once, so only a window of commands is kept
+ * in flight. Commands are written in chunks to keep the writes few.
+ */
+static constexpr size_t batchwindow = 64;
+static constexpr size_t batchchunk = 16;
+
+vector<bool> Secop::Run(Secop::Batch &batch)
+{
+	size_t count = batch.cmds.size();
+	vector<bool> res( count, false );
+	vector<int> tids;
+	size_t done = 0;
+
+	try
+	{
+		while( tids.size() < count )
 		{
-			resp = json::parse(buf, buf+rd);
+			size_t last = min( count, tids.size() + batchchunk );
+
+			// Make room, oldest commands are answered first
+			for( ; done + batchwindow < last; done++ )
+			{
+				this->Wait( tids[done] );
+			}
+
+			string r;
+			for( size_t i = tids.size(); i < last; i++ )
+			{
+				tids.push_back( this->replies.Add( batch.cmds[i], [this, &res, i](const json& rep)
+				{
+					res[i] = this->CheckReply( rep );
+				}, r ) );
+			}
+
+			this->secop.Write(r.c_str(), r.size() );
 		}
-		catch (json::parse_error& err)
+
+		for( ; done < tids.size(); done++ )
 		{
-			logg << Logger::Error << "Failed to parse response: " << err.what()<<lend;
+			this->Wait( tids[done] );
 		}
 	}
+	catch( ... )
+	{
+		// Callbacks refer to res, drop all that are still pending
+		for( int t: tids )
+		{
+			this->replies.Remove( t );
+		}
+		throw;
+	}
 
-	return resp;
+	return res;
+}
+
+size_t Secop::Outstanding() const
+{
+	return this->replies.Outstanding();
+}
+
+void Secop::Wait(int tid)
+{
+	try
+	{
+		while( this->replies.Pending( tid ) )
+		{
+			if( ! this->ReadReply() )
+			{
+				this->replies.Fail();
+			}
+		}
+	}
+	catch( ... )
+	{
+		// Callbacks could refer to state of callers, i.e. DoCall, that is
+		// gone once we unwind. Don't leave any around for later replies.
+		this->replies.Fail();
+		throw;
+	}
+}
+
+void Secop::WaitAll()
+{
+	try
+	{
+		while( this->replies.Outstanding() > 0 )
+		{
+			if( ! this->ReadReply() )
+			{
+				this->replies.Fail();
+			}
+		}
+	}
+	catch( ... )
+	{
+		this->replies.Fail();
+		throw;
+	}
+}
+
+bool Secop::ReadReply()
+{
+	while( ! this->replies.DispatchNext() )
+	{
+		size_t avail = 0;
+		char* buf = this->replies.WritePtr( avail );
+		int rd;
+
+		if( ( rd = this->secop.Read( buf, avail ) ) <= 0  )
+		{
+			logg << Logger::Error << "Failed to read response from secop" << lend;
+			return false;
+		}
+
+		this->replies.Commit( rd );
+	}
+
+	return true;
 }
 
 bool Secop::CheckReply( const json& val )
+{
+	return Replies::CheckReply( val );
+}
+
+/*
+ * Implementation of caching secop
+ */
+
+CachingSecop::CachingSecop(size_t maxentries, chrono::seconds ttl, const string &path):
+	Secop(path), maxentries(maxentries), ttl(ttl)
+{
+
+}
+
+void CachingSecop::Invalidate(const string &user)
+{
+	for( auto it = this->lru.begin(); it != this->lru.end(); )
+	{
+		if( get<1>( it->key ) == user )
+		{
+			this->entries.erase( it->key );
+			it = this->lru.erase( it );
+		}
+		else
+		{
+			++it;
+		}
+	}
+}
+
+void CachingSecop::InvalidateAll()
+{
+	this->entries.clear();
+	this->lru.clear();
+}
+
+bool CachingSecop::CreateUser(const string &user, const string &pwd, const string &display)
+{
+	this->Invalidate( user );
+	return Secop::CreateUser( user, pwd, display );
+}
+
+bool CachingSecop::RemoveUser(const string &user)
+{
+	this->Invalidate( user );
+	return Secop::RemoveUser( user );
+}
+
+vector<string> CachingSecop::GetUserGroups(const string &user)
+{
+	Key key( KindGroups, user, "", "" );
+	json val;
+
+	if( ! this->Lookup( key, val ) )
+	{
+		val = Secop::GetUserGroups( user );
+		this->Store( key, val );
+	}
+
+	return val.get<vector<string>>();
+}
+
+bool CachingSecop::AddAttribute(const string &user, const string &attr, const string &value)
+{
+	this->Drop( Key( KindAttribute, user, attr, "" ) );
+	return Secop::AddAttribute( user, attr, value );
+}
+
+bool CachingSecop::RemoveAttribute(const string &user, const string &attr)
+{
+	this->Drop( Key( KindAttribute, user, attr, "" ) );
+	return Secop::RemoveAttribute( user, attr );
+}
+
+string CachingSecop::GetAttribute(const string &user, const string &attr)
+{
+	Key key( KindAttribute, user, attr, "" );
+	json val;
+
+	if( ! this->Lookup( key, val ) )
+	{
+		val = Secop::GetAttribute( user, attr );
+		this->Store( key, val );
+	}
+
+	return val;
+}
+
+bool CachingSecop::RemoveService(const string &user, const string &service)
+{
+	// Drops ACLs of service
+	this->Invalidate( user );
+	return Secop::RemoveService( user, service );
+}
+
+vector<string> CachingSecop::GetACL(const string &user, const string &service)
+{
+	Key key( KindACL, user, service, "" );
+	json val;
+
+	if( ! this->Lookup( key, val ) )
+	{
+		val = Secop::GetACL( user, service );
+		this->Store( key, val );
+	}
+
+	return val.get<vector<string>>();
+}
+
+bool CachingSecop::AddACL(const string &user, const string &service, const string &acl)
+{
+	this->Drop( Key( KindACL, user, service, "" ) );
+	this->Drop( Key( KindHasACL, user, service, acl ) );
+	return Secop::AddACL( user, service, acl );
+}
+
+bool CachingSecop::RemoveACL(const string &user, const string &service, const string &acl)
+{
+	this->Drop( Key( KindACL, user, service, "" ) );
+	this->Drop( Key( KindHasACL, user, service, acl ) );
+	return Secop::RemoveACL( user, service, acl );
+}
+
+bool CachingSecop::HasACL(const string &user, const string &service, const string &acl)
+{
+	Key key( KindHasACL, user, service, acl );
+	json val;
+
+	if( ! this->Lookup( key, val ) )
+	{
+		val = Secop::HasACL( user, service, acl );
+		this->Store( key, val );
+	}
+
+	return val;
+}
+
+bool CachingSecop::AddGroupMember(const string &group, const string &member)
+{
+	// Membership could also affect ACLs of member
+	this->Invalidate( member );
+	return Secop::AddGroupMember( group, member );
+}
+
+bool CachingSecop::RemoveGroup(const string &group)
+{
+	// Members unknown, drop everything membership could affect
+	this->DropKind( KindGroups );
+	this->DropKind( KindACL );
+	this->DropKind( KindHasACL );
+	return Secop::RemoveGroup( group );
+}
+
+bool CachingSecop::RemoveGroupMember(const string &group, const string &member)
+{
+	this->Invalidate( member );
+	return Secop::RemoveGroupMember( group, member );
+}
+
+vector<bool> CachingSecop::Run(Secop::Batch &batch)
+{
+	this->InvalidateAll();
+	return Secop::Run( batch );
+}
+
+CachingSecop::~CachingSecop() = default;
+
+bool CachingSecop::Lookup(const CachingSecop::Key &key, json &value)
+{
+	auto it = this->entries.find( key );
+	if( it == this->entries.end() )
+	{
+		return false;
+	}
+
+	if( chrono::steady_clock::now() >= it->second->expires )
+	{
+		this->lru.erase( it->second );
+		this->entries.erase( it );
+		return false;
+	}
+
+	// Move to front, most recently used
+	this->lru.splice( this->lru.begin(), this->lru, it->second );
+	value = it->second->value;
+
+	return true;
+}
+
+void CachingSecop::Store(const CachingSecop::Key &key, const json &value)
+{
+	if( this->maxentries == 0 )
+	{
+		return;
+	}
+
+	this->Drop( key );
+
+	while( this->lru.size() >= this->maxentries )
+	{
+		this->entries.erase( this->lru.back().key );
+		this->lru.pop_back();
+	}
+
+	this->lru.push_front( { key, value, chrono::steady_clock::now() + this->ttl } );
+	this->entries[key] = this->lru.begin();
+}
+
+void CachingSecop::Drop(const CachingSecop::Key &key)
+{
+	auto it = this->entries.find( key );
+	if( it != this->entries.end() )
+	{
+		this->lru.erase( it->second );
+		this->entries.erase( it );
+	}
+}
+
+void CachingSecop::DropKind(CachingSecop::Kind kind)
+{
+	for( auto it = this->lru.begin(); it != this->lru.end(); )
+	{
+		if( get<0>( it->key ) == kind )
+		{
+			this->entries.erase( it->key );
+			it = this->lru.erase( it );
+		}
+		else
+		{
+			++it;
+		}
+	}
+}
+
+/*
+ * Implementation of batch
+ */
+
+Secop::Batch &Secop::Batch::CreateUser(const string &user, const string &pwd, const string &display)
+{
+	this->cmds.push_back( CreateUserCmd( user, pwd, display ) );
+	return *this;
+}
+
+Secop::Batch &Secop::Batch::RemoveUser(const string &user)
+{
+	this->cmds.push_back( RemoveUserCmd( user ) );
+	return *this;
+}
+
+Secop::Batch &Secop::Batch::AddAttribute(const string &user, const string &attr, const string &value)
+{
+	this->cmds.push_back( AddAttributeCmd( user, attr, value ) );
+	return *this;
+}
+
+Secop::Batch &Secop::Batch::AddService(const string &user, const string &service)
+{
+	this->cmds.push_back( AddServiceCmd( user, service ) );
+	return *this;
+}
+
+Secop::Batch &Secop::Batch::AddACL(const string &user, const string &service, const string &acl)
+{
+	this->cmds.push_back( ACLCmd( "addacl", user, service, acl ) );
+	return *this;
+}
+
+Secop::Batch &Secop::Batch::RemoveACL(const string &user, const string &service, const string &acl)
+{
+	this->cmds.push_back( ACLCmd( "removeacl", user, service, acl ) );
+	return *this;
+}
+
+Secop::Batch &Secop::Batch::AddGroup(const string &group)
+{
+	this->cmds.push_back( AddGroupCmd( group ) );
+	return *this;
+}
+
+Secop::Batch &Secop::Batch::AddGroupMember(const string &group, const string &member)
+{
+	this->cmds.push_back( AddGroupMemberCmd( group, member ) );
+	return *this;
+}
+
+size_t Secop::Batch::Size() const
+{
+	return this->cmds.size();
+}
+
+void Secop::Batch::Clear()
+{
+	this->cmds.clear();
+}
+
+/*
+ * Implementation of reply bookkeeping
+ */
+
+Secop::Replies::Replies(): tid(0)
+{
+
+}
+
+int Secop::Replies::Add(json &cmd, Secop::ReplyCallback cb, string &out)
+{
+	int t = this->tid++;
+
+	cmd["tid"]=t;
+	cmd["version"]=1.0;
+	out += cmd.dump();
+
+	this->pending[t] = std::move( cb );
+
+	return t;
+}
+
+void Secop::Replies::Remove(int tid)
+{
+	this->pending.erase( tid );
+}
+
+bool Secop::Replies::Pending(int tid) const
+{
+	return this->pending.find( tid ) != this->pending.end();
+}
+
+size_t Secop::Replies::Outstanding() const
+{
+	return this->pending.size();
+}
+
+char *Secop::Replies::WritePtr(size_t &avail)
+{
+	return this->rbuf.WritePtr( avail );
+}
+
+void Secop::Replies::Commit(size_t len)
+{
+	this->rbuf.Commit( len );
+}
+
+bool Secop::Replies::DispatchNext()
+{
+	const char* begin = nullptr;
+	const char* end = nullptr;
+
+	if( ! this->rbuf.Next( begin, end ) )
+	{
+		return false;
+	}
+
+	json resp;
+
+	try
+	{
+		resp = json::parse( begin, end );
+	}
+	catch (json::parse_error& err)
+	{
+		logg << Logger::Error << "Failed to parse response: " << err.what()<<lend;
+	}
+
+	// Done with buffer before callback, which could post more commands
+	this->rbuf.Consume();
+
+	this->Dispatch( resp );
+
+	return true;
+}
+
+void Secop::Replies::Fail()
+{
+	this->rbuf.Clear();
+
+	// Answer remaining commands with empty reply
+	map<int, ReplyCallback> failed;
+	failed.swap( this->pending );
+
+	for( auto& p: failed )
+	{
+		if( p.second )
+		{
+			p.second( json() );
+		}
+	}
+}
+
+bool Secop::Replies::CheckReply(const json &val)
 {
 	bool ret = false;
 
-	if( val.contains("status") && val["status"].is_object() )
+	if( val.contains("status") && val["status"].is_object() &&
+			val["status"].contains("value") && val["status"]["value"].is_number_integer() )
 	{
 		ret = val["status"]["value"].get<int>() == 0;
 	}
@@ -763,4 +1325,151 @@ bool Secop::CheckReply( const json& val )
 	return ret;
 }
 
+void Secop::Replies::Dispatch(const json &reply)
+{
+	if( this->pending.empty() )
+	{
+		logg << Logger::Notice << "Secop: discarding unexpected reply" << lend;
+		return;
+	}
+
+	// Replies are answered in order, use oldest unless reply carries tid
+	auto it = this->pending.begin();
+	if( reply.contains("tid") )
+	{
+		// Could be a late reply to a command dropped by Remove, it
+		// must not be mistaken for the answer to another command
+		it = reply["tid"].is_number_integer() ? this->pending.find( reply["tid"].get<int>() ) : this->pending.end();
+		if( it == this->pending.end() )
+		{
+			logg << Logger::Notice << "Secop: discarding reply to unknown command" << lend;
+			return;
+		}
+	}
+
+	ReplyCallback cb = std::move( it->second );
+	this->pending.erase( it );
+
+	if( cb )
+	{
+		cb( reply );
+	}
+}
+
+/*
+ * Implementation of reply buffer
+ */
+
+// Initial size and least free space to offer for each read
+#define REPLYBUF_SIZE	16384
+#define REPLYBUF_MINREAD	4096
+
+Secop::ReplyBuffer::ReplyBuffer():
+	buf(REPLYBUF_SIZE), start(0), scan(0), fill(0),
+	depth(0), instring(false), escape(false)
+{
+
+}
+
+char *Secop::ReplyBuffer::WritePtr(size_t &avail)
+{
+	if( this->buf.size() - this->fill < REPLYBUF_MINREAD )
+	{
+		if( this->start > 0 )
+		{
+			// Move unconsumed data to front of buffer
+			memmove( &this->buf[0], &this->buf[this->start], this->fill - this->start );
+			this->scan -= this->start;
+			this->fill -= this->start;
+			this->start = 0;
+		}
+
+		if( this->buf.size() - this->fill < REPLYBUF_MINREAD )
+		{
+			this->buf.resize( this->buf.size() * 2 );
+		}
+	}
+
+	avail = this->buf.size() - this->fill;
+
+	return &this->buf[this->fill];
+}
+
+void Secop::ReplyBuffer::Commit(size_t len)
+{
+	this->fill += len;
+}
+
+bool Secop::ReplyBuffer::Next(const char *&begin, const char *&end)
+{
+	for( ; this->scan < this->fill; this->scan++ )
+	{
+		char c = this->buf[this->scan];
+
+		if( this->instring )
+		{
+			if( this->escape )
+			{
+				this->escape = false;
+			}
+			else if( c == '\\' )
+			{
+				this->escape = true;
+			}
+			else if( c == '"' )
+			{
+				this->instring = false;
+			}
+			continue;
+		}
+
+		switch( c )
+		{
+		case '"':
+			this->instring = true;
+			break;
+		case '{':
+		case '[':
+			this->depth++;
+			break;
+		case '}':
+		case ']':
+			if( --this->depth == 0 )
+			{
+				this->scan++;
+				begin = &this->buf[this->start];
+				end = &this->buf[this->scan];
+				return true;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	return false;
+}
+
+void Secop::ReplyBuffer::Consume()
+{
+	this->start = this->scan;
+	this->depth = 0;
+	this->instring = false;
+	this->escape = false;
+
+	if( this->start == this->fill )
+	{
+		// All consumed, start over at beginning of buffer
+		this->start = this->scan = this->fill = 0;
+	}
+}
+
+void Secop::ReplyBuffer::Clear()
+{
+	this->start = this->scan = this->fill = 0;
+	this->depth = 0;
+	this->instring = false;
+	this->escape = false;
+}
+
 } // End NS
@@ -5,9 +5,13 @@
 #include <libutils/ClassTools.h>
 #include <nlohmann/json.hpp>
 
+#include <chrono>
+#include <functional>
 #include <string>
 #include <list>
 #include <map>
+#include <tuple>
+#include <vector>
 
 using namespace std;
 using namespace Utils::Net;
@@ -33,7 +37,7 @@ public:
 		Authenticated	= 0x04
 	};
 
-	Secop();
+	Secop(const string& path = "/tmp/secop");
 
 	bool Init(const string& pwd);
 
@@ -43,26 +47,26 @@ public:
 	bool PlainAuth(const string& user, const string& pwd);
 
 	// User commands
-	bool CreateUser(const string& user, const string& pwd, const string& display="");
+	virtual bool CreateUser(const string& user, const string& pwd, const string& display="");
 	bool UpdateUserPassword(const string& user, const string& pwd);
-	bool RemoveUser(const string& user);
+	virtual bool RemoveUser(const string& user);
 	vector<string> GetUsers();
-	vector<string> GetUserGroups(const string &user);
+	virtual vector<string> GetUserGroups(const string &user);
 
-	bool AddAttribute(const string& user, const string& attr, const string& value);
-	bool RemoveAttribute(const string& user, const string& attr);
+	virtual bool AddAttribute(const string& user, const string& attr, const string& value);
+	virtual bool RemoveAttribute(const string& user, const string& attr);
 	vector<string> GetAttributes(const string& user);
-	string GetAttribute(const string& user, const string& attr);
+	virtual string GetAttribute(const string& user, const string& attr);
 
 
 	vector<string> GetServices(const string& user);
 	bool AddService(const string& user, const string& service);
-	bool RemoveService(const string& user, const string& service);
+	virtual bool RemoveService(const string& user, const string& service);
 
-	vector<string> GetACL(const string& user, const string& service);
-	bool AddACL(const string& user, const string& service, const string& acl);
-	bool RemoveACL(const string& user, const string& service, const string& acl);
-	bool HasACL(const string& user, const string& service, const string& acl);
+	virtual vector<string> GetACL(const string& user, const string& service);
+	virtual bool AddACL(const string& user, const string& service, const string& acl);
+	virtual bool RemoveACL(const string& user, const string& service, const string& acl);
+	virtual bool HasACL(const string& user, const string& service, const string& acl);
 
 	/* Limited, can only add key value string pairs */
 	bool AddIdentifier(const string& user, const string& service, const map<string,string>& identifier);
@@ -74,11 +78,11 @@ public:
 
 	// Group commands
 	bool AddGroup(const string& group);
-	bool AddGroupMember(const string& group, const string& member);
+	virtual bool AddGroupMember(const string& group, const string& member);
 	vector<string> GetGroupMembers(const string& group);
 	vector<string> GetGroups();
-	bool RemoveGroup(const string& group);
-	bool RemoveGroupMember(const string& group, const string& member);
+	virtual bool RemoveGroup(const string& group);
+	virtual bool RemoveGroupMember(const string& group, const string& member);
 
 	// Appid / system commands
 	bool AppAddID(const string& appid);
@@ -95,6 +99,58 @@ public:
 	bool AppHasACL(const string& appid, const string& acl);
 
 
+	/*
+	 * Pipelined calls
+	 *
+	 * Post sends a command without waiting for the reply and returns its
+	 * tid. Replies are read by Wait/WaitAll and handed to the callback of
+	 * the command with matching tid. Several commands can thus be in
+	 * flight on the connection at once.
+	 *
+	 * If reading fails, by error or exception, all outstanding commands
+	 * are answered with an empty reply before Wait/WaitAll returns.
+	 */
+	typedef function<void(const json& reply)> ReplyCallback;
+
+	int Post(json& cmd, ReplyCallback cb);
+
+	// Read replies until command with tid has been answered
+	void Wait(int tid);
+
+	// Read replies until all posted commands have been answered
+	void WaitAll();
+
+	/*
+	 * Collection of modifying commands to be sent to secop in one go
+	 */
+	class Batch
+	{
+	public:
+		Batch& CreateUser(const string& user, const string& pwd, const string& display="");
+		Batch& RemoveUser(const string& user);
+		Batch& AddAttribute(const string& user, const string& attr, const string& value);
+		Batch& AddService(const string& user, const string& service);
+		Batch& AddACL(const string& user, const string& service, const string& acl);
+		Batch& RemoveACL(const string& user, const string& service, const string& acl);
+		Batch& AddGroup(const string& group);
+		Batch& AddGroupMember(const string& group, const string& member);
+
+		size_t Size() const;
+		void Clear();
+	private:
+		friend class Secop;
+		vector<json> cmds;
+	};
+
+	/*
+	 * Send all commands in batch, pipelined, and wait for replies.
+	 * Returns result of each command, in the order they were added.
+	 */
+	virtual vector<bool> Run(Batch& batch);
+
+	// Number of posted commands not yet answered
+	size_t Outstanding() const;
+
 	virtual ~Secop();
 
 protected:
@@ -102,15 +158,159 @@ protected:
 
 	bool CheckReply( const json& val );
 
-	int tid;
 private:
+	friend class AsyncSecop;
+
+	/*
+	 * Replies read from socket, kept between calls so that it is only
+	 * grown when a reply is larger than any seen before. Complete JSON
+	 * objects are located incrementally, each byte is only scanned once
+	 * regardless of how many reads a reply is spread over.
+	 */
+	class ReplyBuffer
+	{
+	public:
+		ReplyBuffer();
+
+		// Get space to read more data into
+		char* WritePtr(size_t& avail);
+		// Add len bytes just read into WritePtr
+		void Commit(size_t len);
+
+		// Locate next complete object, false if more data is needed
+		bool Next(const char*& begin, const char*& end);
+		// Drop object returned by Next
+		void Consume();
+
+		void Clear();
+	private:
+		vector<char> buf;
+		size_t start;		// Start of unconsumed data
+		size_t scan;		// Next byte to scan
+		size_t fill;		// End of valid data
+		int depth;
+		bool instring;
+		bool escape;
+	};
+
+	/*
+	 * Commands in flight on a connection and the replies to them, used
+	 * by both Secop and AsyncSecop. Replies are matched to commands on
+	 * tid, a reply without one answers the oldest command.
+	 */
+	class Replies
+	{
+	public:
+		Replies();
+
+		// Assign tid, register callback and append serialized command to out
+		int Add(json& cmd, ReplyCallback cb, string& out);
+		// Forget command, i.e. when it could not be sent
+		void Remove(int tid);
+
+		bool Pending(int tid) const;
+		size_t Outstanding() const;
+
+		// Space to read replies into and commit data read, as ReplyBuffer
+		char* WritePtr(size_t& avail);
+		void Commit(size_t len);
+
+		// Dispatch next complete reply read, false if more data is needed
+		bool DispatchNext();
+
+		// Connection failed, drop buffered data and answer all commands
+		// with an empty reply
+		void Fail();
+
+		static bool CheckReply(const json& val);
+	private:
+		void Dispatch(const json& reply);
+
+		int tid;
+		ReplyBuffer rbuf;
+		map<int, ReplyCallback> pending;
+	};
+
+	// Read and dispatch one reply, false if connection failed
+	bool ReadReply();
+
 	UnixStreamClientSocket secop;
+	Replies replies;
 	//Json::FastWriter writer;
 	//Json::Reader reader;
 };
 
 typedef shared_ptr<Secop> SecopPtr;
 
+/*
+ * Secop keeping results of GetUserGroups, GetAttribute, GetACL and HasACL
+ * in a bounded LRU cache. Entries expire after ttl and are invalidated
+ * when affected data is modified using this instance. Modifications made
+ * by other clients are only seen when entries expire or are invalidated
+ * explicitly.
+ */
+class CachingSecop: public Secop
+{
+public:
+	CachingSecop(size_t maxentries = 1000, chrono::seconds ttl = chrono::seconds(30),
+				 const string& path = "/tmp/secop");
+
+	// Drop cached results for user
+	void Invalidate(const string& user);
+	// Drop all cached results
+	void InvalidateAll();
+
+	bool CreateUser(const string& user, const string& pwd, const string& display="") override;
+	bool RemoveUser(const string& user) override;
+	vector<string> GetUserGroups(const string &user) override;
+
+	bool AddAttribute(const string& user, const string& attr, const string& value) override;
+	bool RemoveAttribute(const string& user, const string& attr) override;
+	string GetAttribute(const string& user, const string& attr) override;
+
+	bool RemoveService(const string& user, const string& service) override;
+
+	vector<string> GetACL(const string& user, const string& service) override;
+	bool AddACL(const string& user, const string& service, const string& acl) override;
+	bool RemoveACL(const string& user, const string& service, const string& acl) override;
+	bool HasACL(const string& user, const string& service, const string& acl) override;
+
+	bool AddGroupMember(const string& group, const string& member) override;
+	bool RemoveGroup(const string& group) override;
+	bool RemoveGroupMember(const string& group, const string& member) override;
+
+	vector<bool> Run(Batch& batch) override;
+
+	virtual ~CachingSecop();
+private:
+	enum Kind {
+		KindGroups,
+		KindAttribute,
+		KindACL,
+		KindHasACL
+	};
+
+	// Kind, user, and up to two more arguments
+	typedef tuple<Kind, string, string, string> Key;
+
+	struct Entry
+	{
+		Key key;
+		json value;
+		chrono::steady_clock::time_point expires;
+	};
+
+	bool Lookup(const Key& key, json& value);
+	void Store(const Key& key, const json& value);
+	void Drop(const Key& key);
+	void DropKind(Kind kind);
+
+	size_t maxentries;
+	chrono::seconds ttl;
+	list<Entry> lru;	// Most recently used first
+	map<Key, list<Entry>::iterator> entries;
+};
+
 } // End NS
 
 #endif // SECOP_H
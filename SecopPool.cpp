@@ -0,0 +1,248 @@
+#include "SecopPool.h"
+
+#include <libutils/Logger.h>
+
+#include <exception>
+#include <stdexcept>
+
+using namespace Utils;
+
+namespace OPI
+{
+
+/*
+ * Implementation of lease
+ */
+
+SecopPool::Lease::Lease(SecopPool::Lease &&other) noexcept:
+	pool(other.pool), secop(std::move(other.secop)), exceptions(other.exceptions)
+{
+	other.pool = nullptr;
+}
+
+Secop *SecopPool::Lease::operator->()
+{
+	return this->secop.get();
+}
+
+Secop &SecopPool::Lease::operator*()
+{
+	return *this->secop;
+}
+
+void SecopPool::Lease::Discard()
+{
+	if( this->pool && this->secop )
+	{
+		this->pool->Return( std::move( this->secop ), false );
+	}
+	this->pool = nullptr;
+}
+
+SecopPool::Lease::~Lease()
+{
+	if( this->pool && this->secop )
+	{
+		// Connection could be in the middle of a call if we are unwinding
+		bool reuse = uncaught_exceptions() == this->exceptions &&
+				this->secop->Outstanding() == 0;
+
+		this->pool->Return( std::move( this->secop ), reuse );
+	}
+}
+
+SecopPool::Lease::Lease(SecopPool *pool, SecopPtr secop):
+	pool(pool), secop(std::move(secop)), exceptions(uncaught_exceptions())
+{
+
+}
+
+/*
+ * Implementation of pool
+ */
+
+SecopPool::SecopPool(size_t min, size_t max, chrono::seconds maxidle, chrono::seconds checkinterval, SecopPool::Factory factory):
+	min(min), max(max > 0 ? max : 1), maxidle(maxidle), checkinterval(checkinterval),
+	factory(std::move(factory)), total(0), stop(false)
+{
+	auto now = chrono::steady_clock::now();
+
+	for( size_t i = 0; i < this->min && i < this->max; i++ )
+	{
+		this->idle.push_back( { this->Create(), now } );
+		this->total++;
+	}
+
+	this->reaper = thread( &SecopPool::Reaper, this );
+}
+
+SecopPool::Lease SecopPool::Get()
+{
+	unique_lock<mutex> l( this->lock );
+
+	this->Shrink( chrono::steady_clock::now() );
+
+	while( true )
+	{
+		if( ! this->idle.empty() )
+		{
+			IdleConnection c = std::move( this->idle.front() );
+			this->idle.pop_front();
+
+			if( chrono::steady_clock::now() - c.since < this->checkinterval )
+			{
+				return Lease( this, std::move( c.secop ) );
+			}
+
+			// Check without holding lock, status is a round trip
+			l.unlock();
+			bool healthy = SecopPool::Healthy( c.secop );
+			l.lock();
+
+			if( healthy )
+			{
+				return Lease( this, std::move( c.secop ) );
+			}
+
+			logg << Logger::Notice << "SecopPool: dropping failed connection" << lend;
+			this->total--;
+			continue;
+		}
+
+		if( this->total < this->max )
+		{
+			// Reserve slot and connect without holding lock
+			this->total++;
+			l.unlock();
+
+			try
+			{
+				SecopPtr secop = this->Create();
+				return Lease( this, std::move( secop ) );
+			}
+			catch( ... )
+			{
+				l.lock();
+				this->total--;
+				this->available.notify_one();
+				throw;
+			}
+		}
+
+		this->available.wait( l );
+	}
+}
+
+size_t SecopPool::Size()
+{
+	lock_guard<mutex> l( this->lock );
+
+	return this->total;
+}
+
+size_t SecopPool::Idle()
+{
+	lock_guard<mutex> l( this->lock );
+
+	return this->idle.size();
+}
+
+SecopPool::~SecopPool()
+{
+	{
+		unique_lock<mutex> l( this->lock );
+
+		// Outstanding leases would return to a destroyed pool
+		if( this->total != this->idle.size() )
+		{
+			logg << Logger::Debug << "SecopPool: waiting for leased connections" << lend;
+			this->reap.wait( l, [this]{ return this->total == this->idle.size(); } );
+		}
+
+		this->stop = true;
+	}
+	this->reap.notify_all();
+	this->reaper.join();
+}
+
+SecopPtr SecopPool::Create()
+{
+	SecopPtr secop = this->factory ? this->factory() : make_shared<Secop>();
+
+	if( ! secop->SockAuth() )
+	{
+		logg << Logger::Error << "SecopPool: failed to authenticate connection" << lend;
+		throw runtime_error("Failed to authenticate secop connection");
+	}
+
+	return secop;
+}
+
+bool SecopPool::Healthy(const SecopPtr &secop)
+{
+	try
+	{
+		return secop->Status() != Secop::Unknown;
+	}
+	catch( std::exception& err )
+	{
+		logg << Logger::Debug << "SecopPool: status check failed: " << err.what() << lend;
+	}
+
+	return false;
+}
+
+void SecopPool::Return(SecopPtr secop, bool reuse)
+{
+	lock_guard<mutex> l( this->lock );
+
+	auto now = chrono::steady_clock::now();
+
+	if( reuse )
+	{
+		this->idle.push_front( { std::move( secop ), now } );
+	}
+	else
+	{
+		this->total--;
+	}
+
+	this->Shrink( now );
+
+	this->available.notify_one();
+	// Reaper and possibly destructor
+	this->reap.notify_all();
+}
+
+void SecopPool::Shrink(chrono::steady_clock::time_point now)
+{
+	// Least recently returned are at the back
+	while( this->total > this->min && ! this->idle.empty() &&
+		   now - this->idle.back().since >= this->maxidle )
+	{
+		this->idle.pop_back();
+		this->total--;
+	}
+}
+
+// Closes idle connections when they expire, pool could be unused by then
+void SecopPool::Reaper()
+{
+	unique_lock<mutex> l( this->lock );
+
+	while( ! this->stop )
+	{
+		this->Shrink( chrono::steady_clock::now() );
+
+		if( this->total > this->min && ! this->idle.empty() )
+		{
+			this->reap.wait_until( l, this->idle.back().since + this->maxidle );
+		}
+		else
+		{
+			this->reap.wait( l );
+		}
+	}
+}
+
+} // End NS
@@ -0,0 +1,105 @@
+#ifndef SECOPPOOL_H
+#define SECOPPOOL_H
+
+#include "Secop.h"
+
+#include <libutils/ClassTools.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+namespace OPI
+{
+
+/*
+ * Pool of socket authenticated Secop connections for use from multiple
+ * threads. A connection is handed out as a Lease and returned to the
+ * pool when the lease goes out of scope.
+ *
+ * The pool keeps at least min connections and creates more on demand, up
+ * to max, after which Get waits for a connection to be returned. Idle
+ * connections above min are closed after maxidle, also without traffic
+ * on the pool. Connections idle for longer than checkinterval are checked
+ * with a status call before reuse.
+ *
+ * Leases refer to the pool, destroying the pool waits for all leased
+ * connections to be returned.
+ */
+class SecopPool: public Utils::NoCopy
+{
+public:
+	typedef function<SecopPtr()> Factory;
+
+	class Lease
+	{
+	public:
+		Lease(Lease&& other) noexcept;
+		Lease( const Lease&) = delete;
+		Lease& operator=( const Lease&) = delete;
+
+		Secop* operator->();
+		Secop& operator*();
+
+		// Don't return connection to pool, i.e. when in unknown state
+		void Discard();
+
+		virtual ~Lease();
+	private:
+		friend class SecopPool;
+		Lease(SecopPool* pool, SecopPtr secop);
+
+		SecopPool* pool;
+		SecopPtr secop;
+		int exceptions;
+	};
+
+	SecopPool(size_t min = 1, size_t max = 8,
+			  chrono::seconds maxidle = chrono::seconds(60),
+			  chrono::seconds checkinterval = chrono::seconds(10),
+			  Factory factory = nullptr);
+
+	// Get a connection, waits if max connections are in use
+	Lease Get();
+
+	// Total number of connections, idle and leased
+	size_t Size();
+	size_t Idle();
+
+	virtual ~SecopPool();
+private:
+	struct IdleConnection
+	{
+		SecopPtr secop;
+		chrono::steady_clock::time_point since;
+	};
+
+	SecopPtr Create();
+	static bool Healthy(const SecopPtr& secop);
+	void Return(SecopPtr secop, bool reuse);
+	void Shrink(chrono::steady_clock::time_point now);
+	void Reaper();
+
+	size_t min;
+	size_t max;
+	chrono::seconds maxidle;
+	chrono::seconds checkinterval;
+	Factory factory;
+
+	mutex lock;
+	condition_variable available;
+	condition_variable reap;
+	list<IdleConnection> idle;	// Most recently returned first
+	size_t total;
+	bool stop;
+	thread reaper;
+};
+
+} // End NS
+
+#endif // SECOPPOOL_H
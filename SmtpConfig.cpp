@@ -25,7 +25,7 @@ static string getport(const string &host);
 
 // Convenience defines
 #define SCFG	(OPI::SysConfig())
-#define SAREA (SCFG.GetKeyAsString("filesystem","storagemount"))
+#define SAREA (SCFG.Get<OPI::Keys::Filesystem::StorageMount>())
 #define MCFG(opt)  (SAREA+SCFG.GetKeyAsString("mail", opt))
 #define CFGOPT(scope, key) (SCFG.GetKeyAsString(scope, key))
 #define IS_OP	(SCFG.HasKey("dns", "provider") && SCFG.GetKeyAsString("dns", "provider") == "OpenProducts")
@@ -415,15 +415,15 @@ void SmtpConfig::getConfig()
 	SysConfig sysconf;
 	passwdline pass = cfg.GetConfig();
 
-	string name = sysconf.GetKeyAsString("hostinfo", "hostname");
-	string domain = sysconf.GetKeyAsString("hostinfo", "domain");
+	string name = sysconf.Get<Keys::Hostinfo::Hostname>();
+	string domain = sysconf.Get<Keys::Hostinfo::Domain>();
 
 	this->opiname = name+"."+domain;
 	if( this->is_op )
 	{
-		this->unit_id = sysconf.GetKeyAsString("hostinfo", "unitid");
+		this->unit_id = sysconf.Get<Keys::Hostinfo::UnitId>();
 	}
-    const string relay = sysconf.GetKeyAsString("mail", "oprelayserver");
+    const string relay = sysconf.Get<Keys::Mail::OpRelayServer>();
 
 	// OP relay?
 	if( this->is_op && this->checkMX( this->opiname ) )
@@ -23,390 +23,1315 @@
 #include <libutils/Exceptions.h>
 #include <libutils/FileUtils.h>
 #include <libutils/Logger.h>
+#include <fcntl.h>
 #include <sys/file.h>
+#include <sys/inotify.h>
+#include <poll.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
 #include <utility>
 #include <vector>
-#include <ext/stdio_filebuf.h>
-#include <fstream>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
 
 using namespace Utils;
 
 namespace OPI {
 
-SysConfig::SysConfig(): path(SYSCONFIGDBPATH),fd(0), writeable(false)
+/*
+ * Binary database layout, all integers little endian
+ *
+ *   magic "OPICFGB1"
+ *   u32 number of scopes
+ *   per scope: u16 name length, name, u32 offset, u32 length
+ *   CBOR encoded scope values, offsets relative start of this area
+ */
+static const char binmagic[] = "OPICFGB1";
+static const size_t binmagiclen = sizeof(binmagic) - 1;
+
+/*
+ * Database as read from disk, shared between readers via the cache.
+ *
+ * A JSON database is parsed in full up front. A binary database only has
+ * its scope index read, scopes are decoded when first accessed.
+ */
+class DBSnapshot
 {
+public:
+	// Create from file content, format is detected from data
+	static shared_ptr<DBSnapshot> FromData(vector<char> data);
+	static shared_ptr<DBSnapshot> FromJson(json doc, SysConfig::Format format);
 
-}
+	// Serialize database for storage in given format
+	static string Encode(const json& doc, SysConfig::Format format);
 
-SysConfig::SysConfig(bool writeable): path(SYSCONFIGDBPATH),fd(0), writeable(writeable)
-{
+	SysConfig::Format GetFormat() const;
 
-}
+	// Get value of scope, nullptr if no such scope
+	shared_ptr<const json> Scope(const string& scope) const;
 
-SysConfig::SysConfig(string path, bool writeable): path(std::move(path)), fd(0), writeable(writeable)
-{
+	// Get complete database
+	json Document() const;
 
-}
+private:
+	DBSnapshot(SysConfig::Format format);
 
-void SysConfig::Writeable(bool writeable)
+	bool ParseIndex();
+
+	struct ScopeData
+	{
+		uint32_t offset = 0;
+		uint32_t length = 0;
+		shared_ptr<const json> value;
+	};
+
+	SysConfig::Format format;
+	shared_ptr<const json> doc;
+	vector<char> data;
+	size_t dataoffset;
+	mutable mutex lock;
+	mutable map<string, ScopeData> scopes;
+};
+
+static void PutU16(string& out, uint16_t val)
 {
-	this->writeable = writeable;
+	out.push_back( static_cast<char>( val & 0xff ) );
+	out.push_back( static_cast<char>( ( val >> 8 ) & 0xff ) );
 }
 
-bool SysConfig::IsWriteable()
+static void PutU32(string& out, uint32_t val)
 {
-	return this->writeable;
+	PutU16( out, val & 0xffff );
+	PutU16( out, ( val >> 16 ) & 0xffff );
 }
 
-string SysConfig::GetKeyAsString(const string &scope, const string &key)
+static bool GetU16(const vector<char>& data, size_t& pos, uint16_t& val)
 {
-	json db = this->LoadDB();
+	if( data.size() < 2 || pos > data.size() - 2 )
+	{
+		return false;
+	}
 
-	json val = this->GetKey( db, scope, key );
+	val = static_cast<uint8_t>( data[pos] ) | ( static_cast<uint8_t>( data[pos+1] ) << 8 );
+	pos += 2;
 
-	if( val.is_string() )
+	return true;
+}
+
+static bool GetU32(const vector<char>& data, size_t& pos, uint32_t& val)
+{
+	uint16_t lo = 0, hi = 0;
+
+	if( ! GetU16( data, pos, lo ) || ! GetU16( data, pos, hi ) )
 	{
-		 return val;
+		return false;
 	}
 
-	logg << Logger::Error << "Key " << key << " not of wanted type" << lend;
-	throw runtime_error("Key not of wanted type in config db");
+	val = lo | ( static_cast<uint32_t>( hi ) << 16 );
+
+	return true;
 }
 
-list<string> SysConfig::GetKeyAsStringList(const string &scope, const string &key)
+shared_ptr<DBSnapshot> DBSnapshot::FromData(vector<char> data)
 {
-	json db = this->LoadDB();
+	if( data.size() >= binmagiclen && equal( binmagic, binmagic + binmagiclen, data.begin() ) )
+	{
+		shared_ptr<DBSnapshot> snap( new DBSnapshot( SysConfig::Binary ) );
 
-	json val = this->GetKey( db, scope, key );
+		snap->data = std::move( data );
 
-	if( val.is_array() )
+		if( ! snap->ParseIndex() )
+		{
+			logg << Logger::Error << "Failed to parse sysconfig database index" << lend;
+			snap->scopes.clear();
+		}
+
+		return snap;
+	}
+
+	json val;
+
+	if( ! data.empty() )
 	{
-		list<string> ret;
-		for( const auto& item: val)
+		try
 		{
-			if( item.is_string() )
-			{
-				ret.push_back(item);
-			}
-			else
-			{
-				logg << Logger::Error << "ConfigDB: unexpected data type in list"<<lend;
-				throw runtime_error("Unexpected data type in list");
-			}
+			val = json::parse( data.begin(), data.end() );
+		}
+		catch (json::parse_error& err)
+		{
+			logg << Logger::Error << "Failed to parse sysconfig datbaase: " << err.what() <<lend;
 		}
-		return ret;
 	}
 
-	logg << Logger::Error << "Key " << key << " not of wanted type" << lend;
-	throw runtime_error("Key not of wanted type in config db");
+	return DBSnapshot::FromJson( std::move(val), SysConfig::Json );
 }
 
-int SysConfig::GetKeyAsInt(const string &scope, const string &key)
+shared_ptr<DBSnapshot> DBSnapshot::FromJson(json doc, SysConfig::Format format)
 {
-	json db = this->LoadDB();
-
-	json val = this->GetKey( db, scope, key );
-
-	if( val.is_number_integer() )
-	{
-		 return val;
-	}
+	shared_ptr<DBSnapshot> snap( new DBSnapshot( format ) );
 
-	logg << Logger::Error << "Key " << key << " not of wanted type" << lend;
+	snap->doc = make_shared<const json>( std::move( doc ) );
 
-	throw runtime_error("Key not of wanted type in config db");
+	return snap;
 }
 
-list<int> SysConfig::GetKeyAsIntList(const string &scope, const string &key)
+string DBSnapshot::Encode(const json &doc, SysConfig::Format format)
 {
-	json db = this->LoadDB();
+	if( format != SysConfig::Binary )
+	{
+		return doc.dump(4);
+	}
 
-	json val = this->GetKey( db, scope, key );
+	string index, values;
+	uint32_t count = 0;
 
-	if( val.is_array() )
+	if( doc.is_object() )
 	{
-		list<int> ret;
-		for( const auto& item: val )
+		for( const auto& item: doc.items() )
 		{
-			if( item.is_number_integer())
-			{
-				ret.push_back(item);
-			}
-			else
+			vector<uint8_t> cbor = json::to_cbor( item.value() );
+
+			// Don't write an index that would be read back wrong
+			if( item.key().size() > numeric_limits<uint16_t>::max() ||
+					values.size() > numeric_limits<uint32_t>::max() ||
+					cbor.size() > numeric_limits<uint32_t>::max() ||
+					count == numeric_limits<uint32_t>::max() )
 			{
-				logg << Logger::Error << "ConfigDB: unexpected data type in list"<<lend;
-				throw runtime_error("Unexpected data type in list");
+				logg << Logger::Error << "SysConfig: scope " << item.key().substr( 0, 64 ) << " too large for binary format" << lend;
+				throw runtime_error("ConfigDB: database too large for binary format");
 			}
+
+			PutU16( index, static_cast<uint16_t>( item.key().size() ) );
+			index += item.key();
+			PutU32( index, static_cast<uint32_t>( values.size() ) );
+			PutU32( index, static_cast<uint32_t>( cbor.size() ) );
+
+			values.append( cbor.begin(), cbor.end() );
+			count++;
 		}
-		return ret;
 	}
 
-	logg << Logger::Error << "Key " << key << " not of wanted type" << lend;
-	throw runtime_error("Key not of wanted type in config db");
+	string out( binmagic, binmagiclen );
+	PutU32( out, count );
+
+	return out + index + values;
 }
 
-bool SysConfig::GetKeyAsBool(const string &scope, const string &key)
+SysConfig::Format DBSnapshot::GetFormat() const
 {
-	json db = this->LoadDB();
+	return this->format;
+}
 
-	json val = this->GetKey( db, scope, key );
+shared_ptr<const json> DBSnapshot::Scope(const string &scope) const
+{
+	if( this->doc )
+	{
+		if( ! this->doc->is_object() || ! this->doc->contains( scope ) )
+		{
+			return nullptr;
+		}
 
-	if( val.is_boolean() )
+		// Share ownership with complete document
+		return shared_ptr<const json>( this->doc, &(*this->doc)[scope] );
+	}
+
+	lock_guard<mutex> l( this->lock );
+
+	auto it = this->scopes.find( scope );
+	if( it == this->scopes.end() )
 	{
-		 return val;
+		return nullptr;
 	}
 
-	logg << Logger::Error << "Key " << key << " not of wanted type" << lend;
+	ScopeData& sd = it->second;
+	if( ! sd.value )
+	{
+		auto start = this->data.begin() + this->dataoffset + sd.offset;
+		try
+		{
+			sd.value = make_shared<const json>( json::from_cbor( start, start + sd.length ) );
+		}
+		catch( json::exception& err )
+		{
+			logg << Logger::Error << "Failed to decode sysconfig scope " << scope << ": " << err.what() << lend;
+			sd.value = make_shared<const json>();
+		}
+	}
 
-	throw runtime_error("Key not of wanted type in config db");
+	return sd.value;
 }
 
-list<bool> SysConfig::GetKeyAsBoolList(const string &scope, const string &key)
+json DBSnapshot::Document() const
 {
-	json db = this->LoadDB();
+	if( this->doc )
+	{
+		return *this->doc;
+	}
 
-	json val = this->GetKey( db, scope, key );
+	json ret;
 
-	if( val.is_array() )
+	vector<string> names;
 	{
-		list<bool> ret;
-		for(const auto& item: val)
+		lock_guard<mutex> l( this->lock );
+		for( const auto& scope: this->scopes )
 		{
-			if( item.is_boolean() )
-			{
-				ret.push_back(item);
-			}
-			else
-			{
-				logg << Logger::Error << "ConfigDB: unexpected data type in list"<<lend;
-				throw runtime_error("Unexpected data type in list");
-			}
+			names.push_back( scope.first );
 		}
-		return ret;
 	}
 
-	logg << Logger::Error << "Key " << key << " not of wanted type" << lend;
-	throw runtime_error("Key not of wanted type in config db");
+	for( const auto& name: names )
+	{
+		ret[name] = *this->Scope( name );
+	}
 
+	return ret;
 }
 
-void SysConfig::PutKey(const string &scope, const string &key, const char *value)
+DBSnapshot::DBSnapshot(SysConfig::Format format): format(format), dataoffset(0)
 {
-	this->PutKey(scope, key, string(value));
+
 }
 
-void SysConfig::PutKey(const string &scope, const string &key, const string &value)
+bool DBSnapshot::ParseIndex()
 {
-	this->OpenDB();
+	size_t pos = binmagiclen;
+	uint32_t count = 0;
 
-	json db = this->ReadDB();
+	if( ! GetU32( this->data, pos, count ) )
+	{
+		return false;
+	}
 
-	db[scope][key]=value;
+	vector<pair<string, ScopeData>> entries;
 
-	this->WriteDB(db);
+	for( uint32_t i = 0; i < count; i++ )
+	{
+		uint16_t namelen = 0;
+		if( ! GetU16( this->data, pos, namelen ) || this->data.size() - pos < namelen )
+		{
+			return false;
+		}
 
-	this->CloseDB();
-}
+		string name( &this->data[pos], namelen );
+		pos += namelen;
 
-void SysConfig::PutKey(const string &scope, const string &key, const list<string> &value)
-{
-	this->OpenDB();
+		ScopeData sd;
+		if( ! GetU32( this->data, pos, sd.offset ) || ! GetU32( this->data, pos, sd.length ) )
+		{
+			return false;
+		}
 
-	json db = this->ReadDB();
+		entries.emplace_back( name, sd );
+	}
 
-	json l;
+	this->dataoffset = pos;
 
-	for(const auto& val: value)
+	for( auto& entry: entries )
 	{
-		l.push_back(val);
+		const ScopeData& sd = entry.second;
+		if( static_cast<uint64_t>( sd.offset ) + sd.length > this->data.size() - this->dataoffset )
+		{
+			return false;
+		}
+
+		this->scopes[entry.first] = sd;
 	}
 
-	db[scope][key] = l;
+	return true;
+}
 
-	this->WriteDB(db);
+namespace {
 
-	this->CloseDB();
+// Events on database directory that could mean database has changed
+const uint32_t watchmask = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE |
+		IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
+
+void SplitPath(const string& path, string& dir, string& file)
+{
+	dir = ".";
+	file = path;
+
+	string::size_type pos = path.find_last_of('/');
+	if( pos != string::npos )
+	{
+		dir = pos == 0 ? "/" : path.substr( 0, pos );
+		file = path.substr( pos + 1 );
+	}
 }
 
-void SysConfig::PutKey(const string &scope, const string &key, int value)
+/*
+ * Process wide cache of parsed config databases, shared by all
+ * SysConfig instances and keyed on database path.
+ *
+ * A snapshot is considered valid as long as device, inode, size and
+ * mtime of the file are unchanged. The containing directory is watched
+ * using inotify, if that works, and the file is only stat:ed when an
+ * event has arrived for it. Without inotify every lookup stats the file.
+ */
+class DBCache
 {
-	this->OpenDB();
+public:
+	static DBCache& Instance();
 
-	json db = this->ReadDB();
+	// Get snapshot for path if file on disk is unchanged, else nullptr
+	shared_ptr<const DBSnapshot> Lookup(const string& path);
 
-	db[scope][key]=value;
+	// Get snapshot for path if it matches already stat:ed file, else nullptr
+	shared_ptr<const DBSnapshot> Lookup(const string& path, const struct stat& st);
 
-	this->WriteDB(db);
+	void Store(const string& path, const struct stat& st, shared_ptr<const DBSnapshot> doc);
 
-	this->CloseDB();
+	virtual ~DBCache();
+private:
+	DBCache();
+
+	struct Entry
+	{
+		dev_t dev = 0;
+		ino_t ino = 0;
+		off_t size = 0;
+		struct timespec mtime = {};
+		shared_ptr<const DBSnapshot> doc;
+		string filename;	// Name within watched directory
+		int wd = -1;		// Inotify watch, -1 if not watched
+		bool dirty = true;
+	};
+
+	static bool Matches(const Entry& e, const struct stat& st);
+	void Watch(const string& path, Entry& e);
+	void ProcessEvents();
+
+	mutex lock;
+	int ifd;
+	map<string, Entry> entries;
+};
+
+DBCache &DBCache::Instance()
+{
+	static DBCache cache;
+
+	return cache;
 }
 
-void SysConfig::PutKey(const string &scope, const string &key, const list<int> &value)
+shared_ptr<const DBSnapshot> DBCache::Lookup(const string &path)
 {
-	this->OpenDB();
+	lock_guard<mutex> l(this->lock);
 
-	json db = this->ReadDB();
+	auto it = this->entries.find( path );
+	if( it == this->entries.end() || ! it->second.doc )
+	{
+		return nullptr;
+	}
 
-	json l;
+	Entry& e = it->second;
 
-	for(const auto& val: value)
+	this->ProcessEvents();
+
+	if( e.wd >= 0 && ! e.dirty )
 	{
-		l.push_back(val);
+		return e.doc;
 	}
 
-	db[scope][key] = l;
+	struct stat st = {};
+	if( stat( path.c_str(), &st ) < 0 || ! DBCache::Matches( e, st ) )
+	{
+		return nullptr;
+	}
 
-	this->WriteDB(db);
+	e.dirty = false;
 
-	this->CloseDB();
+	return e.doc;
 }
 
-void SysConfig::PutKey(const string &scope, const string &key, bool value)
+shared_ptr<const DBSnapshot> DBCache::Lookup(const string &path, const struct stat &st)
 {
-	this->OpenDB();
+	lock_guard<mutex> l(this->lock);
 
-	json db = this->ReadDB();
+	auto it = this->entries.find( path );
+	if( it == this->entries.end() || ! DBCache::Matches( it->second, st ) )
+	{
+		return nullptr;
+	}
 
-	db[scope][key]=value;
+	this->ProcessEvents();
 
-	this->WriteDB(db);
+	// Stat can't tell writes within same mtime tick apart, trust inotify
+	if( it->second.wd >= 0 && it->second.dirty )
+	{
+		return nullptr;
+	}
 
-	this->CloseDB();
+	return it->second.doc;
 }
 
-void SysConfig::PutKey(const string &scope, const string &key, const list<bool> &value)
+void DBCache::Store(const string &path, const struct stat &st, shared_ptr<const DBSnapshot> doc)
 {
-	this->OpenDB();
+	lock_guard<mutex> l(this->lock);
 
-	json db = this->ReadDB();
+	// Pick up events generated before this stat, they are accounted for
+	this->ProcessEvents();
 
-	json l;
+	Entry& e = this->entries[path];
 
-	for(const auto& val: value)
+	e.dev = st.st_dev;
+	e.ino = st.st_ino;
+	e.size = st.st_size;
+	e.mtime = st.st_mtim;
+	e.doc = std::move(doc);
+	e.dirty = false;
+
+	if( e.wd < 0 )
 	{
-		l.push_back(val);
+		this->Watch( path, e );
+		// File could have changed before watch was added, stat once more
+		e.dirty = true;
 	}
-
-	db[scope][key] = l;
-
-	this->WriteDB(db);
-
-	this->CloseDB();
 }
 
-void SysConfig::RemoveKey(const string &scope, const string &key)
+DBCache::~DBCache()
 {
-	this->OpenDB();
-
-	json db = this->ReadDB();
-
-	if( this->HasKey( db, scope, key ) )
+	if( this->ifd >= 0 )
 	{
-		db[scope].erase(key);
-		if(db[scope].empty() )
-		{
-			db.erase(scope);
-		}
+		close( this->ifd );
+	}
+}
 
+DBCache::DBCache()
+{
+	if( ( this->ifd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC ) ) < 0 )
+	{
+		logg << Logger::Debug << "SysConfig: inotify unavailable, using stat for cache validation" << lend;
 	}
-	this->WriteDB(db);
-	this->CloseDB();
 }
 
-bool SysConfig::HasKey(const string &scope, const string &key)
+bool DBCache::Matches(const DBCache::Entry &e, const struct stat &st)
 {
-	json db = this->LoadDB();
+	return e.dev == st.st_dev &&
+			e.ino == st.st_ino &&
+			e.size == st.st_size &&
+			e.mtime.tv_sec == st.st_mtim.tv_sec &&
+			e.mtime.tv_nsec == st.st_mtim.tv_nsec;
+}
 
-	bool res = this->HasKey( db, scope, key);
+void DBCache::Watch(const string &path, DBCache::Entry &e)
+{
+	if( this->ifd < 0 )
+	{
+		return;
+	}
 
-	this->CloseDB();
+	// Watch directory rather than file to also catch file being replaced
+	string dir;
+	SplitPath( path, dir, e.filename );
 
-	return res;
+	e.wd = inotify_add_watch( this->ifd, dir.c_str(), watchmask );
+	if( e.wd < 0 )
+	{
+		logg << Logger::Debug << "SysConfig: unable to watch '" << dir << "'" << lend;
+	}
 }
 
-bool SysConfig::HasScope(const string &scope)
+void DBCache::ProcessEvents()
 {
-	json db = this->LoadDB();
+	if( this->ifd < 0 )
+	{
+		return;
+	}
 
-	bool res = this->HasScope( db, scope );
+	alignas(struct inotify_event) char buf[4096];
+	ssize_t len;
 
-	this->CloseDB();
+	while( ( len = read( this->ifd, buf, sizeof(buf) ) ) > 0 )
+	{
+		for( char* p = buf; p < buf + len; )
+		{
+			const struct inotify_event* ev = reinterpret_cast<const struct inotify_event*>( p );
 
-	return res;
-}
+			for( auto& entry: this->entries )
+			{
+				Entry& e = entry.second;
+				if( ev->mask & ( IN_Q_OVERFLOW | IN_IGNORED ) )
+				{
+					// Lost events or watch, revalidate all using stat
+					e.dirty = true;
+					if( ev->mask & IN_IGNORED && e.wd == ev->wd )
+					{
+						e.wd = -1;
+					}
+				}
+				else if( e.wd == ev->wd && ev->len > 0 && e.filename == ev->name )
+				{
+					e.dirty = true;
+				}
+			}
 
-SysConfig::~SysConfig()
-{
-	this->CloseDB();
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
 }
 
-json SysConfig::LoadDB()
+} // End anon NS
+
+/*
+ * Process wide watcher of databases, runs callbacks for subscribed keys
+ * when their values change.
+ *
+ * One thread waits for inotify events on the database directories. When
+ * a watched database changes it is reloaded and the value of each
+ * subscribed key is compared with the previous one.
+ */
+class DBWatcher
 {
+public:
+	static DBWatcher& Instance();
 
-	this->OpenDB();
+	int Add(const string& path, const string& scope, const string& key, SysConfig::WatchCallback cb);
+	void Remove(int id);
 
-	json val = this->ReadDB();
+	virtual ~DBWatcher();
+private:
+	DBWatcher();
 
-	this->CloseDB();
+	struct Subscription
+	{
+		string path;
+		string scope;
+		string key;
+		SysConfig::WatchCallback cb;
+		int wd = -1;
+		string filename;
+		bool present = false;
+		json value;
+	};
+
+	static bool ValueOf(const string& path, const string& scope, const string& key, json& value);
+
+	void Run();
+	void Check(const set<string>& paths);
+
+	mutex lock;
+	condition_variable done;
+	int ifd;
+	int pipefd[2];
+	thread worker;
+	int nextid;
+	int running;	// Id of subscription in callback, 0 if none
+	map<int, Subscription> subs;
+};
+
+DBWatcher &DBWatcher::Instance()
+{
+	static DBWatcher watcher;
 
-	return val;
+	return watcher;
 }
 
-json SysConfig::GetKey(const json &db, const string &scope, const string &key)
+int DBWatcher::Add(const string &path, const string &scope, const string &key, SysConfig::WatchCallback cb)
 {
-	if( this->HasKey(db, scope, key)  )
+	Subscription s;
+	s.path = path;
+	s.scope = scope;
+	s.key = key;
+	s.cb = std::move( cb );
+
+	string dir;
+	SplitPath( path, dir, s.filename );
+
+	// Held while adding watch so Remove can't drop it before we are registered
+	lock_guard<mutex> l( this->lock );
+
+	if( this->ifd < 0 || ( s.wd = inotify_add_watch( this->ifd, dir.c_str(), watchmask ) ) < 0 )
 	{
-		return db[scope][key];
+		throw ErrnoException("SysConfig: unable to watch '" + dir + "'");
 	}
-	else
+
+	// Read value after watch is in place to not miss any change
+	s.present = DBWatcher::ValueOf( path, scope, key, s.value );
+
+	if( ! this->worker.joinable() )
 	{
-		logg << Logger::Debug << "ConfigDB: No such key [" << key << "] or scope [" << scope << "] in database" << lend;
+		this->worker = thread( &DBWatcher::Run, this );
 	}
-	throw runtime_error("ConfigDB: key or scope not found");
-}
 
-bool SysConfig::DBExists()
-{
-	return File::FileExists( SYSCONFIGDBPATH );
-}
+	int id = this->nextid++;
+	this->subs[id] = std::move( s );
 
-bool SysConfig::HasScope(const json &val, const string &scope)
-{
-	return val.contains( scope ) && val[scope].is_object();
+	return id;
 }
 
-bool SysConfig::HasKey(const json &val, const string &scope, const string &key)
+void DBWatcher::Remove(int id)
 {
-	return this->HasScope(val, scope) && val[scope].contains(key);
-}
+	unique_lock<mutex> l( this->lock );
 
-void SysConfig::OpenDB()
-{
-	if( this->fd > 0 )
+	auto it = this->subs.find( id );
+	if( it == this->subs.end() )
 	{
-		throw runtime_error("Configdb already open");
+		return;
 	}
 
-	int flags = this->writeable ? O_RDWR|O_CREAT : O_RDONLY;
+	int wd = it->second.wd;
+	this->subs.erase( it );
 
-    if((this->fd=open(this->path.c_str(), flags, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH))<0)
+	// Let callback in flight finish, unless we are called from it
+	if( this_thread::get_id() != this->worker.get_id() )
 	{
-		logg << Logger::Error << "Unable to open file sysconfig database (" << path << ")"<< lend;
-		throw ErrnoException("Unable to open file '"+path+"'");
+		this->done.wait( l, [this, id]{ return this->running != id; } );
 	}
 
-	if( flock(this->fd, LOCK_EX) == -1 )
+	// Inotify watch is shared by all subscriptions in directory
+	for( const auto& sub: this->subs )
 	{
-		close( this->fd );
-		this->fd = 0;
-		logg << Logger::Error << "Unable to lock sysconfig database"<< lend;
-		throw ErrnoException("Unable to lock file '"+ this->path +"'");
+		if( sub.second.wd == wd )
+		{
+			return;
+		}
 	}
 
+	if( inotify_rm_watch( this->ifd, wd ) < 0 )
+	{
+		logg << Logger::Debug << "SysConfig: unable to remove watch: " << strerror( errno ) << lend;
+	}
+}
+
+DBWatcher::~DBWatcher()
+{
+	if( this->worker.joinable() )
+	{
+		char c = 0;
+		if( write( this->pipefd[1], &c, 1 ) != 1 )
+		{
+			logg << Logger::Error << "SysConfig: failed to signal watcher" << lend;
+		}
+		this->worker.join();
+	}
+
+	if( this->ifd >= 0 )
+	{
+		close( this->ifd );
+		close( this->pipefd[0] );
+		close( this->pipefd[1] );
+	}
+}
+
+DBWatcher::DBWatcher(): ifd(-1), pipefd{-1, -1}, nextid(1), running(0)
+{
+	// Make sure cache outlives us
+	DBCache::Instance();
+
+	if( pipe2( this->pipefd, O_CLOEXEC ) < 0 )
+	{
+		logg << Logger::Error << "SysConfig: unable to create watcher pipe" << lend;
+		return;
+	}
+
+	if( ( this->ifd = inotify_init1( IN_CLOEXEC ) ) < 0 )
+	{
+		logg << Logger::Error << "SysConfig: unable to initialize inotify" << lend;
+		close( this->pipefd[0] );
+		close( this->pipefd[1] );
+	}
+}
+
+bool DBWatcher::ValueOf(const string &path, const string &scope, const string &key, json &value)
+{
+	try
+	{
+		SysConfig cfg( path );
+
+		if( cfg.HasKey( scope, key ) )
+		{
+			value = cfg.GetKey( scope, key );
+			return true;
+		}
+	}
+	catch( std::exception& err )
+	{
+		logg << Logger::Debug << "SysConfig: unable to read '" << path << "': " << err.what() << lend;
+	}
+
+	value = json();
+	return false;
+}
+
+void DBWatcher::Run()
+{
+	alignas(struct inotify_event) char buf[4096];
+
+	while( true )
+	{
+		struct pollfd fds[2] = {
+			{ this->ifd, POLLIN, 0 },
+			{ this->pipefd[0], POLLIN, 0 }
+		};
+
+		if( poll( fds, 2, -1 ) < 0 )
+		{
+			if( errno == EINTR )
+			{
+				continue;
+			}
+			logg << Logger::Error << "SysConfig: watcher poll failed" << lend;
+			return;
+		}
+
+		if( fds[1].revents )
+		{
+			// Terminate
+			return;
+		}
+
+		ssize_t len = read( this->ifd, buf, sizeof(buf) );
+		if( len <= 0 )
+		{
+			continue;
+		}
+
+		set<string> changed;
+		{
+			lock_guard<mutex> l( this->lock );
+
+			for( char* p = buf; p < buf + len; )
+			{
+				const struct inotify_event* ev = reinterpret_cast<const struct inotify_event*>( p );
+
+				for( const auto& sub: this->subs )
+				{
+					const Subscription& s = sub.second;
+					if( ( ev->mask & IN_Q_OVERFLOW ) ||
+						( s.wd == ev->wd && ev->len > 0 && s.filename == ev->name ) )
+					{
+						changed.insert( s.path );
+					}
+				}
+
+				p += sizeof(struct inotify_event) + ev->len;
+			}
+		}
+
+		if( ! changed.empty() )
+		{
+			this->Check( changed );
+		}
+	}
+}
+
+void DBWatcher::Check(const set<string> &paths)
+{
+	vector<pair<int, Subscription>> subs;
+	{
+		lock_guard<mutex> l( this->lock );
+		for( const auto& sub: this->subs )
+		{
+			if( paths.find( sub.second.path ) != paths.end() )
+			{
+				subs.push_back( sub );
+			}
+		}
+	}
+
+	// Read values and run callbacks without lock held, callbacks may
+	// add or remove subscriptions
+	for( auto& sub: subs )
+	{
+		Subscription& s = sub.second;
+
+		json value;
+		bool present = DBWatcher::ValueOf( s.path, s.scope, s.key, value );
+
+		if( present == s.present && value == s.value )
+		{
+			continue;
+		}
+
+		{
+			lock_guard<mutex> l( this->lock );
+
+			auto it = this->subs.find( sub.first );
+			if( it == this->subs.end() )
+			{
+				// Removed meanwhile
+				continue;
+			}
+			it->second.present = present;
+			it->second.value = value;
+			this->running = sub.first;
+		}
+
+		try
+		{
+			s.cb( s.scope, s.key );
+		}
+		catch( std::exception& err )
+		{
+			logg << Logger::Error << "SysConfig: watch callback failed: " << err.what() << lend;
+		}
+
+		{
+			lock_guard<mutex> l( this->lock );
+			this->running = 0;
+		}
+		this->done.notify_all();
+	}
+}
+
+SysConfig::SysConfig(): path(SYSCONFIGDBPATH),fd(0), writeable(false), format(Auto)
+{
+
+}
+
+SysConfig::SysConfig(bool writeable): path(SYSCONFIGDBPATH),fd(0), writeable(writeable), format(Auto)
+{
+
+}
+
+SysConfig::SysConfig(string path, bool writeable): path(std::move(path)), fd(0), writeable(writeable), format(Auto)
+{
+
+}
+
+void SysConfig::Writeable(bool writeable)
+{
+	this->writeable = writeable;
+}
+
+bool SysConfig::IsWriteable()
+{
+	return this->writeable;
+}
+
+int SysConfig::Watch(const string &scope, const string &key, SysConfig::WatchCallback cb)
+{
+	return DBWatcher::Instance().Add( this->path, scope, key, std::move( cb ) );
+}
+
+void SysConfig::Unwatch(int id)
+{
+	DBWatcher::Instance().Remove( id );
+}
+
+SysConfig::KeyHandle::KeyHandle(const char *scope, const char *key): scope(scope), key(key)
+{
+
+}
+
+void SysConfig::SetFormat(SysConfig::Format format)
+{
+	this->format = format;
+}
+
+SysConfig::Format SysConfig::GetFormat()
+{
+	return this->format;
+}
+
+string SysConfig::GetKeyAsString(const string &scope, const string &key)
+{
+	json val = this->GetKey( scope, key );
+
+	if( val.is_string() )
+	{
+		 return val;
+	}
+
+	logg << Logger::Error << "Key " << key << " not of wanted type" << lend;
+	throw runtime_error("Key not of wanted type in config db");
+}
+
+list<string> SysConfig::GetKeyAsStringList(const string &scope, const string &key)
+{
+	json val = this->GetKey( scope, key );
+
+	if( val.is_array() )
+	{
+		list<string> ret;
+		for( const auto& item: val)
+		{
+			if( item.is_string() )
+			{
+				ret.push_back(item);
+			}
+			else
+			{
+				logg << Logger::Error << "ConfigDB: unexpected data type in list"<<lend;
+				throw runtime_error("Unexpected data type in list");
+			}
+		}
+		return ret;
+	}
+
+	logg << Logger::Error << "Key " << key << " not of wanted type" << lend;
+	throw runtime_error("Key not of wanted type in config db");
+}
+
+int SysConfig::GetKeyAsInt(const string &scope, const string &key)
+{
+	json val = this->GetKey( scope, key );
+
+	if( val.is_number_integer() )
+	{
+		 return val;
+	}
+
+	logg << Logger::Error << "Key " << key << " not of wanted type" << lend;
+
+	throw runtime_error("Key not of wanted type in config db");
+}
+
+list<int> SysConfig::GetKeyAsIntList(const string &scope, const string &key)
+{
+	json val = this->GetKey( scope, key );
+
+	if( val.is_array() )
+	{
+		list<int> ret;
+		for( const auto& item: val )
+		{
+			if( item.is_number_integer())
+			{
+				ret.push_back(item);
+			}
+			else
+			{
+				logg << Logger::Error << "ConfigDB: unexpected data type in list"<<lend;
+				throw runtime_error("Unexpected data type in list");
+			}
+		}
+		return ret;
+	}
+
+	logg << Logger::Error << "Key " << key << " not of wanted type" << lend;
+	throw runtime_error("Key not of wanted type in config db");
+}
+
+bool SysConfig::GetKeyAsBool(const string &scope, const string &key)
+{
+	json val = this->GetKey( scope, key );
+
+	if( val.is_boolean() )
+	{
+		 return val;
+	}
+
+	logg << Logger::Error << "Key " << key << " not of wanted type" << lend;
+
+	throw runtime_error("Key not of wanted type in config db");
+}
+
+list<bool> SysConfig::GetKeyAsBoolList(const string &scope, const string &key)
+{
+	json val = this->GetKey( scope, key );
+
+	if( val.is_array() )
+	{
+		list<bool> ret;
+		for(const auto& item: val)
+		{
+			if( item.is_boolean() )
+			{
+				ret.push_back(item);
+			}
+			else
+			{
+				logg << Logger::Error << "ConfigDB: unexpected data type in list"<<lend;
+				throw runtime_error("Unexpected data type in list");
+			}
+		}
+		return ret;
+	}
+
+	logg << Logger::Error << "Key " << key << " not of wanted type" << lend;
+	throw runtime_error("Key not of wanted type in config db");
+
+}
+
+void SysConfig::PutKey(const string &scope, const string &key, const char *value)
+{
+	this->PutKey(scope, key, string(value));
+}
+
+void SysConfig::PutKey(const string &scope, const string &key, const string &value)
+{
+	Transaction tr(*this);
+	tr.PutKey(scope, key, value);
+	tr.Commit();
+}
+
+void SysConfig::PutKey(const string &scope, const string &key, const list<string> &value)
+{
+	Transaction tr(*this);
+	tr.PutKey(scope, key, value);
+	tr.Commit();
+}
+
+void SysConfig::PutKey(const string &scope, const string &key, int value)
+{
+	Transaction tr(*this);
+	tr.PutKey(scope, key, value);
+	tr.Commit();
+}
+
+void SysConfig::PutKey(const string &scope, const string &key, const list<int> &value)
+{
+	Transaction tr(*this);
+	tr.PutKey(scope, key, value);
+	tr.Commit();
+}
+
+void SysConfig::PutKey(const string &scope, const string &key, bool value)
+{
+	Transaction tr(*this);
+	tr.PutKey(scope, key, value);
+	tr.Commit();
+}
+
+void SysConfig::PutKey(const string &scope, const string &key, const list<bool> &value)
+{
+	Transaction tr(*this);
+	tr.PutKey(scope, key, value);
+	tr.Commit();
+}
+
+void SysConfig::RemoveKey(const string &scope, const string &key)
+{
+	Transaction tr(*this);
+	tr.RemoveKey(scope, key);
+	tr.Commit();
+}
+
+bool SysConfig::HasKey(const string &scope, const string &key)
+{
+	shared_ptr<const json> sc = this->LoadDB()->Scope( scope );
+
+	return sc && sc->is_object() && sc->contains( key );
+}
+
+bool SysConfig::HasScope(const string &scope)
+{
+	shared_ptr<const json> sc = this->LoadDB()->Scope( scope );
+
+	return sc && sc->is_object();
+}
+
+SysConfig::~SysConfig()
+{
+	this->CloseDB();
+}
+
+shared_ptr<const DBSnapshot> SysConfig::LoadDB()
+{
+	// Database is already open and locked by transaction
+	if( this->txsnap )
+	{
+		return this->txsnap;
+	}
+
+	shared_ptr<const DBSnapshot> val = DBCache::Instance().Lookup( this->path );
+
+	if( val )
+	{
+		return val;
+	}
+
+	this->OpenDB();
+
+	try
+	{
+		val = this->ReadDB();
+	}
+	catch( ... )
+	{
+		this->CloseDB();
+		throw;
+	}
+
+	this->CloseDB();
+
+	return val;
+}
+
+json SysConfig::GetKey(const string &scope, const string &key)
+{
+	// Only decode the scope asked for
+	shared_ptr<const json> sc = this->LoadDB()->Scope( scope );
+
+	if( sc && sc->is_object() && sc->contains( key ) )
+	{
+		return (*sc)[key];
+	}
+	else
+	{
+		logg << Logger::Debug << "ConfigDB: No such key [" << key << "] or scope [" << scope << "] in database" << lend;
+	}
+	throw runtime_error("ConfigDB: key or scope not found");
+}
+
+shared_ptr<const json> SysConfig::GetKey(SysConfig::KeyHandle &handle)
+{
+	shared_ptr<const DBSnapshot> snap = this->LoadDB();
+
+	lock_guard<mutex> l( handle.lock );
+
+	// Resolve key again only if database changed since last lookup
+	if( handle.snap.lock() != snap )
+	{
+		shared_ptr<const json> sc = snap->Scope( handle.scope );
+
+		if( sc && sc->is_object() && sc->contains( handle.key ) )
+		{
+			handle.value = shared_ptr<const json>( sc, &(*sc)[handle.key] );
+		}
+		else
+		{
+			handle.value = nullptr;
+		}
+		handle.snap = snap;
+	}
+
+	if( ! handle.value )
+	{
+		logg << Logger::Debug << "ConfigDB: No such key [" << handle.key << "] or scope [" << handle.scope << "] in database" << lend;
+		throw runtime_error("ConfigDB: key or scope not found");
+	}
+
+	return handle.value;
+}
+
+template<typename T>
+static void ConvertValue(const SysConfig::KeyHandle& handle, const json& val, T& value)
+{
+	try
+	{
+		value = val.get<T>();
+	}
+	catch( json::type_error& err )
+	{
+		logg << Logger::Error << "Key " << handle.key << " not of wanted type" << lend;
+		throw runtime_error("Key not of wanted type in config db");
+	}
+}
+
+void SysConfig::GetValue(SysConfig::KeyHandle &handle, string &value)
+{
+	ConvertValue( handle, *this->GetKey( handle ), value );
+}
+
+void SysConfig::GetValue(SysConfig::KeyHandle &handle, list<string> &value)
+{
+	ConvertValue( handle, *this->GetKey( handle ), value );
+}
+
+void SysConfig::GetValue(SysConfig::KeyHandle &handle, int &value)
+{
+	const json& val = *this->GetKey( handle );
+
+	// Don't silently truncate floats
+	if( ! val.is_number_integer() )
+	{
+		logg << Logger::Error << "Key " << handle.key << " not of wanted type" << lend;
+		throw runtime_error("Key not of wanted type in config db");
+	}
+
+	ConvertValue( handle, val, value );
+}
+
+void SysConfig::GetValue(SysConfig::KeyHandle &handle, list<int> &value)
+{
+	const json& val = *this->GetKey( handle );
+
+	// Same rules as GetKeyAsIntList, no floats in list
+	if( ! val.is_array() )
+	{
+		logg << Logger::Error << "Key " << handle.key << " not of wanted type" << lend;
+		throw runtime_error("Key not of wanted type in config db");
+	}
+
+	for( const auto& item: val )
+	{
+		if( ! item.is_number_integer() )
+		{
+			logg << Logger::Error << "ConfigDB: unexpected data type in list"<<lend;
+			throw runtime_error("Unexpected data type in list");
+		}
+	}
+
+	ConvertValue( handle, val, value );
+}
+
+void SysConfig::GetValue(SysConfig::KeyHandle &handle, bool &value)
+{
+	ConvertValue( handle, *this->GetKey( handle ), value );
+}
+
+void SysConfig::GetValue(SysConfig::KeyHandle &handle, list<bool> &value)
+{
+	ConvertValue( handle, *this->GetKey( handle ), value );
+}
+
+bool SysConfig::DBExists()
+{
+	return File::FileExists( SYSCONFIGDBPATH );
+}
+
+bool SysConfig::HasScope(const json &val, const string &scope)
+{
+	return val.contains( scope ) && val[scope].is_object();
+}
+
+bool SysConfig::HasKey(const json &val, const string &scope, const string &key)
+{
+	return this->HasScope(val, scope) && val[scope].contains(key);
+}
+
+void SysConfig::OpenDB()
+{
+	if( this->fd > 0 )
+	{
+		throw runtime_error("Configdb already open");
+	}
+
+	int flags = this->writeable ? O_RDWR|O_CREAT : O_RDONLY;
+
+	// Readers share the lock, only writers are serialized
+	int lockop = this->writeable ? LOCK_EX : LOCK_SH;
+
+	while( true )
+	{
+		if((this->fd=open(this->path.c_str(), flags, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH))<0)
+		{
+			this->fd = 0;
+			logg << Logger::Error << "Unable to open file sysconfig database (" << path << ")"<< lend;
+			throw ErrnoException("Unable to open file '"+path+"'");
+		}
+
+		if( flock(this->fd, lockop) == -1 )
+		{
+			close( this->fd );
+			this->fd = 0;
+			logg << Logger::Error << "Unable to lock sysconfig database"<< lend;
+			throw ErrnoException("Unable to lock file '"+ this->path +"'");
+		}
+
+		// Writers replace the file using rename, make sure we locked the
+		// file currently in place and not one replaced while we waited
+		struct stat fst = {}, pst = {};
+		if( fstat( this->fd, &fst ) == 0 && stat( this->path.c_str(), &pst ) == 0 &&
+				fst.st_dev == pst.st_dev && fst.st_ino == pst.st_ino )
+		{
+			break;
+		}
+
+		close( this->fd );
+		this->fd = 0;
+	}
 }
 
 void SysConfig::CloseDB()
@@ -418,20 +1343,28 @@ void SysConfig::CloseDB()
 	}
 }
 
-json SysConfig::ReadDB()
+shared_ptr<const DBSnapshot> SysConfig::ReadDB()
 {
-	json val;
 	struct stat st = {};
 
 	if(fstat(this->fd,&st))
 	{
-		return val;
+		return DBSnapshot::FromJson( json(), SysConfig::Json );
+	}
+
+	// Unchanged since we last parsed it?
+	shared_ptr<const DBSnapshot> cached = DBCache::Instance().Lookup( this->path, st );
+	if( cached )
+	{
+		return cached;
 	}
 
 	// Empty file
 	if( st.st_size == 0 )
 	{
-		return val;
+		cached = DBSnapshot::FromJson( json(), SysConfig::Json );
+		DBCache::Instance().Store( this->path, st, cached );
+		return cached;
 	}
 
 	// Make sure we have room for data
@@ -456,42 +1389,297 @@ json SysConfig::ReadDB()
 
 	}while( bytes_read>0);
 
+	cached = DBSnapshot::FromData( std::move(data) );
+	DBCache::Instance().Store( this->path, st, cached );
+
+	return cached;
+}
+
+void SysConfig::WriteDB(const json &db, Format format)
+{
+	if( ! this->writeable )
+	{
+		logg << Logger::Error << "SysConfig: tried to write readonly sysconfig" << lend;
+		throw std::runtime_error("Attempt to write readonly config database");
+	}
+
+	// Write complete database to a temporary file next to the original and
+	// rename it into place, readers thus see either old or new version.
+	string tmppath = this->path + ".XXXXXX";
+	vector<char> tmpname( tmppath.begin(), tmppath.end() );
+	tmpname.push_back('\0');
+
+	int tfd = mkstemp( &tmpname.front() );
+	if( tfd < 0 )
+	{
+		throw ErrnoException("ConfigDB: failed to create temporary db-file");
+	}
+	tmppath = &tmpname.front();
+
 	try
 	{
-		val = json::parse(string(&data.front(), data.size()) );
+		// Keep permissions and, if allowed, ownership of current file
+		struct stat ost = {};
+		if( fstat( this->fd, &ost ) == 0 )
+		{
+			if( fchmod( tfd, ost.st_mode & 07777 ) < 0 )
+			{
+				throw ErrnoException("ConfigDB: failed to set mode on temporary db-file");
+			}
+			if( fchown( tfd, ost.st_uid, ost.st_gid ) < 0 )
+			{
+				logg << Logger::Debug << "ConfigDB: unable to preserve ownership of db-file" << lend;
+			}
+		}
+
+		string out = DBSnapshot::Encode( db, format );
+
+		size_t written = 0;
+		while( written < out.size() )
+		{
+			ssize_t ret = write( tfd, out.data() + written, out.size() - written );
+			if( ret < 0 )
+			{
+				if( errno == EINTR )
+				{
+					continue;
+				}
+				throw ErrnoException("ConfigDB: failed to write temporary db-file");
+			}
+			written += ret;
+		}
+
+		if( fsync( tfd ) < 0 )
+		{
+			throw ErrnoException("ConfigDB: failed to sync temporary db-file");
+		}
+
+		if( rename( tmppath.c_str(), this->path.c_str() ) < 0 )
+		{
+			throw ErrnoException("ConfigDB: failed to replace db-file");
+		}
+	}
+	catch( ... )
+	{
+		close( tfd );
+		unlink( tmppath.c_str() );
+		throw;
 	}
-	catch (json::parse_error& err)
+
+	this->SyncDir();
+
+	// Update cache with what we just wrote
+	struct stat st = {};
+	if( fstat( tfd, &st ) == 0 )
 	{
-		logg << Logger::Error << "Failed to parse sysconfig datbaase: " << err.what() <<lend;
+		DBCache::Instance().Store( this->path, st, DBSnapshot::FromJson( db, format ) );
 	}
 
-	return val;
+	close( tfd );
 }
 
-void SysConfig::WriteDB(const json &db)
+void SysConfig::SyncDir()
 {
-	if( ! this->writeable )
+	string dir, file;
+	SplitPath( this->path, dir, file );
+
+	int dfd = open( dir.c_str(), O_RDONLY | O_DIRECTORY );
+	if( dfd < 0 )
+	{
+		logg << Logger::Debug << "ConfigDB: unable to open '" << dir << "' for sync" << lend;
+		return;
+	}
+
+	if( fsync( dfd ) < 0 )
+	{
+		logg << Logger::Debug << "ConfigDB: unable to sync '" << dir << "'" << lend;
+	}
+
+	close( dfd );
+}
+
+/*
+ * Implementation of transaction
+ */
+
+SysConfig::Transaction::Transaction(SysConfig &cfg): cfg(cfg), format(Json), active(false), modified(false)
+{
+	if( ! this->cfg.writeable )
 	{
 		logg << Logger::Error << "SysConfig: tried to write readonly sysconfig" << lend;
 		throw std::runtime_error("Attempt to write readonly config database");
 	}
 
-	if( lseek( this->fd, SEEK_SET, 0 ) < 0 )
+	this->cfg.OpenDB();
+
+	try
+	{
+		shared_ptr<const DBSnapshot> snap = this->cfg.ReadDB();
+
+		this->db = snap->Document();
+		this->format = this->cfg.format == Auto ? snap->GetFormat() : this->cfg.format;
+
+		// Format change needs a rewrite to migrate database
+		this->modified = this->format != snap->GetFormat();
+
+		this->cfg.txsnap = snap;
+	}
+	catch( ... )
+	{
+		this->cfg.CloseDB();
+		throw;
+	}
+
+	this->active = true;
+}
+
+void SysConfig::Transaction::PutKey(const string &scope, const string &key, const char *value)
+{
+	this->PutKey(scope, key, string(value));
+}
+
+void SysConfig::Transaction::PutKey(const string &scope, const string &key, const string &value)
+{
+	this->CheckActive();
+
+	this->db[scope][key] = value;
+	this->modified = true;
+}
+
+void SysConfig::Transaction::PutKey(const string &scope, const string &key, const list<string> &value)
+{
+	this->CheckActive();
+
+	json l;
+
+	for(const auto& val: value)
+	{
+		l.push_back(val);
+	}
+
+	this->db[scope][key] = l;
+	this->modified = true;
+}
+
+void SysConfig::Transaction::PutKey(const string &scope, const string &key, int value)
+{
+	this->CheckActive();
+
+	this->db[scope][key] = value;
+	this->modified = true;
+}
+
+void SysConfig::Transaction::PutKey(const string &scope, const string &key, const list<int> &value)
+{
+	this->CheckActive();
+
+	json l;
+
+	for(const auto& val: value)
+	{
+		l.push_back(val);
+	}
+
+	this->db[scope][key] = l;
+	this->modified = true;
+}
+
+void SysConfig::Transaction::PutKey(const string &scope, const string &key, bool value)
+{
+	this->CheckActive();
+
+	this->db[scope][key] = value;
+	this->modified = true;
+}
+
+void SysConfig::Transaction::PutKey(const string &scope, const string &key, const list<bool> &value)
+{
+	this->CheckActive();
+
+	json l;
+
+	for(const auto& val: value)
+	{
+		l.push_back(val);
+	}
+
+	this->db[scope][key] = l;
+	this->modified = true;
+}
+
+void SysConfig::Transaction::RemoveKey(const string &scope, const string &key)
+{
+	this->CheckActive();
+
+	if( this->cfg.HasKey( this->db, scope, key ) )
 	{
-		throw ErrnoException("ConfigDB: failed to rewind db-file before write");
+		this->db[scope].erase(key);
+		if(this->db[scope].empty() )
+		{
+			this->db.erase(scope);
+		}
+		this->modified = true;
 	}
+}
+
+bool SysConfig::Transaction::HasKey(const string &scope, const string &key)
+{
+	this->CheckActive();
+
+	return this->cfg.HasKey( this->db, scope, key );
+}
+
+bool SysConfig::Transaction::HasScope(const string &scope)
+{
+	this->CheckActive();
+
+	return this->cfg.HasScope( this->db, scope );
+}
+
+void SysConfig::Transaction::Commit()
+{
+	this->CheckActive();
 
-	if( ftruncate( this->fd, 0 ) < 0 )
+	try
+	{
+		if( this->modified )
+		{
+			this->cfg.WriteDB( this->db, this->format );
+		}
+	}
+	catch( ... )
 	{
-		throw ErrnoException("ConfigDB: failed to truncate db-file before write");
+		this->Rollback();
+		throw;
 	}
 
-	string out = db.dump(4);
+	this->active = false;
+	this->cfg.txsnap.reset();
+	this->cfg.CloseDB();
+}
+
+void SysConfig::Transaction::Rollback()
+{
+	if( this->active )
+	{
+		this->active = false;
+		this->modified = false;
+		this->cfg.txsnap.reset();
+		this->cfg.CloseDB();
+	}
+}
 
-	__gnu_cxx::stdio_filebuf<char> fb(this->fd,std::ios_base::out);
-	iostream of(&fb);
+SysConfig::Transaction::~Transaction()
+{
+	this->Rollback();
+}
 
-	of<< out <<flush;
+void SysConfig::Transaction::CheckActive()
+{
+	if( ! this->active )
+	{
+		throw runtime_error("ConfigDB: transaction already committed or rolled back");
+	}
 }
 
 } // END NameSpace OPI
@@ -20,7 +20,10 @@
 #ifndef SYSCONFIG_H
 #define SYSCONFIG_H
 
+#include <functional>
 #include <list>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <nlohmann/json.hpp>
 
@@ -29,9 +32,70 @@ using json = nlohmann::json;
 
 namespace OPI {
 
+class DBSnapshot;
+class DBWatcher;
+
 class SysConfig
 {
 public:
+
+	/*
+	 * On disk format used when writing the database. Reads detect format
+	 * from file content. Auto keeps the format of the current file.
+	 */
+	enum Format {
+		Auto,
+		Json,
+		Binary
+	};
+
+	/*
+	 * Batch any number of updates into one read and one write of the
+	 * database. The database is locked for the lifetime of the
+	 * transaction, changes are discarded unless Commit is called.
+	 *
+	 * Reads on the SysConfig meanwhile are served from the database as
+	 * it was when the transaction started, uncommitted changes are only
+	 * visible through the transaction.
+	 */
+	class Transaction
+	{
+	public:
+		Transaction(SysConfig& cfg);
+
+		Transaction( const Transaction&) = delete;
+		Transaction& operator=( const Transaction&) = delete;
+
+		void PutKey(const string& scope, const string& key, const char* value);
+		void PutKey(const string& scope, const string& key, const string& value);
+		void PutKey(const string& scope, const string& key, const list<string>& value);
+		void PutKey(const string& scope, const string& key, int value);
+		void PutKey(const string& scope, const string& key, const list<int>& value);
+		void PutKey(const string& scope, const string& key, bool value);
+		void PutKey(const string& scope, const string& key, const list<bool>& value);
+
+		void RemoveKey(const string& scope, const string& key);
+
+		bool HasKey(const string& scope, const string& key);
+		bool HasScope(const string& scope);
+
+		// Write all changes and release lock
+		void Commit();
+
+		// Discard all changes and release lock
+		void Rollback();
+
+		virtual ~Transaction();
+	private:
+		void CheckActive();
+
+		SysConfig& cfg;
+		json db;
+		Format format;
+		bool active;
+		bool modified;
+	};
+
 	SysConfig();
 	SysConfig(bool writeable);
 	SysConfig(string  path, bool writeable = false);
@@ -39,6 +103,45 @@ public:
 	void Writeable(bool writeable);
 	bool IsWriteable();
 
+	void SetFormat(Format format);
+	Format GetFormat();
+
+	/*
+	 * Resolved location of a key in the database. Remembers the value
+	 * found in the last database snapshot so repeated lookups of the same
+	 * key, while the database is unchanged, skip scope and key lookup.
+	 */
+	class KeyHandle
+	{
+	public:
+		KeyHandle(const char* scope, const char* key);
+
+		KeyHandle( const KeyHandle&) = delete;
+		KeyHandle& operator=( const KeyHandle&) = delete;
+
+		const string scope;
+		const string key;
+	private:
+		friend class SysConfig;
+
+		mutex lock;
+		weak_ptr<const DBSnapshot> snap;
+		shared_ptr<const json> value;
+	};
+
+	/*
+	 * Typed access to a key declared in the registry below, i.e.
+	 *   Get<Keys::Filesystem::StorageMount>()
+	 * Unknown keys and unsupported types fail at compile time.
+	 */
+	template<typename Key>
+	typename Key::type Get()
+	{
+		typename Key::type ret;
+		this->GetValue( Key::Handle(), ret );
+		return ret;
+	}
+
 	string GetKeyAsString(const string& scope, const string& key);
 	list<string> GetKeyAsStringList(const string& scope, const string& key);
 	int GetKeyAsInt(const string& scope, const string& key);
@@ -59,27 +162,102 @@ public:
 	bool HasKey(const string& scope, const string& key);
 	bool HasScope(const string& scope);
 
+	typedef function<void(const string& scope, const string& key)> WatchCallback;
+
+	/*
+	 * Get callback when value of key changes, is added or removed. Callbacks
+	 * are run on a watcher thread shared by the process. Returns id to be
+	 * used with Unwatch.
+	 *
+	 * Once Unwatch returns the callback is neither running nor called
+	 * again, Unwatch thus waits for a callback in progress. Called from a
+	 * callback it only prevents further calls.
+	 */
+	int Watch(const string& scope, const string& key, WatchCallback cb);
+	static void Unwatch(int id);
+
 	virtual ~SysConfig();
 private:
+	friend class DBWatcher;
 
 	// Convenience function
-	// Open, Load and close file, for get operations
-	json LoadDB();
+	// Get a snapshot of the database for get operations. Served from the
+	// process wide cache, only opening the file if it has changed on disk.
+	shared_ptr<const DBSnapshot> LoadDB();
+
+	json GetKey(const string& scope, const string& key);
 
-	json GetKey(const json& db, const string& scope, const string& key);
+	shared_ptr<const json> GetKey(KeyHandle& handle);
+	void GetValue(KeyHandle& handle, string& value);
+	void GetValue(KeyHandle& handle, list<string>& value);
+	void GetValue(KeyHandle& handle, int& value);
+	void GetValue(KeyHandle& handle, list<int>& value);
+	void GetValue(KeyHandle& handle, bool& value);
+	void GetValue(KeyHandle& handle, list<bool>& value);
 
 	bool DBExists();
 	bool HasScope(const json& val, const string& scope);
 	bool HasKey(const json& val, const string& scope, const string& key);
 	void OpenDB();
 	void CloseDB();
-	json ReadDB();
-	void WriteDB(const json& db);
+	shared_ptr<const DBSnapshot> ReadDB();
+	// Atomically replace database, write temp file, fsync and rename
+	void WriteDB(const json& db, Format format);
+	void SyncDir();
 
 	string path;
 	int fd;
 	bool writeable;
+	Format format;
+	// Database as read by active transaction, which holds the lock
+	shared_ptr<const DBSnapshot> txsnap;
 };
+
+// Declare key ktype kscope:kkey in registry as name
+#define SYSCONFIG_KEY(name, ktype, kscope, kkey) \
+	struct name \
+	{ \
+		using type = ktype; \
+		static SysConfig::KeyHandle& Handle() \
+		{ \
+			static SysConfig::KeyHandle handle( kscope, kkey ); \
+			return handle; \
+		} \
+	}
+
+/*
+ * Registry of known config keys
+ */
+namespace Keys
+{
+namespace Dns
+{
+	SYSCONFIG_KEY( Provider,	string,	"dns",	"provider" );
+	SYSCONFIG_KEY( DnsAuthKey,	string,	"dns",	"dnsauthkey" );
+}
+
+namespace Filesystem
+{
+	SYSCONFIG_KEY( StorageMount,	string,	"filesystem",	"storagemount" );
+}
+
+namespace Hostinfo
+{
+	SYSCONFIG_KEY( Hostname,	string,	"hostinfo",	"hostname" );
+	SYSCONFIG_KEY( Domain,	string,	"hostinfo",	"domain" );
+	SYSCONFIG_KEY( UnitId,	string,	"hostinfo",	"unitid" );
+	SYSCONFIG_KEY( CaFile,	string,	"hostinfo",	"cafile" );
+}
+
+namespace Mail
+{
+	SYSCONFIG_KEY( VMailbox,	string,	"mail",	"vmailbox" );
+	SYSCONFIG_KEY( VDomains,	string,	"mail",	"vdomains" );
+	SYSCONFIG_KEY( SaslPasswd,	string,	"mail",	"saslpasswd" );
+	SYSCONFIG_KEY( OpRelayServer,	string,	"mail",	"oprelayserver" );
+}
+} // End NS Keys
+
 }
 
 #endif // SYSCONFIG_H
@@ -0,0 +1,188 @@
+#include "X509Helper.h"
+
+#include <memory>
+#include <stdexcept>
+
+#include <openssl/bio.h>
+#include <openssl/bn.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+namespace OPI {
+namespace X509Helper {
+
+typedef unique_ptr<BIO, decltype(&BIO_free)> BIOPtr;
+typedef unique_ptr<BIGNUM, decltype(&BN_free)> BIGNUMPtr;
+typedef unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> EVP_PKEYPtr;
+typedef unique_ptr<X509, decltype(&X509_free)> X509Ptr;
+typedef unique_ptr<X509_EXTENSION, decltype(&X509_EXTENSION_free)> X509_EXTENSIONPtr;
+typedef unique_ptr<X509_REQ, decltype(&X509_REQ_free)> X509_REQPtr;
+
+static runtime_error ssl_error(const string& what)
+{
+	char buf[256] = {0};
+	unsigned long err = ERR_get_error();
+	ERR_clear_error();
+
+	if( err != 0 )
+	{
+		ERR_error_string_n( err, buf, sizeof( buf ) );
+		return runtime_error( what + ": " + buf );
+	}
+	return runtime_error( what );
+}
+
+static EVP_PKEYPtr ssl_key(const unsigned char* key, size_t keylen, Format keyformat)
+{
+	EVP_PKEYPtr pkey( nullptr, EVP_PKEY_free );
+
+	if( keyformat == DER )
+	{
+		pkey.reset( d2i_AutoPrivateKey( nullptr, &key, keylen ) );
+	}
+	else
+	{
+		BIOPtr bio( BIO_new_mem_buf( key, keylen ), BIO_free );
+		if( ! bio )
+		{
+			throw ssl_error("Unable to allocate BIO");
+		}
+		pkey.reset( PEM_read_bio_PrivateKey( bio.get(), nullptr, nullptr, nullptr ) );
+	}
+
+	if( ! pkey )
+	{
+		throw ssl_error("Unable to read private key");
+	}
+
+	return pkey;
+}
+
+static void ssl_name(X509_NAME* name, const string& cn, const string& company)
+{
+	if( ! X509_NAME_add_entry_by_txt( name, "O", MBSTRING_UTF8,
+				reinterpret_cast<const unsigned char*>( company.c_str() ), -1, -1, 0 ) ||
+		! X509_NAME_add_entry_by_txt( name, "CN", MBSTRING_UTF8,
+				reinterpret_cast<const unsigned char*>( cn.c_str() ), -1, -1, 0 ) )
+	{
+		throw ssl_error("Unable to set subject name");
+	}
+}
+
+static void ssl_extension(X509* cert, X509V3_CTX* ctx, int nid, const char* value)
+{
+	X509_EXTENSIONPtr ext( X509V3_EXT_conf_nid( nullptr, ctx, nid, value ), X509_EXTENSION_free );
+	if( ! ext || ! X509_add_ext( cert, ext.get(), -1 ) )
+	{
+		throw ssl_error( string("Unable to add extension ") + OBJ_nid2sn( nid ) );
+	}
+}
+
+template<class T, class Writer, class Encoder>
+static vector<unsigned char> ssl_out(T* obj, Format format, Writer write, Encoder encode)
+{
+	if( format == PEM )
+	{
+		BIOPtr bio( BIO_new( BIO_s_mem() ), BIO_free );
+		if( ! bio || ! write( bio.get(), obj ) )
+		{
+			throw ssl_error("Unable to encode PEM");
+		}
+
+		char* data = nullptr;
+		long len = BIO_get_mem_data( bio.get(), &data );
+
+		return vector<unsigned char>( data, data + len );
+	}
+
+	int len = encode( obj, nullptr );
+	if( len <= 0 )
+	{
+		throw ssl_error("Unable to encode DER");
+	}
+
+	vector<unsigned char> ret( len );
+	unsigned char* p = ret.data();
+	encode( obj, &p );
+
+	return ret;
+}
+
+vector<unsigned char> MakeCSR(const unsigned char *key, size_t keylen, Format keyformat,
+		const string &cn, const string &company, Format format)
+{
+	EVP_PKEYPtr pkey = ssl_key( key, keylen, keyformat );
+
+	X509_REQPtr req( X509_REQ_new(), X509_REQ_free );
+	if( ! req )
+	{
+		throw ssl_error("Unable to allocate request");
+	}
+
+	ssl_name( X509_REQ_get_subject_name( req.get() ), cn, company );
+
+	if( ! X509_REQ_set_version( req.get(), 0 ) ||
+		! X509_REQ_set_pubkey( req.get(), pkey.get() ) ||
+		! X509_REQ_sign( req.get(), pkey.get(), EVP_sha256() ) )
+	{
+		throw ssl_error("Unable to create request");
+	}
+
+	return ssl_out( req.get(), format, PEM_write_bio_X509_REQ, i2d_X509_REQ );
+}
+
+/*
+ * Same content as "openssl req -x509" with the default configuration,
+ * a random serial, subject as issuer and CA basic constraints.
+ */
+vector<unsigned char> MakeSelfSignedCert(const unsigned char *key, size_t keylen, Format keyformat,
+		const string &cn, const string &company, unsigned int days, Format format)
+{
+	EVP_PKEYPtr pkey = ssl_key( key, keylen, keyformat );
+
+	X509Ptr cert( X509_new(), X509_free );
+	if( ! cert )
+	{
+		throw ssl_error("Unable to allocate certificate");
+	}
+
+	BIGNUMPtr serial( BN_new(), BN_free );
+	if( ! serial ||
+		! BN_rand( serial.get(), 159, BN_RAND_TOP_ANY, BN_RAND_BOTTOM_ANY ) ||
+		! BN_to_ASN1_INTEGER( serial.get(), X509_get_serialNumber( cert.get() ) ) )
+	{
+		throw ssl_error("Unable to set serial");
+	}
+
+	ssl_name( X509_get_subject_name( cert.get() ), cn, company );
+
+	if( ! X509_set_version( cert.get(), 2 ) ||
+		! X509_set_issuer_name( cert.get(), X509_get_subject_name( cert.get() ) ) ||
+		! X509_gmtime_adj( X509_getm_notBefore( cert.get() ), 0 ) ||
+		! X509_gmtime_adj( X509_getm_notAfter( cert.get() ), 60L * 60 * 24 * days ) ||
+		! X509_set_pubkey( cert.get(), pkey.get() ) )
+	{
+		throw ssl_error("Unable to create certificate");
+	}
+
+	X509V3_CTX ctx;
+	X509V3_set_ctx_nodb( &ctx );
+	X509V3_set_ctx( &ctx, cert.get(), cert.get(), nullptr, nullptr, 0 );
+
+	ssl_extension( cert.get(), &ctx, NID_subject_key_identifier, "hash" );
+	ssl_extension( cert.get(), &ctx, NID_authority_key_identifier, "keyid:always" );
+	ssl_extension( cert.get(), &ctx, NID_basic_constraints, "critical,CA:TRUE" );
+
+	if( ! X509_sign( cert.get(), pkey.get(), EVP_sha512() ) )
+	{
+		throw ssl_error("Unable to sign certificate");
+	}
+
+	return ssl_out( cert.get(), format, PEM_write_bio_X509, i2d_X509 );
+}
+
+} // Namespace X509Helper
+} // Namespace OPI
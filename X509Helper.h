@@ -0,0 +1,41 @@
+#ifndef X509HELPER_H
+#define X509HELPER_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace OPI {
+
+/*
+ *
+ * Certificate requests and self signed certificates using OpenSSL
+ *
+ * Internal to CryptoHelper. Kept free of Crypto++ since both define
+ * RSA and SHA256 in the global namespace.
+ *
+ * Keys are RSA private keys, PKCS#1 or PKCS#8, subjects are
+ * O=company, CN=cn. All functions throw runtime_error on failure.
+ *
+ */
+
+namespace X509Helper {
+
+enum Format
+{
+	PEM,
+	DER
+};
+
+vector<unsigned char> MakeCSR(const unsigned char* key, size_t keylen, Format keyformat,
+		const string& cn, const string& company, Format format);
+
+vector<unsigned char> MakeSelfSignedCert(const unsigned char* key, size_t keylen, Format keyformat,
+		const string& cn, const string& company, unsigned int days, Format format);
+
+} // Namespace X509Helper
+} // Namespace OPI
+
+#endif // X509HELPER_H
@@ -0,0 +1,236 @@
+/*
+ * Throughput of the CryptoHelper primitives
+ *
+ * Usage: cryptobench [MiB]
+ */
+
+#include "Base64.h"
+#include "CryptoHelper.h"
+#include "SysInfo.h"
+
+#include <crypto++/base64.h>
+#include <crypto++/filters.h>
+
+#include <libutils/Logger.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <vector>
+
+using namespace OPI;
+using namespace OPI::CryptoHelper;
+using namespace std::chrono;
+
+// Run op until at least bytes have been processed, print MB/s
+static void Report(const char* name, size_t bytes, size_t chunk, const function<void()>& op)
+{
+	size_t done = 0;
+
+	auto start = steady_clock::now();
+	while( done < bytes )
+	{
+		op();
+		done += chunk;
+	}
+	double total = duration<double>( steady_clock::now() - start ).count();
+
+	printf( "%-28s %10.1f MB/s\n", name, done / total / 1e6 );
+}
+
+static void BenchAEAD(AEADWrapper::Algorithm alg, size_t bytes, size_t chunk)
+{
+	if( ! AEADWrapper::HasAlgorithm( alg ) )
+	{
+		printf( "%-28s not available\n", AEADWrapper::AlgorithmName( alg ).c_str() );
+		return;
+	}
+
+	AEADWrapper aead( PBKDF2( "bench", AEADWrapper::KeySize ), alg );
+	vector<byte> in( chunk, 0x5a ), out, back;
+
+	string name = AEADWrapper::AlgorithmName( alg );
+
+	Report( ( name + " encrypt" ).c_str(), bytes, chunk, [&]()
+	{
+		aead.Encrypt( in, out );
+	});
+
+	Report( ( name + " decrypt" ).c_str(), bytes, chunk, [&]()
+	{
+		aead.Decrypt( out, back );
+	});
+}
+
+static void BenchCBC(size_t bytes, size_t chunk)
+{
+	AESStream enc( PBKDF2( "bench", 32 ), AESStream::Encrypt );
+	AESStream dec( PBKDF2( "bench", 32 ), AESStream::Decrypt );
+	vector<byte> in( chunk, 0x5a ), out( chunk + AES::BLOCKSIZE ), back( chunk + AES::BLOCKSIZE );
+
+	Report( "aes-cbc encrypt", bytes, chunk, [&]()
+	{
+		enc.Update( in.data(), in.size(), out.data() );
+	});
+
+	enc.Final( out.data() );
+
+	Report( "aes-cbc decrypt", bytes, chunk, [&]()
+	{
+		dec.Update( out.data(), chunk, back.data() );
+	});
+}
+
+// Compare the Base64 codec with the Crypto++ filter pipeline it replaced
+static void BenchBase64(size_t bytes, size_t chunk)
+{
+	vector<byte> in( chunk );
+	for( size_t i = 0; i < chunk; i++ )
+	{
+		in[i] = i * 7;
+	}
+	string enc = Base64Encode( in ), tmp;
+	vector<byte> dec;
+
+	Report( "base64 crypto++ encode", bytes, chunk, [&]()
+	{
+		tmp.clear();
+		ArraySource( in.data(), in.size(), true, new Base64Encoder( new StringSink( tmp ), false ) );
+	});
+
+	Report( "base64 crypto++ decode", bytes, chunk, [&]()
+	{
+		tmp.clear();
+		StringSource( enc, true, new Base64Decoder( new StringSink( tmp ) ) );
+	});
+
+	for( bool scalar: { true, false } )
+	{
+		Base64::ForceScalar( scalar );
+		string name = "base64 " + Base64::Backend();
+
+		Report( ( name + " encode" ).c_str(), bytes, chunk, [&]()
+		{
+			Base64Encode( ByteView( in ), tmp );
+		});
+
+		Report( ( name + " decode" ).c_str(), bytes, chunk, [&]()
+		{
+			Base64Decode( ByteView( enc ), dec, Base64::Strict );
+		});
+	}
+}
+
+// Derivation time per iteration count on this board, for tuning iterations per SysType
+static void BenchKDF()
+{
+	printf( "PBKDF2-HMAC-SHA512 on %s\n", sysinfo.SysTypeText[sysinfo.Type()].c_str() );
+
+	double persec = 0;
+	for( unsigned int iter: { 1000, 5000, 20000, 100000 } )
+	{
+		size_t runs = 0;
+		double total = 0;
+
+		auto start = steady_clock::now();
+		while( runs < 3 || total < 0.5 )
+		{
+			PBKDF2( "bench", 32, defaultsalt, iter );
+			runs++;
+			total = duration<double>( steady_clock::now() - start ).count();
+		}
+
+		double ms = total * 1000 / runs;
+		persec = iter / ( total / runs );
+		printf( "%-28s %10.1f ms\n", ( "pbkdf2 " + to_string( iter ) + " iter" ).c_str(), ms );
+	}
+
+	for( unsigned int target: { 100, 250, 500 } )
+	{
+		printf( "%-28s %10.0f iter\n", ( "pbkdf2 for " + to_string( target ) + " ms" ).c_str(), persec * target / 1000 );
+	}
+
+	KDFCache::Clear();
+	KDFCache::PBKDF2( "bench", 32 );
+
+	size_t count = 100000;
+	auto start = steady_clock::now();
+	for( size_t i = 0; i < count; i++ )
+	{
+		KDFCache::PBKDF2( "bench", 32 );
+	}
+	double total = duration<double>( steady_clock::now() - start ).count();
+	printf( "%-28s %10.1f us\n\n", "pbkdf2 cached", total * 1e6 / count );
+	KDFCache::Clear();
+}
+
+// Operations per second, one by one versus batched over all cpus
+static void BenchRSA(size_t count)
+{
+	RSAWrapper rsa;
+	rsa.GenerateKeys( 3072 );
+
+	vector<string> msgs;
+	for( size_t i = 0; i < count; i++ )
+	{
+		msgs.push_back( "challenge " + to_string( i ) );
+	}
+	vector<vector<byte>> sigs;
+
+	auto ops = [count](const char* name, const function<void()>& op)
+	{
+		auto start = steady_clock::now();
+		op();
+		double total = duration<double>( steady_clock::now() - start ).count();
+		printf( "%-28s %10.0f ops/s\n", name, count / total );
+	};
+
+	ops( "rsa3072 sign", [&]()
+	{
+		for( const auto& m: msgs )
+		{
+			sigs.push_back( rsa.SignMessage( m ) );
+		}
+	});
+
+	ops( "rsa3072 sign batch", [&]()
+	{
+		sigs = rsa.SignBatch( msgs );
+	});
+
+	ops( "rsa3072 verify", [&]()
+	{
+		for( size_t i = 0; i < count; i++ )
+		{
+			rsa.VerifyMessage( msgs[i], sigs[i] );
+		}
+	});
+
+	ops( "rsa3072 verify batch", [&]()
+	{
+		rsa.VerifyBatch( msgs, sigs );
+	});
+}
+
+int main(int argc, char** argv)
+{
+	size_t mib = argc > 1 ? atoi( argv[1] ) : 64;
+	size_t bytes = mib * 1024 * 1024;
+	const size_t chunk = 64 * 1024;
+
+	Utils::logg.SetLevel(Utils::Logger::Error);
+
+	printf( "Hardware AES: %s, preferred AEAD: %s\n\n",
+			AEADWrapper::HasHardwareAES() ? "yes" : "no",
+			AEADWrapper::AlgorithmName( AEADWrapper::Preferred() ).c_str() );
+
+	BenchCBC( bytes, chunk );
+	BenchAEAD( AEADWrapper::AESGCM, bytes, chunk );
+	BenchAEAD( AEADWrapper::ChaChaPoly, bytes, chunk );
+	BenchBase64( bytes, chunk );
+	BenchKDF();
+	BenchRSA( 200 );
+
+	return 0;
+}
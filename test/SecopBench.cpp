@@ -0,0 +1,102 @@
+/*
+ * Latency and throughput of the Secop client against the mock server
+ *
+ * Usage: secopbench [calls]
+ */
+
+#include "Secop.h"
+#include "SecopMockServer.h"
+
+#include <libutils/Logger.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <vector>
+
+#define BENCHSOCK "/tmp/bench-secop"
+
+using namespace OPI;
+using namespace std::chrono;
+
+// Run op rounds times, each round doing calls calls. Print rate and latency per round.
+static void Report(const char* name, int rounds, int calls, const function<void()>& op)
+{
+	vector<double> lat;
+
+	auto start = steady_clock::now();
+	for( int i = 0; i < rounds; i++ )
+	{
+		auto t = steady_clock::now();
+		op();
+		lat.push_back( duration<double, micro>( steady_clock::now() - t ).count() );
+	}
+	double total = duration<double>( steady_clock::now() - start ).count();
+
+	if( lat.empty() || total <= 0 )
+	{
+		printf( "%-12s no rounds run\n", name );
+		return;
+	}
+
+	sort( lat.begin(), lat.end() );
+
+	printf( "%-12s %10.0f calls/s  p50 %8.1f us  p99 %8.1f us  (per %d call%s)\n",
+			name, rounds * calls / total,
+			lat[ lat.size() / 2 ], lat[ lat.size() * 99 / 100 ],
+			calls, calls > 1 ? "s" : "" );
+}
+
+int main(int argc, char** argv)
+{
+	int calls = argc > 1 ? atoi( argv[1] ) : 10000;
+	const int burst = 100;
+
+	// At least one round of each kind
+	const int rounds = max( 1, calls / burst );
+	calls = max( 1, calls );
+
+	Utils::logg.SetLevel(Utils::Logger::Error);
+
+	SecopMockServer server( BENCHSOCK );
+	server.Start();
+
+	Secop s( BENCHSOCK );
+	s.CreateUser( "user", "secret" );
+	s.AddService( "user", "mail" );
+
+	Report( "single", calls, 1, [&s]()
+	{
+		s.HasACL( "user", "mail", "admin" );
+	});
+
+	Report( "pipelined", rounds, burst, [&s, burst]()
+	{
+		for( int i = 0; i < burst; i++ )
+		{
+			json cmd;
+			cmd["cmd"]			= "hasacl";
+			cmd["username"]		= "user";
+			cmd["servicename"]	= "mail";
+			cmd["acl"]			= "admin";
+			s.Post( cmd, nullptr );
+		}
+		s.WaitAll();
+	});
+
+	Report( "batched", rounds, burst, [&s, burst]()
+	{
+		Secop::Batch b;
+		for( int i = 0; i < burst; i++ )
+		{
+			b.AddACL( "user", "mail", "acl" + to_string(i) );
+		}
+		s.Run( b );
+	});
+
+	server.Stop();
+
+	return 0;
+}
@@ -0,0 +1,465 @@
+#include "SecopMockServer.h"
+
+#include <cstring>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static json Reply(int value = 0, const string& desc = "OK")
+{
+	json rep;
+
+	rep["status"]["value"] = value;
+	rep["status"]["desc"] = desc;
+
+	return rep;
+}
+
+static map<string,string> Identifier(const json& cmd)
+{
+	map<string,string> id;
+
+	if( cmd.contains("identifier") )
+	{
+		for( const auto& item: cmd["identifier"].items() )
+		{
+			id[item.key()] = item.value();
+		}
+	}
+
+	return id;
+}
+
+SecopMockServer::SecopMockServer(const string &path): path(path), lfd(-1), running(false), handled(0)
+{
+
+}
+
+void SecopMockServer::Start()
+{
+	struct sockaddr_un addr = {};
+
+	addr.sun_family = AF_UNIX;
+	strncpy( addr.sun_path, this->path.c_str(), sizeof(addr.sun_path) - 1 );
+
+	unlink( this->path.c_str() );
+
+	if( ( this->lfd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 ) ) < 0 ||
+		bind( this->lfd, reinterpret_cast<struct sockaddr*>( &addr ), sizeof(addr) ) < 0 ||
+		listen( this->lfd, 64 ) < 0 )
+	{
+		throw runtime_error("Failed to set up mock secop socket");
+	}
+
+	this->running = true;
+	this->acceptor = thread( &SecopMockServer::Run, this );
+}
+
+void SecopMockServer::Stop()
+{
+	if( ! this->running )
+	{
+		return;
+	}
+
+	this->running = false;
+	this->acceptor.join();
+
+	{
+		lock_guard<mutex> l( this->conlock );
+		for( int fd: this->fds )
+		{
+			shutdown( fd, SHUT_RDWR );
+		}
+	}
+
+	for( auto& t: this->connections )
+	{
+		t.join();
+	}
+	this->connections.clear();
+	this->fds.clear();
+
+	close( this->lfd );
+	unlink( this->path.c_str() );
+}
+
+size_t SecopMockServer::Handled()
+{
+	return this->handled;
+}
+
+SecopMockServer::~SecopMockServer()
+{
+	this->Stop();
+}
+
+void SecopMockServer::Run()
+{
+	while( this->running )
+	{
+		struct pollfd pfd = { this->lfd, POLLIN, 0 };
+
+		if( poll( &pfd, 1, 50 ) <= 0 )
+		{
+			continue;
+		}
+
+		int fd = accept4( this->lfd, nullptr, nullptr, SOCK_CLOEXEC );
+		if( fd < 0 )
+		{
+			continue;
+		}
+
+		lock_guard<mutex> l( this->conlock );
+		this->fds.push_back( fd );
+		this->connections.emplace_back( &SecopMockServer::Serve, this, fd );
+	}
+}
+
+void SecopMockServer::Serve(int fd)
+{
+	string buf;
+	char rd[16384];
+	ssize_t len;
+	size_t scan = 0;
+	int depth = 0;
+	bool instring = false, escape = false;
+
+	while( ( len = read( fd, rd, sizeof(rd) ) ) > 0 )
+	{
+		buf.append( rd, len );
+
+		string out;
+		for( ; scan < buf.size(); scan++ )
+		{
+			char c = buf[scan];
+
+			if( instring )
+			{
+				if( escape )
+				{
+					escape = false;
+				}
+				else if( c == '\\' )
+				{
+					escape = true;
+				}
+				else if( c == '"' )
+				{
+					instring = false;
+				}
+				continue;
+			}
+
+			if( c == '"' )
+			{
+				instring = true;
+			}
+			else if( c == '{' )
+			{
+				depth++;
+			}
+			else if( c == '}' && --depth == 0 )
+			{
+				json rep;
+				try
+				{
+					json cmd = json::parse( buf.begin(), buf.begin() + scan + 1 );
+					rep = this->Handle( cmd );
+					if( cmd.contains("tid") )
+					{
+						rep["tid"] = cmd["tid"];
+					}
+				}
+				catch( json::exception& )
+				{
+					rep = Reply( 1, "Malformed request" );
+				}
+				out += rep.dump();
+
+				buf.erase( 0, scan + 1 );
+				scan = static_cast<size_t>(-1);
+			}
+		}
+
+		for( size_t written = 0; written < out.size(); )
+		{
+			ssize_t wr = write( fd, out.data() + written, out.size() - written );
+			if( wr <= 0 )
+			{
+				break;
+			}
+			written += wr;
+		}
+	}
+
+	close( fd );
+}
+
+json SecopMockServer::Handle(const json &cmd)
+{
+	lock_guard<mutex> l( this->dblock );
+
+	this->handled++;
+
+	const string op = cmd.value("cmd", "");
+	const string user = cmd.value("username", "");
+	const string service = cmd.value("servicename", "");
+	const string group = cmd.value("group", "");
+	const string appid = cmd.value("appid", "");
+
+	json rep = Reply();
+
+	bool needuser = op != "createuser" && op != "getusers" && cmd.contains("username");
+	if( needuser && this->users.find( user ) == this->users.end() )
+	{
+		return Reply( 1, "User not found" );
+	}
+
+	if( op == "init" || op == "auth" )
+	{
+	}
+	else if( op == "status" )
+	{
+		rep["server"]["state"] = 4;
+	}
+	else if( op == "createuser" )
+	{
+		if( this->users.find( user ) != this->users.end() )
+		{
+			return Reply( 1, "User exists" );
+		}
+		this->users[user].password = cmd.value("password", "");
+		this->users[user].displayname = cmd.value("displayname", "");
+	}
+	else if( op == "updateuserpassword" )
+	{
+		this->users[user].password = cmd.value("password", "");
+	}
+	else if( op == "removeuser" )
+	{
+		this->users.erase( user );
+		for( auto& g: this->groups )
+		{
+			g.second.erase( user );
+		}
+	}
+	else if( op == "getusers" )
+	{
+		rep["users"] = json::array();
+		for( const auto& u: this->users )
+		{
+			rep["users"].push_back( u.first );
+		}
+	}
+	else if( op == "getusergroups" )
+	{
+		rep["groups"] = json::array();
+		for( const auto& g: this->groups )
+		{
+			if( g.second.count( user ) )
+			{
+				rep["groups"].push_back( g.first );
+			}
+		}
+	}
+	else if( op == "addattribute" )
+	{
+		if( ! cmd.contains("value") )
+		{
+			return Reply( 1, "Missing value" );
+		}
+		this->users[user].attributes[cmd["attribute"]] = cmd["value"];
+	}
+	else if( op == "removeattribute" )
+	{
+		this->users[user].attributes.erase( cmd.value("attribute", "") );
+	}
+	else if( op == "getattributes" )
+	{
+		rep["attributes"] = json::array();
+		for( const auto& a: this->users[user].attributes )
+		{
+			rep["attributes"].push_back( a.first );
+		}
+	}
+	else if( op == "getattribute" )
+	{
+		auto& attrs = this->users[user].attributes;
+		auto it = attrs.find( cmd.value("attribute", "") );
+		if( it == attrs.end() )
+		{
+			return Reply( 1, "Attribute not found" );
+		}
+		rep["attribute"] = it->second;
+	}
+	else if( op == "getservices" )
+	{
+		rep["services"] = json::array();
+		for( const auto& s: this->users[user].services )
+		{
+			rep["services"].push_back( s.first );
+		}
+	}
+	else if( op == "addservice" )
+	{
+		this->users[user].services[service];
+	}
+	else if( op == "removeservice" )
+	{
+		this->users[user].services.erase( service );
+	}
+	else if( op == "getacl" || op == "addacl" || op == "removeacl" || op == "hasacl" )
+	{
+		auto& services = this->users[user].services;
+		auto it = services.find( service );
+		if( it == services.end() )
+		{
+			return Reply( 1, "Service not found" );
+		}
+
+		const string acl = cmd.value("acl", "");
+		if( op == "getacl" )
+		{
+			rep["acl"] = json::array();
+			for( const auto& a: it->second )
+			{
+				rep["acl"].push_back( a );
+			}
+		}
+		else if( op == "addacl" )
+		{
+			it->second.insert( acl );
+		}
+		else if( op == "removeacl" )
+		{
+			it->second.erase( acl );
+		}
+		else
+		{
+			rep["hasacl"] = it->second.count( acl ) > 0;
+		}
+	}
+	else if( op == "addidentifier" )
+	{
+		this->users[user].identifiers.push_back( Identifier( cmd ) );
+	}
+	else if( op == "removeidentifier" )
+	{
+		this->users[user].identifiers.remove( Identifier( cmd ) );
+	}
+	else if( op == "getidentifiers" )
+	{
+		rep["identifiers"] = json::array();
+		for( const auto& id: this->users[user].identifiers )
+		{
+			rep["identifiers"].push_back( id );
+		}
+	}
+	else if( op == "groupadd" )
+	{
+		this->groups[group];
+	}
+	else if( op == "groupaddmember" || op == "groupremovemember" || op == "groupgetmembers" || op == "groupremove" )
+	{
+		auto it = this->groups.find( group );
+		if( it == this->groups.end() )
+		{
+			return Reply( 1, "Group not found" );
+		}
+
+		if( op == "groupaddmember" )
+		{
+			it->second.insert( cmd.value("member", "") );
+		}
+		else if( op == "groupremovemember" )
+		{
+			it->second.erase( cmd.value("member", "") );
+		}
+		else if( op == "groupgetmembers" )
+		{
+			rep["members"] = json::array();
+			for( const auto& m: it->second )
+			{
+				rep["members"].push_back( m );
+			}
+		}
+		else
+		{
+			this->groups.erase( it );
+		}
+	}
+	else if( op == "groupsget" )
+	{
+		rep["groups"] = json::array();
+		for( const auto& g: this->groups )
+		{
+			rep["groups"].push_back( g.first );
+		}
+	}
+	else if( op == "createappid" )
+	{
+		this->apps[appid];
+	}
+	else if( op == "getappids" )
+	{
+		rep["appids"] = json::array();
+		for( const auto& a: this->apps )
+		{
+			rep["appids"].push_back( a.first );
+		}
+	}
+	else if( op == "removeappid" )
+	{
+		this->apps.erase( appid );
+	}
+	else if( this->apps.find( appid ) == this->apps.end() )
+	{
+		return Reply( 1, "Unknown command or appid" );
+	}
+	else if( op == "addappidentifier" )
+	{
+		this->apps[appid].identifiers.push_back( Identifier( cmd ) );
+	}
+	else if( op == "getappidentifiers" )
+	{
+		rep["identifiers"] = json::array();
+		for( const auto& id: this->apps[appid].identifiers )
+		{
+			rep["identifiers"].push_back( id );
+		}
+	}
+	else if( op == "appremoveidentifier" )
+	{
+		this->apps[appid].identifiers.remove( Identifier( cmd ) );
+	}
+	else if( op == "addappacl" )
+	{
+		this->apps[appid].acl.insert( cmd.value("acl", "") );
+	}
+	else if( op == "getappacl" )
+	{
+		rep["acl"] = json::array();
+		for( const auto& a: this->apps[appid].acl )
+		{
+			rep["acl"].push_back( a );
+		}
+	}
+	else if( op == "removeappacl" )
+	{
+		this->apps[appid].acl.erase( cmd.value("acl", "") );
+	}
+	else if( op == "hasappacl" )
+	{
+		rep["hasacl"] = this->apps[appid].acl.count( cmd.value("acl", "") ) > 0;
+	}
+	else
+	{
+		return Reply( 1, "Unknown command" );
+	}
+
+	return rep;
+}
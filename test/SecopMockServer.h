@@ -0,0 +1,71 @@
+#ifndef SECOPMOCKSERVER_H
+#define SECOPMOCKSERVER_H
+
+#include <nlohmann/json.hpp>
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+using namespace std;
+using json = nlohmann::json;
+
+/*
+ * In process stand in for the secop daemon, used by tests and benchmarks.
+ *
+ * Listens on a unix socket and answers the commands used by OPI::Secop
+ * from an in memory database. Commands sent back to back on a connection
+ * are answered in order, replies carry the tid of the request.
+ */
+class SecopMockServer
+{
+public:
+	SecopMockServer(const string& path);
+
+	void Start();
+	void Stop();
+
+	// Number of commands handled
+	size_t Handled();
+
+	virtual ~SecopMockServer();
+private:
+	struct User
+	{
+		string password;
+		string displayname;
+		map<string, string> attributes;
+		map<string, set<string>> services;	// Service -> acl
+		list<map<string, string>> identifiers;
+	};
+
+	struct App
+	{
+		set<string> acl;
+		list<map<string, string>> identifiers;
+	};
+
+	void Run();
+	void Serve(int fd);
+	json Handle(const json& cmd);
+
+	string path;
+	int lfd;
+	atomic<bool> running;
+	atomic<size_t> handled;
+	thread acceptor;
+	mutex conlock;
+	list<thread> connections;
+	list<int> fds;
+
+	mutex dblock;
+	map<string, User> users;
+	map<string, set<string>> groups;
+	map<string, App> apps;
+};
+
+#endif // SECOPMOCKSERVER_H
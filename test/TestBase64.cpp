@@ -0,0 +1,124 @@
+#include "TestBase64.h"
+
+#include "Base64.h"
+
+#include <stdexcept>
+#include <vector>
+
+CPPUNIT_TEST_SUITE_REGISTRATION ( TestBase64 );
+
+using namespace OPI;
+
+static string encode(const string& s)
+{
+	string out( Base64::EncodedLength( s.size() ), 0 );
+	out.resize( Base64::Encode( (const uint8_t*) s.data(), s.size(), &out[0] ) );
+	return out;
+}
+
+static string decode(const string& s, Base64::Mode mode = Base64::Strict)
+{
+	string out( Base64::DecodedMaxLength( s.size() ), 0 );
+	out.resize( Base64::Decode( s.data(), s.size(), (uint8_t*) &out[0], mode ) );
+	return out;
+}
+
+void TestBase64::setUp()
+{
+}
+
+void TestBase64::tearDown()
+{
+	Base64::ForceScalar( false );
+}
+
+void TestBase64::TestVectors()
+{
+	// RFC 4648
+	const vector<pair<string,string>> vectors = {
+		{ "", "" },
+		{ "f", "Zg==" },
+		{ "fo", "Zm8=" },
+		{ "foo", "Zm9v" },
+		{ "foob", "Zm9vYg==" },
+		{ "fooba", "Zm9vYmE=" },
+		{ "foobar", "Zm9vYmFy" },
+	};
+
+	for( const auto& v: vectors )
+	{
+		CPPUNIT_ASSERT_EQUAL( v.second, encode( v.first ) );
+		CPPUNIT_ASSERT_EQUAL( v.first, decode( v.second ) );
+		CPPUNIT_ASSERT_EQUAL( v.first, decode( v.second, Base64::Lenient ) );
+	}
+
+	CPPUNIT_ASSERT_EQUAL( string("+/+/"), encode( "\xfb\xff\xbf" ) );
+}
+
+void TestBase64::TestStrict()
+{
+	CPPUNIT_ASSERT_THROW( decode( "Zm9" ), std::runtime_error );
+	CPPUNIT_ASSERT_THROW( decode( "Zm9v\nYmFy" ), std::runtime_error );
+	CPPUNIT_ASSERT_THROW( decode( "Zm9v YmFy" ), std::runtime_error );
+	CPPUNIT_ASSERT_THROW( decode( "Zm=vYmFy" ), std::runtime_error );
+	CPPUNIT_ASSERT_THROW( decode( "Zm9vYm-y" ), std::runtime_error );
+	CPPUNIT_ASSERT_THROW( decode( "====" ), std::runtime_error );
+
+	// Non canonical, unused bits set
+	CPPUNIT_ASSERT_THROW( decode( "Zh==" ), std::runtime_error );
+	CPPUNIT_ASSERT_THROW( decode( "Zm9=" ), std::runtime_error );
+
+	// Invalid character deep into a long input
+	string s = encode( string( 300, 'x' ) );
+	s[ 250 ] = '!';
+	CPPUNIT_ASSERT_THROW( decode( s ), std::runtime_error );
+}
+
+void TestBase64::TestLenient()
+{
+	CPPUNIT_ASSERT_EQUAL( string("foobar"), decode( "Zm9v\nYmFy\n", Base64::Lenient ) );
+	CPPUNIT_ASSERT_EQUAL( string("foobar"), decode( " Zm 9v\r\nYm Fy", Base64::Lenient ) );
+	CPPUNIT_ASSERT_EQUAL( string("fo"), decode( "Zm8", Base64::Lenient ) );
+	CPPUNIT_ASSERT_EQUAL( string("f"), decode( "Zg==garbage", Base64::Lenient ) );
+
+	// PEM style line breaks
+	string data;
+	for( int i = 0; i < 1000; i++ )
+	{
+		data += (char) ( i * 13 );
+	}
+	string enc = encode( data ), pem;
+	for( size_t i = 0; i < enc.size(); i += 64 )
+	{
+		pem += enc.substr( i, 64 ) + "\n";
+	}
+
+	CPPUNIT_ASSERT( decode( pem, Base64::Lenient ) == data );
+}
+
+void TestBase64::TestBackends()
+{
+	string data;
+	for( int i = 0; i < 5000; i++ )
+	{
+		data += (char) ( i * 7 + ( i >> 3 ) );
+	}
+
+	// Vector and scalar versions must agree on every length
+	for( size_t len = 0; len < 200; len++ )
+	{
+		string in = data.substr( len * 17, len );
+
+		Base64::ForceScalar( false );
+		string simd = encode( in );
+		Base64::ForceScalar( true );
+		string scalar = encode( in );
+
+		CPPUNIT_ASSERT_EQUAL( scalar, simd );
+		CPPUNIT_ASSERT( decode( simd ) == in );
+		Base64::ForceScalar( false );
+		CPPUNIT_ASSERT( decode( simd ) == in );
+	}
+
+	CPPUNIT_ASSERT( decode( encode( data ) ) == data );
+}
@@ -0,0 +1,23 @@
+#ifndef TESTBASE64_H_
+#define TESTBASE64_H_
+
+#include <cppunit/extensions/HelperMacros.h>
+
+class TestBase64: public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE( TestBase64 );
+	CPPUNIT_TEST( TestVectors );
+	CPPUNIT_TEST( TestStrict );
+	CPPUNIT_TEST( TestLenient );
+	CPPUNIT_TEST( TestBackends );
+	CPPUNIT_TEST_SUITE_END();
+public:
+	void setUp();
+	void tearDown();
+	void TestVectors();
+	void TestStrict();
+	void TestLenient();
+	void TestBackends();
+};
+
+#endif /* TESTBASE64_H_ */
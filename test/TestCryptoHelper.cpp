@@ -1,6 +1,8 @@
 #include "TestCryptoHelper.h"
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <sstream>
 #include "CryptoHelper.h"
 #include <libutils/FileUtils.h>
 #include <libutils/Process.h>
@@ -47,3 +49,417 @@ void TestCryptoHelper::TestSelfSigned()
 	unlink("testpub.pem");
 	unlink("testcert.pem");
 }
+
+void TestCryptoHelper::TestInMemoryCert()
+{
+	CryptoHelper::RSAWrapper rsa;
+	rsa.GenerateKeys( 2048 );
+
+	File::Write("testpriv.pem", rsa.PrivKeyAsPEM(),0600);
+
+	string cert = CryptoHelper::MakeSelfSignedCertAsPEM( rsa, "localhost", "OpenProducts", 30 );
+	CPPUNIT_ASSERT( cert.find("-----BEGIN CERTIFICATE-----") == 0 );
+	File::Write("testcert.pem", cert, 0600);
+
+	bool ret;
+	string cert_mod, key_mod, subject;
+	tie(ret, cert_mod) = Process::Exec("openssl x509 -noout -modulus -in testcert.pem");
+	CPPUNIT_ASSERT(ret);
+	tie(ret, key_mod) = Process::Exec("openssl rsa -noout -modulus -in testpriv.pem");
+	CPPUNIT_ASSERT(ret);
+	CPPUNIT_ASSERT( key_mod == cert_mod );
+
+	tie(ret, ignore) = Process::Exec("openssl verify -CAfile testcert.pem testcert.pem");
+	CPPUNIT_ASSERT(ret);
+
+	// DER is the same certificate type, only encoded differently
+	vector<byte> der = CryptoHelper::MakeSelfSignedCertAsDER( rsa, "localhost", "OpenProducts" );
+	CPPUNIT_ASSERT( der.size() > 0 && der[0] == 0x30 );
+
+	string csr = CryptoHelper::MakeCSRAsPEM( rsa, "localhost", "OpenProducts" );
+	CPPUNIT_ASSERT( csr.find("-----BEGIN CERTIFICATE REQUEST-----") == 0 );
+	File::Write("testcsr.pem", csr, 0600);
+
+	tie(ret, subject) = Process::Exec("openssl req -in testcsr.pem -noout -verify -subject");
+	CPPUNIT_ASSERT(ret);
+	CPPUNIT_ASSERT( subject.find("CN = localhost") != string::npos || subject.find("CN=localhost") != string::npos );
+
+	der = CryptoHelper::MakeCSRAsDER( rsa, "localhost", "OpenProducts" );
+	CPPUNIT_ASSERT( der.size() > 0 && der[0] == 0x30 );
+
+	// File based version on the same key
+	CPPUNIT_ASSERT( CryptoHelper::MakeCSR( "testpriv.pem", "testcsr.pem", "localhost", "OpenProducts" ) );
+	tie(ret, ignore) = Process::Exec("openssl req -in testcsr.pem -noout -verify");
+	CPPUNIT_ASSERT(ret);
+
+	CPPUNIT_ASSERT( ! CryptoHelper::MakeCSR( "nonexistent.pem", "testcsr.pem", "localhost", "OpenProducts" ) );
+
+	unlink("testpriv.pem");
+	unlink("testcert.pem");
+	unlink("testcsr.pem");
+}
+
+void TestCryptoHelper::TestAESStream()
+{
+	CryptoHelper::SecVector<byte> key = CryptoHelper::PBKDF2( "secret", 32 );
+	CryptoHelper::AESWrapper aes( key );
+
+	string plain;
+	for( int i = 0; i < 200000; i++ )
+	{
+		plain += (char) ( i * 7 );
+	}
+
+	// Incremental output must match the one shot version
+	string ref = aes.Encrypt( plain );
+
+	CryptoHelper::AESStream enc( aes, CryptoHelper::AESStream::Encrypt );
+	vector<byte> out( 1000 + AES::BLOCKSIZE );
+	string cipher;
+	for( size_t pos = 0; pos < plain.size(); pos += 1000 )
+	{
+		size_t len = min( (size_t) 1000, plain.size() - pos );
+		size_t wr = enc.Update( (const byte*) plain.data() + pos, len, &out[0] );
+		CPPUNIT_ASSERT( wr <= len + AES::BLOCKSIZE );
+		cipher.append( (const char*) &out[0], wr );
+	}
+	cipher.append( (const char*) &out[0], enc.Final( &out[0] ) );
+
+	CPPUNIT_ASSERT( cipher == ref );
+
+	// Odd sized chunks on decrypt
+	CryptoHelper::AESStream dec( aes, CryptoHelper::AESStream::Decrypt );
+	string res;
+	for( size_t pos = 0; pos < cipher.size(); pos += 333 )
+	{
+		size_t len = min( (size_t) 333, cipher.size() - pos );
+		res.append( (const char*) &out[0], dec.Update( (const byte*) cipher.data() + pos, len, &out[0] ) );
+	}
+	res.append( (const char*) &out[0], dec.Final( &out[0] ) );
+
+	CPPUNIT_ASSERT( res == plain );
+
+	// Truncated input
+	dec.Update( (const byte*) cipher.data(), 20, &out[0] );
+	CPPUNIT_ASSERT_THROW( dec.Final( &out[0] ), CryptoPP::InvalidCiphertext );
+
+	// Stream adapters
+	stringstream in( plain ), mid, back;
+	aes.Encrypt( in, mid );
+	CPPUNIT_ASSERT( mid.str() == ref );
+	aes.Decrypt( mid, back );
+	CPPUNIT_ASSERT( back.str() == plain );
+
+	// fd adapters
+	File::Write( "aesplain.txt", plain, 0600 );
+	int infd = open( "aesplain.txt", O_RDONLY );
+	int outfd = open( "aescipher.bin", O_WRONLY | O_CREAT | O_TRUNC, 0600 );
+	CPPUNIT_ASSERT( infd >= 0 && outfd >= 0 );
+	aes.Encrypt( infd, outfd );
+	close( infd );
+	close( outfd );
+
+	CPPUNIT_ASSERT( File::GetContentAsString( "aescipher.bin" ) == ref );
+
+	unlink( "aesplain.txt" );
+	unlink( "aescipher.bin" );
+}
+
+void TestCryptoHelper::TestAEAD()
+{
+	using CryptoHelper::AEADWrapper;
+
+	CryptoHelper::SecVector<byte> key = CryptoHelper::PBKDF2( "secret", AEADWrapper::KeySize );
+	CryptoHelper::SecVector<byte> badkey = CryptoHelper::PBKDF2( "wrong", AEADWrapper::KeySize );
+
+	CPPUNIT_ASSERT_THROW( AEADWrapper{ CryptoHelper::SecVector<byte>( 16 ) }, std::runtime_error );
+	CPPUNIT_ASSERT( AEADWrapper::HasAlgorithm( AEADWrapper::Preferred() ) );
+
+	for( auto alg: { AEADWrapper::AESGCM, AEADWrapper::ChaChaPoly } )
+	{
+		if( ! AEADWrapper::HasAlgorithm( alg ) )
+		{
+			continue;
+		}
+
+		AEADWrapper aead( key, alg );
+		CPPUNIT_ASSERT_EQUAL( alg, aead.GetAlgorithm() );
+
+		string plain = "Secret message to protect";
+		string c1 = aead.Encrypt( plain, "header" );
+		string c2 = aead.Encrypt( plain, "header" );
+
+		CPPUNIT_ASSERT_EQUAL( plain.size() + AEADWrapper::Overhead, c1.size() );
+		// Fresh nonce every message
+		CPPUNIT_ASSERT( c1 != c2 );
+
+		CPPUNIT_ASSERT_EQUAL( plain, aead.Decrypt( c1, "header" ) );
+		CPPUNIT_ASSERT_EQUAL( plain, aead.Decrypt( c2, "header" ) );
+
+		// Any instance with the same key opens it, whatever its own algorithm
+		AEADWrapper other( key );
+		CPPUNIT_ASSERT_EQUAL( plain, other.Decrypt( c1, "header" ) );
+
+		// Tampering, wrong header and wrong key are detected
+		string bad = c1;
+		bad[ bad.size() / 2 ] ^= 0x01;
+		CPPUNIT_ASSERT_THROW( aead.Decrypt( bad, "header" ), std::runtime_error );
+		CPPUNIT_ASSERT_THROW( aead.Decrypt( c1, "Header" ), std::runtime_error );
+		CPPUNIT_ASSERT_THROW( AEADWrapper( badkey, alg ).Decrypt( c1, "header" ), std::runtime_error );
+		CPPUNIT_ASSERT_THROW( aead.Decrypt( c1.substr( 0, 10 ) ), std::runtime_error );
+
+		vector<byte> in( 100000, 0x42 ), out, back;
+		aead.Encrypt( in, out );
+		aead.Decrypt( out, back );
+		CPPUNIT_ASSERT( in == back );
+
+		// Empty message
+		CPPUNIT_ASSERT_EQUAL( string(), aead.Decrypt( aead.Encrypt( "" ) ) );
+	}
+}
+
+void TestCryptoHelper::TestByteView()
+{
+	const string msg = "Message held in some other buffer";
+	const byte* raw = (const byte*) msg.data();
+
+	// Base64, reusing output buffers
+	string enc;
+	CryptoHelper::Base64Encode( CryptoHelper::ByteView( raw, msg.size() ), enc );
+	CPPUNIT_ASSERT_EQUAL( CryptoHelper::Base64Encode( msg ), enc );
+
+	CryptoHelper::SecVector<byte> dec;
+	CryptoHelper::Base64Decode( CryptoHelper::ByteView( enc ), dec );
+	CPPUNIT_ASSERT( string( dec.begin(), dec.end() ) == msg );
+
+	vector<byte> vdec;
+	CryptoHelper::Base64Decode( enc, vdec );
+	CPPUNIT_ASSERT( string( vdec.begin(), vdec.end() ) == msg );
+	CPPUNIT_ASSERT( CryptoHelper::Base64Decode( enc ) == vdec );
+
+	// Signatures
+	CryptoHelper::RSAWrapper rsa;
+	rsa.GenerateKeys( 1024 );
+
+	vector<byte> sig;
+	rsa.SignMessage( CryptoHelper::ByteView( raw, msg.size() ), sig );
+	CPPUNIT_ASSERT( rsa.VerifyMessage( msg, sig ) );
+	CPPUNIT_ASSERT( rsa.VerifyMessage( CryptoHelper::ByteView( raw, msg.size() ), sig ) );
+	CPPUNIT_ASSERT( ! rsa.VerifyMessage( CryptoHelper::ByteView( raw, msg.size() - 1 ), sig ) );
+
+	// AES into caller provided memory
+	CryptoHelper::AESWrapper aes( CryptoHelper::PBKDF2( "secret", 32 ) );
+
+	byte cipher[ 64 + AES::BLOCKSIZE ];
+	size_t clen = aes.Encrypt( CryptoHelper::ByteView( raw, msg.size() ), cipher );
+	CPPUNIT_ASSERT( string( (const char*) cipher, clen ) == aes.Encrypt( msg ) );
+
+	byte plain[ sizeof( cipher ) ];
+	size_t plen = aes.Decrypt( CryptoHelper::ByteView( cipher, clen ), plain );
+	CPPUNIT_ASSERT( string( (const char*) plain, plen ) == msg );
+
+	CryptoHelper::SecVector<byte> sc, sp;
+	aes.Encrypt( CryptoHelper::ByteView( msg ), sc );
+	aes.Decrypt( CryptoHelper::ByteView( sc ), sp );
+	CPPUNIT_ASSERT( string( sp.begin(), sp.end() ) == msg );
+
+	// Same exception as when Crypto++ did the unpadding
+	CPPUNIT_ASSERT_THROW( aes.Decrypt( CryptoHelper::ByteView( cipher, clen - 1 ), plain ), CryptoPP::InvalidCiphertext );
+
+	// Flip bits of last byte of padding through previous block
+	string bad = aes.Encrypt( msg );
+	bad[ bad.size() - 1 - AES::BLOCKSIZE ] ^= 0x55;
+	CPPUNIT_ASSERT_THROW( aes.Decrypt( bad ), CryptoPP::InvalidCiphertext );
+	CPPUNIT_ASSERT_THROW( aes.Decrypt( vector<byte>( bad.begin(), bad.end() ) ), CryptoPP::InvalidCiphertext );
+}
+
+void TestCryptoHelper::TestKeyCache()
+{
+	using CryptoHelper::RSAKeyCache;
+	using CryptoHelper::RSAWrapper;
+	using CryptoHelper::RSAWrapperPtr;
+
+	RSAKeyCache::Clear();
+
+	RSAWrapper rsa;
+	rsa.GenerateKeys( 1024 );
+	File::Write( "cachepriv.pem", rsa.PrivKeyAsPEM(), 0600 );
+	File::Write( "cachepub.pem", rsa.PubKeyAsPEM(), 0600 );
+
+	// Same files, same instance
+	RSAWrapperPtr k1 = RSAKeyCache::FromPEMFiles( "cachepriv.pem", "cachepub.pem" );
+	RSAWrapperPtr k2 = RSAKeyCache::FromPEMFiles( "cachepriv.pem", "cachepub.pem" );
+	CPPUNIT_ASSERT( k1 );
+	CPPUNIT_ASSERT( k1 == k2 );
+	CPPUNIT_ASSERT( rsa.VerifyMessage( "hello", k1->SignMessage( "hello" ) ) );
+
+	// Changed key file is picked up
+	RSAWrapper rsa2;
+	rsa2.GenerateKeys( 1024 );
+	unlink( "cachepriv.pem" );
+	File::Write( "cachepriv.pem", rsa2.PrivKeyAsPEM(), 0600 );
+
+	RSAWrapperPtr k3 = RSAKeyCache::FromPEMFiles( "cachepriv.pem", "cachepub.pem" );
+	CPPUNIT_ASSERT( k3 != k1 );
+	CPPUNIT_ASSERT( rsa2.VerifyMessage( "hello", k3->SignMessage( "hello" ) ) );
+
+	// Generic interface, loader only called when fingerprint changes
+	int loads = 0;
+	auto loader = [&loads, &rsa]()
+	{
+		loads++;
+		RSAWrapperPtr k( new RSAWrapper );
+		k->LoadPrivKey( rsa.GetPrivKey() );
+		return k;
+	};
+
+	string fp = RSAKeyCache::Fingerprint( rsa.GetPrivKey() );
+	RSAKeyCache::Get( "test", fp, loader );
+	RSAKeyCache::Get( "test", fp, loader );
+	CPPUNIT_ASSERT_EQUAL( 1, loads );
+
+	RSAKeyCache::Get( "test", RSAKeyCache::Fingerprint( string( "other" ) ), loader );
+	CPPUNIT_ASSERT_EQUAL( 2, loads );
+
+	RSAKeyCache::Invalidate( "test" );
+	RSAKeyCache::Get( "test", fp, loader );
+	CPPUNIT_ASSERT_EQUAL( 3, loads );
+
+	CPPUNIT_ASSERT_EQUAL( (size_t) 2, RSAKeyCache::Size() );
+	RSAKeyCache::Clear();
+	CPPUNIT_ASSERT_EQUAL( (size_t) 0, RSAKeyCache::Size() );
+
+	CPPUNIT_ASSERT_THROW( RSAKeyCache::FromPEMFiles( "nonexistent.pem" ), std::runtime_error );
+
+	unlink( "cachepriv.pem" );
+	unlink( "cachepub.pem" );
+}
+
+void TestCryptoHelper::TestBatch()
+{
+	CryptoHelper::RSAWrapper rsa;
+	rsa.GenerateKeys( 1024 );
+
+	vector<string> msgs;
+	for( int i = 0; i < 50; i++ )
+	{
+		msgs.push_back( "challenge " + to_string( i ) );
+	}
+
+	vector<vector<byte>> sigs = rsa.SignBatch( msgs );
+	CPPUNIT_ASSERT_EQUAL( msgs.size(), sigs.size() );
+
+	// PKCS#1 v1.5 is deterministic, batch must match one by one signing
+	for( size_t i = 0; i < msgs.size(); i++ )
+	{
+		CPPUNIT_ASSERT( sigs[i] == rsa.SignMessage( msgs[i] ) );
+	}
+
+	vector<bool> res = rsa.VerifyBatch( msgs, sigs );
+	CPPUNIT_ASSERT_EQUAL( msgs.size(), res.size() );
+	for( bool ok: res )
+	{
+		CPPUNIT_ASSERT( ok );
+	}
+
+	// Broken entries are reported at their index
+	msgs[3] += "x";
+	sigs[17][5] ^= 0x01;
+	res = rsa.VerifyBatch( msgs, sigs );
+	for( size_t i = 0; i < res.size(); i++ )
+	{
+		CPPUNIT_ASSERT_EQUAL( i != 3 && i != 17, (bool) res[i] );
+	}
+
+	CPPUNIT_ASSERT( rsa.VerifyBatch( vector<string>(), vector<vector<byte>>() ).empty() );
+
+	sigs.pop_back();
+	CPPUNIT_ASSERT_THROW( rsa.VerifyBatch( msgs, sigs ), std::runtime_error );
+
+	CryptoHelper::RSAWrapper nokey;
+	CPPUNIT_ASSERT_THROW( nokey.SignBatch( msgs ), std::runtime_error );
+}
+
+void TestCryptoHelper::TestKeyGen()
+{
+	vector<double> steps;
+	CryptoHelper::RSAKeyGen gen( 1024, [&steps](double p){ steps.push_back( p ); } );
+
+	CryptoHelper::RSAWrapperPtr key = gen.Get();
+	CPPUNIT_ASSERT( gen.Ready() );
+	CPPUNIT_ASSERT( key->VerifyMessage( "Hello", key->SignMessage( "Hello" ) ) );
+
+	// Progress starts at 0, never goes backwards and ends at 1
+	CPPUNIT_ASSERT( steps.size() >= 2 );
+	CPPUNIT_ASSERT_EQUAL( 0.0, steps.front() );
+	CPPUNIT_ASSERT_EQUAL( 1.0, steps.back() );
+	for( size_t i = 1; i < steps.size(); i++ )
+	{
+		CPPUNIT_ASSERT( steps[i - 1] <= steps[i] );
+	}
+
+	// Cancelled before start, nothing should be generated
+	atomic<bool> cancel( true );
+	CryptoHelper::RSAWrapper rsa;
+	CPPUNIT_ASSERT_THROW( rsa.GenerateKeys( 1024, nullptr, &cancel ), std::runtime_error );
+
+	CryptoHelper::RSAKeyGen cancelled( 4096 );
+	cancelled.Cancel();
+	CPPUNIT_ASSERT_THROW( cancelled.Get(), std::runtime_error );
+
+	// Pool fills in the background and refills after a take
+	CryptoHelper::RSAKeyPool::Start( 1, 1024 );
+	for( int i = 0; i < 600 && CryptoHelper::RSAKeyPool::Available() == 0; i++ )
+	{
+		usleep( 100000 );
+	}
+	CPPUNIT_ASSERT_EQUAL( (size_t) 1, CryptoHelper::RSAKeyPool::Available() );
+
+	key = CryptoHelper::RSAKeyPool::Take( 1024 );
+	CPPUNIT_ASSERT( key->VerifyMessage( "Hello", key->SignMessage( "Hello" ) ) );
+	CryptoHelper::RSAKeyPool::Stop();
+
+	// Other sizes are generated on the spot
+	key = CryptoHelper::RSAKeyPool::Take( 1024 + 64 );
+	CPPUNIT_ASSERT( key->VerifyMessage( "Hello", key->SignMessage( "Hello" ) ) );
+}
+
+void TestCryptoHelper::TestKDFCache()
+{
+	using CryptoHelper::KDFCache;
+
+	KDFCache::Clear();
+	CPPUNIT_ASSERT_EQUAL( (size_t) 0, KDFCache::Size() );
+
+	vector<byte> salt( 16, 0x42 );
+	CPPUNIT_ASSERT( KDFCache::PBKDF2( "secret", 32 ) == CryptoHelper::PBKDF2( "secret", 32 ) );
+	CPPUNIT_ASSERT( KDFCache::PBKDF2( "secret", 32 ) == CryptoHelper::PBKDF2( "secret", 32 ) );
+	CPPUNIT_ASSERT_EQUAL( (size_t) 1, KDFCache::Size() );
+
+	// Every parameter is part of the cache key
+	CPPUNIT_ASSERT( KDFCache::PBKDF2( "secret", 32, salt ) == CryptoHelper::PBKDF2( "secret", 32, salt ) );
+	CPPUNIT_ASSERT( KDFCache::PBKDF2( "secret", 16 ) == CryptoHelper::PBKDF2( "secret", 16 ) );
+	CPPUNIT_ASSERT( KDFCache::PBKDF2( "secret", 32, salt, 1000 ) == CryptoHelper::PBKDF2( "secret", 32, salt, 1000 ) );
+	CPPUNIT_ASSERT( KDFCache::PBKDF2( "Secret", 32 ) == CryptoHelper::PBKDF2( "Secret", 32 ) );
+	CPPUNIT_ASSERT_EQUAL( (size_t) 5, KDFCache::Size() );
+
+	KDFCache::SetMaxEntries( 2 );
+	CPPUNIT_ASSERT_EQUAL( (size_t) 2, KDFCache::Size() );
+	KDFCache::PBKDF2( "other", 32 );
+	CPPUNIT_ASSERT_EQUAL( (size_t) 2, KDFCache::Size() );
+
+	// Keys are dropped when their lifetime has passed
+	KDFCache::SetLifetime( 1 );
+	KDFCache::PBKDF2( "secret", 32 );
+	CPPUNIT_ASSERT( KDFCache::Size() > 0 );
+	sleep( 2 );
+	CPPUNIT_ASSERT_EQUAL( (size_t) 0, KDFCache::Size() );
+
+	KDFCache::SetLifetime( 0 );
+	KDFCache::PBKDF2( "secret", 32 );
+	CPPUNIT_ASSERT_EQUAL( (size_t) 0, KDFCache::Size() );
+
+	KDFCache::SetLifetime( 300 );
+	KDFCache::SetMaxEntries( 16 );
+	KDFCache::Clear();
+}
@@ -7,11 +7,27 @@ class TestCryptoHelper: public CppUnit::TestFixture
 {
 	CPPUNIT_TEST_SUITE( TestCryptoHelper );
 	CPPUNIT_TEST( TestSelfSigned );
+	CPPUNIT_TEST( TestInMemoryCert );
+	CPPUNIT_TEST( TestAESStream );
+	CPPUNIT_TEST( TestAEAD );
+	CPPUNIT_TEST( TestByteView );
+	CPPUNIT_TEST( TestKeyCache );
+	CPPUNIT_TEST( TestBatch );
+	CPPUNIT_TEST( TestKeyGen );
+	CPPUNIT_TEST( TestKDFCache );
 	CPPUNIT_TEST_SUITE_END();
 public:
 	void setUp();
 	void tearDown();
 	void TestSelfSigned();
+	void TestInMemoryCert();
+	void TestAESStream();
+	void TestAEAD();
+	void TestByteView();
+	void TestKeyCache();
+	void TestBatch();
+	void TestKeyGen();
+	void TestKDFCache();
 };
 
 #endif /* TESTCRYPTOHELPER_H_ */
@@ -4,6 +4,10 @@
 
 #include <utility>
 #include "HttpClient.h"
+#include "DnsServer.h"
+
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace OPI;
 using namespace Utils;
@@ -125,6 +129,31 @@ public:
 		string body = this->DoPost(path, std::move(data));
 		return make_tuple(this->result_code, body);
 	}
+
+	bool Reused()
+	{
+		return this->ConnectionReused();
+	}
+
+	future<HttpMulti::Response> AsyncGet(const string& path, long timeout = 0)
+	{
+		auto result = make_shared<promise<HttpMulti::Response>>();
+		this->DoGetAsync(path, {}, [result](const HttpMulti::Response& res)
+		{
+			result->set_value( res );
+		}, timeout);
+		return result->get_future();
+	}
+
+	HttpMulti::RequestID AsyncGet(const string& path, HttpMulti::Callback cb)
+	{
+		return this->DoGetAsync(path, {}, cb);
+	}
+
+	void Sink(BodySinkPtr sink)
+	{
+		this->CurlSetSink( sink );
+	}
 };
 
 
@@ -172,3 +201,193 @@ void TestHttpClient::TestNoCA()
 
 }
 
+void TestHttpClient::TestReuse()
+{
+	int rc = 0;
+	string data;
+
+	{
+		TestHttp th("https://auth.openproducts.com", false);
+		CPPUNIT_ASSERT_NO_THROW( tie(rc,data) = th.Get("/",{}) );
+		CPPUNIT_ASSERT_EQUAL( 200, rc);
+
+		// Client keeps its connection for its next request
+		CPPUNIT_ASSERT_NO_THROW( tie(rc,data) = th.Get("/",{}) );
+		CPPUNIT_ASSERT_EQUAL( 200, rc);
+		CPPUNIT_ASSERT( th.Reused() );
+	}
+
+	// Connections are not shared between clients, only DNS and TLS sessions
+	{
+		TestHttp th("https://auth.openproducts.com", false);
+		CPPUNIT_ASSERT_NO_THROW( tie(rc,data) = th.Get("/",{}) );
+		CPPUNIT_ASSERT_EQUAL( 200, rc);
+		CPPUNIT_ASSERT( ! th.Reused() );
+	}
+
+	// Not shared, connection still kept for own use
+	{
+		TestHttp th("https://auth.openproducts.com", false);
+		th.setShared( false );
+		CPPUNIT_ASSERT_NO_THROW( tie(rc,data) = th.Get("/",{}) );
+		CPPUNIT_ASSERT( ! th.Reused() );
+
+		// But keeps it for its own next request
+		CPPUNIT_ASSERT_NO_THROW( tie(rc,data) = th.Get("/",{}) );
+		CPPUNIT_ASSERT( th.Reused() );
+	}
+
+	// Without keepalive connection is closed after every request
+	{
+		TestHttp th("https://auth.openproducts.com", false);
+		th.setShared( false );
+		th.setKeepAlive( false );
+		CPPUNIT_ASSERT_NO_THROW( tie(rc,data) = th.Get("/",{}) );
+		CPPUNIT_ASSERT_NO_THROW( tie(rc,data) = th.Get("/",{}) );
+		CPPUNIT_ASSERT( ! th.Reused() );
+	}
+}
+
+void TestHttpClient::TestAsync()
+{
+	vector<future<HttpMulti::Response>> results;
+
+	// Client does not have to outlive its requests
+	{
+		TestHttp th("https://auth.openproducts.com", false);
+		for( int i = 0; i < 10; i++ )
+		{
+			results.push_back( th.AsyncGet("/") );
+		}
+	}
+
+	for( auto& f: results )
+	{
+		HttpMulti::Response res = f.get();
+		CPPUNIT_ASSERT_EQUAL( CURLE_OK, res.result );
+		CPPUNIT_ASSERT_EQUAL( 200L, res.code );
+	}
+
+	// Nothing listens here, connect never completes
+	TestHttp th("http://10.255.255.1", false);
+	HttpMulti::Response res = th.AsyncGet("/", 200).get();
+	CPPUNIT_ASSERT_EQUAL( CURLE_OPERATION_TIMEDOUT, res.result );
+
+	promise<HttpMulti::Response> cancelled;
+	HttpMulti::RequestID id = th.AsyncGet("/", [&cancelled](const HttpMulti::Response& res)
+	{
+		cancelled.set_value( res );
+	});
+	CPPUNIT_ASSERT( HttpMulti::Default().Cancel( id ) );
+	CPPUNIT_ASSERT_EQUAL( CURLE_ABORTED_BY_CALLBACK, cancelled.get_future().get().result );
+	CPPUNIT_ASSERT( ! HttpMulti::Default().Cancel( id ) );
+
+	// Server checks are cancelled through their handle
+	DnsServer dns("http://10.255.255.1/");
+	HttpMulti::Handle<tuple<int, json>> check = dns.CheckOPINameAsync("opi");
+	CPPUNIT_ASSERT( check.multi == &HttpMulti::Default() );
+	CPPUNIT_ASSERT( check.Cancel() );
+	CPPUNIT_ASSERT_THROW( check.result.get(), std::runtime_error );
+	CPPUNIT_ASSERT( ! check.Cancel() );
+
+	// Handle not tied to an engine has nothing to cancel
+	HttpMulti::Handle<int> unbound;
+	CPPUNIT_ASSERT( ! unbound.Cancel() );
+}
+
+void TestHttpClient::TestSinks()
+{
+	int rc = 0;
+	string data, sunk;
+
+	TestHttp th("https://auth.openproducts.com", false);
+	CPPUNIT_ASSERT_NO_THROW( tie(rc,data) = th.Get("/",{}) );
+	CPPUNIT_ASSERT( data.size() > 0 );
+
+	// Body goes to sink, not returned
+	th.Sink( make_shared<CallbackSink>( [&sunk](const char* d, size_t len)
+	{
+		sunk.append( d, len );
+		return true;
+	}));
+	CPPUNIT_ASSERT_NO_THROW( tie(rc,data) = th.Get("/",{}) );
+	CPPUNIT_ASSERT_EQUAL( 200, rc);
+	CPPUNIT_ASSERT( data.empty() );
+	CPPUNIT_ASSERT( sunk.size() > 0 );
+
+	// Sink only used once
+	CPPUNIT_ASSERT_NO_THROW( tie(rc,data) = th.Get("/",{}) );
+	CPPUNIT_ASSERT_EQUAL( sunk.size(), data.size() );
+
+	// Refusing data aborts
+	th.Sink( make_shared<CallbackSink>( [](const char*, size_t){ return false; } ) );
+	CPPUNIT_ASSERT_THROW( th.Get("/",{}), std::runtime_error );
+
+	char path[] = "/tmp/sinkXXXXXX";
+	int fd = mkstemp( path );
+	CPPUNIT_ASSERT( fd >= 0 );
+	auto fs = make_shared<FdSink>( fd );
+	th.Sink( fs );
+	CPPUNIT_ASSERT_NO_THROW( tie(rc,data) = th.Get("/",{}) );
+	close( fd );
+	CPPUNIT_ASSERT_EQUAL( 0, fs->Error() );
+	CPPUNIT_ASSERT_EQUAL( sunk.size(), fs->Written() );
+	CPPUNIT_ASSERT_EQUAL( sunk, File::GetContentAsString( path ) );
+	unlink( path );
+
+	// Small document, parsed when complete
+	{
+		JsonSink js;
+		string doc = R"({"status": "ok", "list": [1,2,3]})";
+		for( char c: doc )
+		{
+			CPPUNIT_ASSERT( js.Write( &c, 1 ) );
+		}
+		js.Finish();
+		CPPUNIT_ASSERT( js.Ok() );
+		CPPUNIT_ASSERT_EQUAL( string("ok"), js.Result()["status"].get<string>() );
+		CPPUNIT_ASSERT_EQUAL( (size_t) 3, js.Result()["list"].size() );
+	}
+
+	// Large document, parsed while written
+	{
+		JsonSink js;
+		nlohmann::json doc = nlohmann::json::array();
+		for( int i = 0; i < 100000; i++ )
+		{
+			doc.push_back( i );
+		}
+		string text = doc.dump();
+		CPPUNIT_ASSERT( text.size() > JsonSink::StreamThreshold );
+		for( size_t pos = 0; pos < text.size(); pos += 1000 )
+		{
+			CPPUNIT_ASSERT( js.Write( text.data() + pos, min( (size_t) 1000, text.size() - pos ) ) );
+		}
+		js.Finish();
+		CPPUNIT_ASSERT( js.Ok() );
+		CPPUNIT_ASSERT( doc == js.Result() );
+	}
+
+	// Truncated document
+	{
+		JsonSink js;
+		CPPUNIT_ASSERT( js.Write( "[1,2,", 5 ) );
+		js.Finish();
+		CPPUNIT_ASSERT( ! js.Ok() );
+		CPPUNIT_ASSERT( ! js.Error().empty() );
+	}
+
+	// Large non JSON body, drained without aborting the transfer
+	{
+		JsonSink js;
+		js.NonBlocking();
+		string junk( 1000, '<' );
+		for( size_t written = 0; written <= 4 * JsonSink::StreamThreshold; written += junk.size() )
+		{
+			CPPUNIT_ASSERT( js.Write( junk.data(), junk.size() ) );
+		}
+		js.Finish();
+		CPPUNIT_ASSERT( ! js.Ok() );
+		CPPUNIT_ASSERT( ! js.Error().empty() );
+	}
+}
@@ -7,11 +7,17 @@ class TestHttpClient: public CppUnit::TestFixture
 {
 	CPPUNIT_TEST_SUITE( TestHttpClient );
 	CPPUNIT_TEST( TestNoCA );
+	CPPUNIT_TEST( TestReuse );
+	CPPUNIT_TEST( TestAsync );
+	CPPUNIT_TEST( TestSinks );
 	CPPUNIT_TEST_SUITE_END();
 public:
 	void setUp();
 	void tearDown();
 	void TestNoCA();
+	void TestReuse();
+	void TestAsync();
+	void TestSinks();
 };
 
 #endif /* TESTHTTPCLIENT_H_ */
@@ -0,0 +1,318 @@
+#include "TestSecop.h"
+
+#include "AsyncSecop.h"
+#include "Secop.h"
+#include "SecopPool.h"
+#include "SecopMockServer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <poll.h>
+
+CPPUNIT_TEST_SUITE_REGISTRATION ( TestSecop );
+
+#define TESTSOCK "/tmp/test-secop"
+
+using namespace OPI;
+
+static unique_ptr<SecopMockServer> server;
+
+void TestSecop::setUp()
+{
+	server.reset( new SecopMockServer( TESTSOCK ) );
+	server->Start();
+}
+
+void TestSecop::tearDown()
+{
+	server.reset();
+}
+
+void TestSecop::TestUsers()
+{
+	Secop s( TESTSOCK );
+
+	CPPUNIT_ASSERT( s.SockAuth() );
+	CPPUNIT_ASSERT_EQUAL( Secop::Authenticated, s.Status() );
+
+	CPPUNIT_ASSERT( s.CreateUser("user", "secret", "A User") );
+	CPPUNIT_ASSERT( ! s.CreateUser("user", "secret") );
+	CPPUNIT_ASSERT_EQUAL( (size_t) 1, s.GetUsers().size() );
+
+	CPPUNIT_ASSERT( s.AddAttribute("user", "email", "user@example.com") );
+	CPPUNIT_ASSERT_EQUAL( string("user@example.com"), s.GetAttribute("user", "email") );
+	CPPUNIT_ASSERT_THROW( s.GetAttribute("user", "phone"), runtime_error );
+	CPPUNIT_ASSERT( s.RemoveAttribute("user", "email") );
+	CPPUNIT_ASSERT_THROW( s.GetAttribute("user", "email"), runtime_error );
+
+	CPPUNIT_ASSERT( s.AddService("user", "mail") );
+	CPPUNIT_ASSERT( s.AddACL("user", "mail", "admin") );
+	CPPUNIT_ASSERT( s.HasACL("user", "mail", "admin") );
+	CPPUNIT_ASSERT( ! s.HasACL("user", "mail", "other") );
+
+	CPPUNIT_ASSERT( s.AddGroup("admins") );
+	CPPUNIT_ASSERT( s.AddGroupMember("admins", "user") );
+	CPPUNIT_ASSERT_EQUAL( string("admins"), s.GetUserGroups("user").front() );
+
+	CPPUNIT_ASSERT( s.RemoveUser("user") );
+	CPPUNIT_ASSERT( s.GetUsers().empty() );
+}
+
+void TestSecop::TestLargeReply()
+{
+	Secop s( TESTSOCK );
+
+	Secop::Batch b;
+	for( int i = 0; i < 2000; i++ )
+	{
+		b.CreateUser( "user-with-a-fairly-long-name-" + to_string( i ), "secret" );
+	}
+	s.Run( b );
+
+	// Reply spans many reads
+	CPPUNIT_ASSERT_EQUAL( (size_t) 2000, s.GetUsers().size() );
+	CPPUNIT_ASSERT_EQUAL( (size_t) 2000, s.GetUsers().size() );
+}
+
+void TestSecop::TestPipelined()
+{
+	Secop s( TESTSOCK );
+
+	CPPUNIT_ASSERT( s.CreateUser("user", "secret") );
+
+	vector<int> order;
+	for( int i = 0; i < 100; i++ )
+	{
+		json cmd;
+		cmd["cmd"] = "addattribute";
+		cmd["username"] = "user";
+		cmd["attribute"] = "attr" + to_string(i);
+		cmd["value"] = to_string(i);
+
+		s.Post( cmd, [&order, i](const json& rep)
+		{
+			if( rep["status"]["value"] == 0 )
+			{
+				order.push_back( i );
+			}
+		});
+	}
+
+	CPPUNIT_ASSERT_EQUAL( (size_t) 100, s.Outstanding() );
+	s.WaitAll();
+	CPPUNIT_ASSERT_EQUAL( (size_t) 0, s.Outstanding() );
+
+	CPPUNIT_ASSERT_EQUAL( (size_t) 100, order.size() );
+	CPPUNIT_ASSERT_EQUAL( 99, order.back() );
+	CPPUNIT_ASSERT_EQUAL( (size_t) 100, s.GetAttributes("user").size() );
+}
+
+void TestSecop::TestBatch()
+{
+	Secop s( TESTSOCK );
+
+	Secop::Batch b;
+	b.CreateUser("user", "secret", "A User")
+		.AddAttribute("user", "email", "user@example.com")
+		.AddService("user", "mail")
+		.AddACL("user", "mail", "admin")
+		.AddGroup("admins")
+		.AddGroupMember("admins", "user")
+		.AddACL("user", "nosuchservice", "admin");
+
+	vector<bool> res = s.Run( b );
+
+	CPPUNIT_ASSERT_EQUAL( (size_t) 7, res.size() );
+	for( size_t i = 0; i < 6; i++ )
+	{
+		CPPUNIT_ASSERT( res[i] );
+	}
+	CPPUNIT_ASSERT( ! res[6] );
+
+	CPPUNIT_ASSERT( s.HasACL("user", "mail", "admin") );
+}
+
+void TestSecop::TestLargeBatch()
+{
+	Secop s( TESTSOCK );
+
+	CPPUNIT_ASSERT( s.CreateUser("user", "secret") );
+
+	// Far more than socket buffers hold, in both directions
+	Secop::Batch b;
+	for( int i = 0; i < 20000; i++ )
+	{
+		b.AddAttribute( "user", "attribute-with-a-fairly-long-name-" + to_string( i ), string( 100, 'v' ) );
+	}
+
+	vector<bool> res = s.Run( b );
+
+	CPPUNIT_ASSERT_EQUAL( (size_t) 20000, res.size() );
+	CPPUNIT_ASSERT( all_of( res.begin(), res.end(), [](bool r){ return r; } ) );
+	CPPUNIT_ASSERT_EQUAL( (size_t) 0, s.Outstanding() );
+	CPPUNIT_ASSERT_EQUAL( (size_t) 20000, s.GetAttributes("user").size() );
+}
+
+void TestSecop::TestCaching()
+{
+	CachingSecop s( 10, chrono::seconds(60), TESTSOCK );
+	Secop other( TESTSOCK );
+
+	CPPUNIT_ASSERT( s.CreateUser("user", "secret") );
+	CPPUNIT_ASSERT( s.AddService("user", "mail") );
+	CPPUNIT_ASSERT( ! s.HasACL("user", "mail", "admin") );
+
+	size_t handled = server->Handled();
+	CPPUNIT_ASSERT( ! s.HasACL("user", "mail", "admin") );
+	CPPUNIT_ASSERT_EQUAL( handled, server->Handled() );
+
+	// Change through same client invalidates
+	CPPUNIT_ASSERT( s.AddACL("user", "mail", "admin") );
+	CPPUNIT_ASSERT( s.HasACL("user", "mail", "admin") );
+
+	// Change by other client is not seen until invalidated
+	CPPUNIT_ASSERT( other.RemoveACL("user", "mail", "admin") );
+	CPPUNIT_ASSERT( s.HasACL("user", "mail", "admin") );
+	s.Invalidate("user");
+	CPPUNIT_ASSERT( ! s.HasACL("user", "mail", "admin") );
+
+	// Removing attribute drops cached value
+	CPPUNIT_ASSERT( s.AddAttribute("user", "email", "user@example.com") );
+	CPPUNIT_ASSERT_EQUAL( string("user@example.com"), s.GetAttribute("user", "email") );
+	CPPUNIT_ASSERT( s.RemoveAttribute("user", "email") );
+	CPPUNIT_ASSERT_THROW( s.GetAttribute("user", "email"), runtime_error );
+}
+
+void TestSecop::TestPool()
+{
+	SecopPool pool( 1, 2, chrono::seconds(60), chrono::seconds(60), []()
+	{
+		return make_shared<Secop>( TESTSOCK );
+	});
+
+	CPPUNIT_ASSERT_EQUAL( (size_t) 1, pool.Size() );
+
+	{
+		SecopPool::Lease a = pool.Get();
+		SecopPool::Lease b = pool.Get();
+		CPPUNIT_ASSERT_EQUAL( (size_t) 2, pool.Size() );
+		CPPUNIT_ASSERT_EQUAL( (size_t) 0, pool.Idle() );
+		CPPUNIT_ASSERT( a->CreateUser("user", "secret") );
+		CPPUNIT_ASSERT_EQUAL( (size_t) 1, b->GetUsers().size() );
+	}
+
+	CPPUNIT_ASSERT_EQUAL( (size_t) 2, pool.Idle() );
+
+	{
+		SecopPool::Lease a = pool.Get();
+		a.Discard();
+	}
+
+	CPPUNIT_ASSERT_EQUAL( (size_t) 1, pool.Size() );
+
+	// Idle connections above min are closed without further use of pool
+	SecopPool shortidle( 1, 3, chrono::seconds(1), chrono::seconds(60), []()
+	{
+		return make_shared<Secop>( TESTSOCK );
+	});
+
+	{
+		SecopPool::Lease a = shortidle.Get();
+		SecopPool::Lease b = shortidle.Get();
+		SecopPool::Lease c = shortidle.Get();
+	}
+	CPPUNIT_ASSERT_EQUAL( (size_t) 3, shortidle.Size() );
+
+	auto deadline = chrono::steady_clock::now() + chrono::seconds(10);
+	while( shortidle.Size() > 1 && chrono::steady_clock::now() < deadline )
+	{
+		this_thread::sleep_for( chrono::milliseconds(50) );
+	}
+	CPPUNIT_ASSERT_EQUAL( (size_t) 1, shortidle.Size() );
+
+	// Destroying pool waits for leases to be returned
+	unique_ptr<SecopPool> leased( new SecopPool( 1, 1, chrono::seconds(60), chrono::seconds(60), []()
+	{
+		return make_shared<Secop>( TESTSOCK );
+	}) );
+	atomic<bool> returned( false );
+	thread user( [lease = leased->Get(), &returned]() mutable
+	{
+		this_thread::sleep_for( chrono::milliseconds(200) );
+		CPPUNIT_ASSERT( lease->Status() != Secop::Unknown );
+		returned = true;
+	});
+	leased.reset();
+	CPPUNIT_ASSERT( returned );
+	user.join();
+}
+
+// Run event loop until all commands are answered
+static void RunAsync(AsyncSecop& as)
+{
+	while( as.Outstanding() > 0 )
+	{
+		struct pollfd pfd = { as.GetFd(), static_cast<short>( POLLIN | ( as.WantWrite() ? POLLOUT : 0 ) ), 0 };
+
+		CPPUNIT_ASSERT( poll( &pfd, 1, 5000 ) > 0 );
+
+		if( pfd.revents & POLLOUT )
+		{
+			CPPUNIT_ASSERT( as.OnWritable() );
+		}
+		if( pfd.revents & POLLIN )
+		{
+			CPPUNIT_ASSERT( as.OnReadable() );
+		}
+	}
+}
+
+void TestSecop::TestAsync()
+{
+	Secop s( TESTSOCK );
+	CPPUNIT_ASSERT( s.CreateUser("user", "secret") );
+	CPPUNIT_ASSERT( s.AddService("user", "mail") );
+	CPPUNIT_ASSERT( s.AddACL("user", "mail", "admin") );
+
+	AsyncSecop as( TESTSOCK );
+
+	int answered = 0;
+	as.SockAuth( [&answered](bool ok)
+	{
+		CPPUNIT_ASSERT( ok );
+		answered++;
+	});
+
+	for( int i = 0; i < 50; i++ )
+	{
+		as.HasACL( "user", "mail", "admin", [&answered](bool ok, bool hasacl)
+		{
+			CPPUNIT_ASSERT( ok && hasacl );
+			answered++;
+		});
+	}
+
+	RunAsync( as );
+
+	CPPUNIT_ASSERT_EQUAL( 51, answered );
+
+	// Failing callback doesn't stop later replies from being dispatched
+	answered = 0;
+	json cmd;
+	cmd["cmd"] = "getusers";
+	as.Call( cmd, [](const json&)
+	{
+		throw runtime_error("callback failed");
+	});
+	as.HasACL( "user", "mail", "admin", [&answered](bool ok, bool hasacl)
+	{
+		CPPUNIT_ASSERT( ok && hasacl );
+		answered++;
+	});
+
+	RunAsync( as );
+
+	CPPUNIT_ASSERT_EQUAL( 1, answered );
+}
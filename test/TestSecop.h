@@ -0,0 +1,31 @@
+#ifndef TESTSECOP_H
+#define TESTSECOP_H
+
+#include <cppunit/extensions/HelperMacros.h>
+
+class TestSecop: public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE( TestSecop );
+	CPPUNIT_TEST( TestUsers );
+	CPPUNIT_TEST( TestLargeReply );
+	CPPUNIT_TEST( TestPipelined );
+	CPPUNIT_TEST( TestBatch );
+	CPPUNIT_TEST( TestLargeBatch );
+	CPPUNIT_TEST( TestCaching );
+	CPPUNIT_TEST( TestPool );
+	CPPUNIT_TEST( TestAsync );
+	CPPUNIT_TEST_SUITE_END();
+public:
+	void setUp();
+	void tearDown();
+	void TestUsers();
+	void TestLargeReply();
+	void TestPipelined();
+	void TestBatch();
+	void TestLargeBatch();
+	void TestCaching();
+	void TestPool();
+	void TestAsync();
+};
+
+#endif // TESTSECOP_H
@@ -2,6 +2,15 @@
 
 #include "SysConfig.h"
 #include <unistd.h>
+#include <libutils/FileUtils.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fstream>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 CPPUNIT_TEST_SUITE_REGISTRATION ( TestSysConfig );
 
@@ -125,3 +134,279 @@ void TestSysConfig::TestList()
 	CPPUNIT_ASSERT_THROW( cfg.GetKeyAsIntList("a","b"), runtime_error);
 	CPPUNIT_ASSERT_THROW( cfg.GetKeyAsBoolList("a","a"), runtime_error);
 }
+
+void TestSysConfig::TestCache()
+{
+	SysConfig wcfg(TESTDB, true);
+	SysConfig rcfg(TESTDB, false);
+
+	CPPUNIT_ASSERT_NO_THROW( wcfg.PutKey("a","b", "c") );
+	CPPUNIT_ASSERT_EQUAL( string("c"), rcfg.GetKeyAsString("a","b") );
+
+	// Change seen by other instance
+	CPPUNIT_ASSERT_NO_THROW( wcfg.PutKey("a","b", "d") );
+	CPPUNIT_ASSERT_EQUAL( string("d"), rcfg.GetKeyAsString("a","b") );
+
+	// File replaced behind our back
+	{
+		ofstream out(TESTDB ".tmp");
+		out << R"({"a":{"b":"external"}})";
+	}
+	CPPUNIT_ASSERT_EQUAL( 0, rename(TESTDB ".tmp", TESTDB) );
+	CPPUNIT_ASSERT_EQUAL( string("external"), rcfg.GetKeyAsString("a","b") );
+	CPPUNIT_ASSERT_EQUAL( string("external"), wcfg.GetKeyAsString("a","b") );
+}
+
+void TestSysConfig::TestAtomicWrite()
+{
+	SysConfig cfg(TESTDB, true);
+	CPPUNIT_ASSERT_NO_THROW( cfg.PutKey("a","b", "c") );
+
+	CPPUNIT_ASSERT_EQUAL( 0, chmod(TESTDB, 0640) );
+
+	struct stat before = {}, after = {};
+	CPPUNIT_ASSERT_EQUAL( 0, stat(TESTDB, &before) );
+
+	CPPUNIT_ASSERT_NO_THROW( cfg.PutKey("a","b", "d") );
+
+	// File should have been replaced, not rewritten in place
+	CPPUNIT_ASSERT_EQUAL( 0, stat(TESTDB, &after) );
+	CPPUNIT_ASSERT( before.st_ino != after.st_ino );
+	CPPUNIT_ASSERT_EQUAL( (mode_t) 0640, after.st_mode & 07777 );
+
+	SysConfig rcfg(string(TESTDB));
+	CPPUNIT_ASSERT_EQUAL( string("d"), rcfg.GetKeyAsString("a","b") );
+}
+
+void TestSysConfig::TestTransaction()
+{
+	SysConfig cfg(TESTDB, true);
+
+	{
+		SysConfig rocfg(TESTDB, false);
+		CPPUNIT_ASSERT_THROW( SysConfig::Transaction tr(rocfg), runtime_error );
+	}
+
+	{
+		SysConfig::Transaction tr(cfg);
+		tr.PutKey("a", "b", "c");
+		tr.PutKey("a", "c", 10);
+		tr.PutKey("b", "d", list<bool>({true,false}) );
+		CPPUNIT_ASSERT( tr.HasKey("a", "c") );
+		tr.Commit();
+
+		CPPUNIT_ASSERT_THROW( tr.PutKey("a", "b", "d"), runtime_error );
+	}
+
+	CPPUNIT_ASSERT_EQUAL( string("c"), cfg.GetKeyAsString("a","b") );
+	CPPUNIT_ASSERT_EQUAL( 10, cfg.GetKeyAsInt("a","c") );
+	CPPUNIT_ASSERT_EQUAL( 2, (int)cfg.GetKeyAsBoolList("b","d").size() );
+
+	{
+		// Not committed, should be rolled back
+		SysConfig::Transaction tr(cfg);
+		tr.PutKey("a", "b", "d");
+		tr.RemoveKey("b", "d");
+		CPPUNIT_ASSERT( ! tr.HasScope("b") );
+	}
+
+	CPPUNIT_ASSERT_EQUAL( string("c"), cfg.GetKeyAsString("a","b") );
+	CPPUNIT_ASSERT( cfg.HasScope("b") );
+
+	{
+		// Reads while locked see database as of transaction start
+		SysConfig::Transaction tr(cfg);
+		tr.PutKey("a", "b", "d");
+
+		// Invalidate cache to force a read of the locked database
+		CPPUNIT_ASSERT_EQUAL( 0, utimes( TESTDB, nullptr ) );
+		CPPUNIT_ASSERT_EQUAL( string("c"), cfg.GetKeyAsString("a","b") );
+		CPPUNIT_ASSERT( cfg.HasKey("b","d") );
+		tr.Commit();
+	}
+
+	CPPUNIT_ASSERT_EQUAL( string("d"), cfg.GetKeyAsString("a","b") );
+}
+
+void TestSysConfig::TestBinaryFormat()
+{
+	{
+		SysConfig cfg(TESTDB, true);
+		CPPUNIT_ASSERT_NO_THROW( cfg.PutKey("a","b", "c") );
+		CPPUNIT_ASSERT_NO_THROW( cfg.PutKey("b","c", list<int>({1,2,3})) );
+		CPPUNIT_ASSERT_EQUAL( '{', Utils::File::GetContentAsString(TESTDB)[0] );
+
+		// Migrate to binary
+		cfg.SetFormat( SysConfig::Binary );
+		{
+			SysConfig::Transaction tr(cfg);
+			tr.Commit();
+		}
+		CPPUNIT_ASSERT_EQUAL( string("OPICFGB1"), Utils::File::GetContentAsString(TESTDB).substr(0,8) );
+	}
+
+	{
+		// Format should be kept when writing using default format
+		SysConfig cfg(TESTDB, true);
+		CPPUNIT_ASSERT_EQUAL( string("c"), cfg.GetKeyAsString("a","b") );
+		CPPUNIT_ASSERT_EQUAL( 3, (int)cfg.GetKeyAsIntList("b","c").size() );
+		CPPUNIT_ASSERT( cfg.HasKey("b","c") );
+		CPPUNIT_ASSERT( ! cfg.HasScope("c") );
+
+		CPPUNIT_ASSERT_NO_THROW( cfg.PutKey("c","d", true) );
+		CPPUNIT_ASSERT_EQUAL( string("OPICFGB1"), Utils::File::GetContentAsString(TESTDB).substr(0,8) );
+	}
+
+	{
+		// And back again
+		SysConfig cfg(TESTDB, true);
+		cfg.SetFormat( SysConfig::Json );
+		CPPUNIT_ASSERT_NO_THROW( cfg.PutKey("a","b", "d") );
+		CPPUNIT_ASSERT_EQUAL( '{', Utils::File::GetContentAsString(TESTDB)[0] );
+		CPPUNIT_ASSERT_EQUAL( string("d"), cfg.GetKeyAsString("a","b") );
+		CPPUNIT_ASSERT_EQUAL( true, cfg.GetKeyAsBool("c","d") );
+	}
+
+	{
+		// Scope name doesn't fit index, nothing should be written
+		SysConfig cfg(TESTDB, true);
+		cfg.SetFormat( SysConfig::Binary );
+		string before = Utils::File::GetContentAsString(TESTDB);
+		CPPUNIT_ASSERT_THROW( cfg.PutKey( string( 70000, 's' ), "k", "v" ), runtime_error );
+		CPPUNIT_ASSERT_EQUAL( before, Utils::File::GetContentAsString(TESTDB) );
+		CPPUNIT_ASSERT_EQUAL( string("d"), cfg.GetKeyAsString("a","b") );
+	}
+}
+
+SYSCONFIG_KEY( TestIntList,	list<int>,	"test",	"intlist" );
+
+void TestSysConfig::TestTypedKeys()
+{
+	SysConfig cfg(TESTDB, true);
+
+	CPPUNIT_ASSERT_THROW( cfg.Get<Keys::Filesystem::StorageMount>(), runtime_error );
+
+	CPPUNIT_ASSERT_NO_THROW( cfg.PutKey("filesystem","storagemount", "/mnt/opi") );
+	CPPUNIT_ASSERT_EQUAL( string("/mnt/opi"), cfg.Get<Keys::Filesystem::StorageMount>() );
+	CPPUNIT_ASSERT_EQUAL( string("/mnt/opi"), cfg.Get<Keys::Filesystem::StorageMount>() );
+
+	// Handle should pick up changes
+	CPPUNIT_ASSERT_NO_THROW( cfg.PutKey("filesystem","storagemount", "/mnt/other") );
+	CPPUNIT_ASSERT_EQUAL( string("/mnt/other"), cfg.Get<Keys::Filesystem::StorageMount>() );
+
+	CPPUNIT_ASSERT_NO_THROW( cfg.PutKey("filesystem","storagemount", 10) );
+	CPPUNIT_ASSERT_THROW( cfg.Get<Keys::Filesystem::StorageMount>(), runtime_error );
+
+	// Lists of ints follow GetKeyAsIntList, floats are rejected
+	CPPUNIT_ASSERT_NO_THROW( cfg.PutKey("test","intlist", list<int>{1,2,3}) );
+	CPPUNIT_ASSERT_EQUAL( (size_t) 3, cfg.Get<TestIntList>().size() );
+
+	Utils::File::Write(TESTDB, R"({"test":{"intlist":[1,2.5,3]}})", 0600);
+	SysConfig floats(TESTDB, true);
+	CPPUNIT_ASSERT_THROW( floats.GetKeyAsIntList("test","intlist"), runtime_error );
+	CPPUNIT_ASSERT_THROW( floats.Get<TestIntList>(), runtime_error );
+}
+
+// Counts callbacks, lets test wait for them without sleeping
+class CallCounter
+{
+public:
+	void Inc()
+	{
+		lock_guard<mutex> l( this->lock );
+		this->calls++;
+		this->cv.notify_all();
+	}
+
+	bool WaitFor(int expected)
+	{
+		unique_lock<mutex> l( this->lock );
+		this->cv.wait_for( l, chrono::seconds(5), [this, expected]{ return this->calls >= expected; } );
+		return this->calls == expected;
+	}
+
+	int Calls()
+	{
+		lock_guard<mutex> l( this->lock );
+		return this->calls;
+	}
+private:
+	mutex lock;
+	condition_variable cv;
+	int calls = 0;
+};
+
+void TestSysConfig::TestWatch()
+{
+	SysConfig cfg(TESTDB, true);
+	CPPUNIT_ASSERT_NO_THROW( cfg.PutKey("a","b", "c") );
+
+	CallCounter calls;
+	int id = cfg.Watch("a", "b", [&calls](const string& scope, const string& key)
+	{
+		if( scope == "a" && key == "b" )
+		{
+			calls.Inc();
+		}
+	});
+
+	// Subscriptions are checked in order, once the later sentinel has
+	// fired all earlier changes have been seen by the first watch
+	CallCounter synced;
+	int syncid = cfg.Watch("sync", "n", [&synced](const string&, const string&)
+	{
+		synced.Inc();
+	});
+	auto sync = [&cfg, &synced]()
+	{
+		int n = synced.Calls() + 1;
+		cfg.PutKey("sync", "n", n );
+		return synced.WaitFor( n );
+	};
+
+	CPPUNIT_ASSERT_NO_THROW( cfg.PutKey("a","b", "d") );
+	CPPUNIT_ASSERT( calls.WaitFor( 1 ) );
+
+	// Other keys and unchanged values should not trigger callback
+	CPPUNIT_ASSERT_NO_THROW( cfg.PutKey("a","c", "d") );
+	CPPUNIT_ASSERT_NO_THROW( cfg.PutKey("a","b", "d") );
+	CPPUNIT_ASSERT( sync() );
+	CPPUNIT_ASSERT_EQUAL( 1, calls.Calls() );
+
+	CPPUNIT_ASSERT_NO_THROW( cfg.RemoveKey("a","b") );
+	CPPUNIT_ASSERT( calls.WaitFor( 2 ) );
+
+	SysConfig::Unwatch( id );
+	CPPUNIT_ASSERT_NO_THROW( cfg.PutKey("a","b", "e") );
+	CPPUNIT_ASSERT( sync() );
+	CPPUNIT_ASSERT_EQUAL( 2, calls.Calls() );
+
+	// Unwatch waits for callback in progress
+	CallCounter started;
+	atomic<bool> finished( false );
+	id = cfg.Watch("a", "b", [&started, &finished](const string&, const string&)
+	{
+		started.Inc();
+		this_thread::sleep_for( chrono::milliseconds(200) );
+		finished = true;
+	});
+	CPPUNIT_ASSERT_NO_THROW( cfg.PutKey("a","b", "f") );
+	CPPUNIT_ASSERT( started.WaitFor( 1 ) );
+	SysConfig::Unwatch( id );
+	CPPUNIT_ASSERT( finished );
+
+	// And doesn't wait for itself
+	CallCounter removed;
+	id = cfg.Watch("a", "b", [&id, &removed](const string&, const string&)
+	{
+		SysConfig::Unwatch( id );
+		removed.Inc();
+	});
+	CPPUNIT_ASSERT_NO_THROW( cfg.PutKey("a","b", "g") );
+	CPPUNIT_ASSERT( removed.WaitFor( 1 ) );
+	CPPUNIT_ASSERT_NO_THROW( cfg.PutKey("a","b", "h") );
+	CPPUNIT_ASSERT( sync() );
+	CPPUNIT_ASSERT_EQUAL( 1, removed.Calls() );
+
+	SysConfig::Unwatch( syncid );
+}
@@ -13,6 +13,12 @@ class TestSysConfig: public CppUnit::TestFixture
 	CPPUNIT_TEST( TestInt );
 	CPPUNIT_TEST( TestBool );
 	CPPUNIT_TEST( TestList );
+	CPPUNIT_TEST( TestCache );
+	CPPUNIT_TEST( TestAtomicWrite );
+	CPPUNIT_TEST( TestTransaction );
+	CPPUNIT_TEST( TestBinaryFormat );
+	CPPUNIT_TEST( TestTypedKeys );
+	CPPUNIT_TEST( TestWatch );
 	CPPUNIT_TEST_SUITE_END();
 public:
 	void setUp();
@@ -23,6 +29,12 @@ public:
 	void TestInt();
 	void TestBool();
 	void TestList();
+	void TestCache();
+	void TestAtomicWrite();
+	void TestTransaction();
+	void TestBinaryFormat();
+	void TestTypedKeys();
+	void TestWatch();
 };
 
 #endif // TESTSYSCONFIG_H